@@ -0,0 +1,916 @@
+/*
+  stmflasher - Open Source ST MCU flash program for *nix
+  Copyright (C) 2010 Geoffrey McRae <geoff@spacevs.com>
+  Copyright (C) 2011 Steve Markgraf <steve@steve-m.de>
+  Copyright (C) 2012 Tormod Volden
+  Copyright (C) 2012-2013 Alatar <alatar_@list.ru>
+
+  This program is free software; you can redistribute it and/or
+  modify it under the terms of the GNU General Public License
+  as published by the Free Software Foundation; either version 2
+  of the License, or (at your option) any later version.
+
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with this program; if not, write to the Free Software
+  Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+*/
+
+/* Bulk flash read/write through a RAM applet: it is loaded above the RAM
+ * the bootloader reserves and started with GO, like the reset code. Write
+ * frames carry up to APPLET_FRAME_MAX bytes and the next one is sent while
+ * the target programs the current one, reads come back in one piece of up
+ * to APPLET_READ_MAX bytes. Both sizes halve after a failure and grow back
+ * with every success, so a noisy line doesn't lose whole kilobytes each time.
+ * The applet talks through USART1, the way the bootloader is usually reached.
+ *
+ * With compression on, a write frame may instead carry an LZ4 block of up to
+ * APPLET_ZBUF_MAX bytes, which the applet unpacks into a staging buffer and
+ * programs from there. Padding and constant tables shrink a lot; data that
+ * doesn't goes out as it is.
+ *
+ * Verification takes a CRC on the target, with the CRC unit where there is
+ * one, so only a few bytes come back unless something is wrong.
+ */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+
+#include "applet.h"
+#include "lz4.h"
+#include "utils.h"
+
+#define APPLET_FRAME_MAX	1024	/* payload of a write frame, less if RAM is short */
+#define APPLET_FRAME_MIN	256
+#define APPLET_READ_MAX		4096	/* bytes of one read request */
+#define APPLET_WINDOW		2	/* write frames on the way, one per receive buffer */
+#define APPLET_TRIES		10	/* attempts of a frame */
+#define APPLET_TIMEOUT		100	/* ms for the reply to a frame, besides wire and round trip time */
+#define APPLET_HELLO_TIMEOUT	200	/* ms for the applet to set up the USART and answer */
+#define APPLET_DRAIN_TIME	50	/* ms of quiet line after a resync burst */
+#define APPLET_BOOT_TIME	20	/* ms from reset until the bootloader listens */
+#define APPLET_STACK		128
+#define APPLET_BAUD_ERROR	2	/* % the USART rate may be off the host rate */
+#define APPLET_BRR		0xFFFFFFFF	/* script value replaced by the baud rate divider */
+#define APPLET_WAIT		1	/* script address flag: wait until the clear bits read as set */
+#define APPLET_SCRIPT_LEN	16
+#define APPLET_PROBATION	250	/* ms a new rate may go without a good frame, at most */
+#define APPLET_SWITCH_TIME	5	/* ms for the applet to switch the clock and rate */
+#define APPLET_CHECK_LEN	1024	/* bytes read to check a new rate */
+#define APPLET_BACK_TRIES	5	/* requests for the startup rate after a failed change */
+#define APPLET_ZBUF_MAX		4096	/* staging buffer for LZ4 blocks, less if RAM is short */
+#define APPLET_PROG_US		80	/* us to program a half-word, at most */
+#define APPLET_CRC_NS		8000	/* ns for a byte of CRC without the CRC unit, at most */
+
+/* Built from applet/stm32_applet.S, see there. ARMv6-M code, the same for
+ * Cortex-M0, M3 and M4.
+ */
+const uint8_t applet_code[] = {
+	0x4a, 0xe0, 0xc0, 0x46, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00,
+	0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00,
+	0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00,
+	0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00,
+	0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00,
+	0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00,
+	0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00,
+	0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x64, 0x10, 0xb7, 0x1d,
+	0xc8, 0x20, 0x6e, 0x3b, 0xac, 0x30, 0xd9, 0x26, 0x90, 0x41, 0xdc, 0x76,
+	0xf4, 0x51, 0x6b, 0x6b, 0x58, 0x61, 0xb2, 0x4d, 0x3c, 0x71, 0x05, 0x50,
+	0x20, 0x83, 0xb8, 0xed, 0x44, 0x93, 0x0f, 0xf0, 0xe8, 0xa3, 0xd6, 0xd6,
+	0x8c, 0xb3, 0x61, 0xcb, 0xb0, 0xc2, 0x64, 0x9b, 0xd4, 0xd2, 0xd3, 0x86,
+	0x78, 0xe2, 0x0a, 0xa0, 0x1c, 0xf2, 0xbd, 0xbd, 0x7f, 0x46, 0x98, 0x3f,
+	0x38, 0x68, 0x85, 0x46, 0x38, 0x46, 0x54, 0x30, 0x83, 0x46, 0x7b, 0x68,
+	0x00, 0xf0, 0x7e, 0xf9, 0xb8, 0x68, 0x00, 0xf0, 0x98, 0xf9, 0xf8, 0x68,
+	0x00, 0xf0, 0x95, 0xf9, 0x7e, 0x6b, 0x00, 0xf0, 0x9b, 0xf9, 0x79, 0x20,
+	0x00, 0xf0, 0xbc, 0xf9, 0x00, 0xf0, 0x9a, 0xf9, 0x78, 0x6c, 0x00, 0x28,
+	0x04, 0xd0, 0xf3, 0x48, 0x00, 0x68, 0x40, 0x0c, 0x00, 0xd3, 0xc2, 0xe0,
+	0xac, 0x42, 0xf3, 0xd1, 0x30, 0x46, 0x08, 0x30, 0x85, 0x42, 0xef, 0xd0,
+	0xb1, 0x46, 0x78, 0x6b, 0x86, 0x42, 0x00, 0xd1, 0xb8, 0x6b, 0x06, 0x46,
+	0x00, 0xf0, 0x80, 0xf9, 0x48, 0x46, 0x41, 0x88, 0xfa, 0x6b, 0x91, 0x42,
+	0x27, 0xd8, 0x07, 0x31, 0x01, 0x30, 0x00, 0xf0, 0xb6, 0xf9, 0x49, 0x46,
+	0x4a, 0x88, 0x08, 0x31, 0x89, 0x18, 0xca, 0x78, 0x12, 0x02, 0x8b, 0x78,
+	0x1a, 0x43, 0x12, 0x02, 0x4b, 0x78, 0x1a, 0x43, 0x12, 0x02, 0x0b, 0x78,
+	0x1a, 0x43, 0x90, 0x42, 0x13, 0xd1, 0x00, 0x21, 0x79, 0x64, 0xdc, 0x48,
+	0x01, 0x60, 0x48, 0x46, 0x41, 0x78, 0x57, 0x29, 0x0f, 0xd0, 0x52, 0x29,
+	0x4b, 0xd0, 0x58, 0x29, 0x70, 0xd0, 0x42, 0x29, 0x77, 0xd0, 0x43, 0x29,
+	0x00, 0xd1, 0xb2, 0xe0, 0x5a, 0x29, 0x00, 0xd1, 0x91, 0xe0, 0x1f, 0x20,
+	0x00, 0xf0, 0x74, 0xf9, 0xb6, 0xe7, 0x41, 0x68, 0x88, 0x46, 0x42, 0x88,
+	0x92, 0x46, 0x08, 0x30, 0x81, 0x46, 0xb8, 0x68, 0x3a, 0x69, 0x91, 0x42,
+	0x00, 0xd3, 0xf8, 0x68, 0x84, 0x46, 0xb9, 0x69, 0x01, 0x61, 0x50, 0x46,
+	0x01, 0x28, 0x1c, 0xd9, 0x02, 0x38, 0x82, 0x46, 0x48, 0x46, 0x00, 0x88,
+	0x41, 0x46, 0x0a, 0x88, 0x90, 0x42, 0x10, 0xd0, 0x08, 0x80, 0x00, 0xf0,
+	0x37, 0xf9, 0x60, 0x46, 0xc1, 0x68, 0xfa, 0x69, 0x11, 0x42, 0xf8, 0xd1,
+	0x3a, 0x6a, 0x11, 0x42, 0x10, 0xd1, 0x48, 0x46, 0x00, 0x88, 0x41, 0x46,
+	0x09, 0x88, 0x88, 0x42, 0x0a, 0xd1, 0x02, 0x20, 0x80, 0x44, 0x81, 0x44,
+	0xdf, 0xe7, 0x00, 0x21, 0x60, 0x46, 0x01, 0x61, 0x79, 0x20, 0x00, 0xf0,
+	0x3f, 0xf9, 0x81, 0xe7, 0x60, 0x46, 0x3a, 0x6a, 0xc2, 0x60, 0x00, 0x21,
+	0x01, 0x61, 0xee, 0x20, 0x00, 0xf0, 0x36, 0xf9, 0x78, 0xe7, 0x41, 0x88,
+	0x04, 0x29, 0xba, 0xd1, 0x41, 0x68, 0x88, 0x46, 0x81, 0x68, 0x8a, 0x46,
+	0x79, 0x20, 0x00, 0xf0, 0x2b, 0xf9, 0x00, 0x23, 0xdb, 0x43, 0x50, 0x46,
+	0x00, 0x28, 0x0c, 0xd0, 0x01, 0x38, 0x82, 0x46, 0x40, 0x46, 0x01, 0x78,
+	0x01, 0x30, 0x80, 0x46, 0x02, 0xb4, 0x00, 0xf0, 0x29, 0xf9, 0x01, 0xbc,
+	0x00, 0xf0, 0x1a, 0xf9, 0xef, 0xe7, 0xdb, 0x43, 0x04, 0x22, 0xd8, 0xb2,
+	0x1b, 0x0a, 0x04, 0xb4, 0x00, 0xf0, 0x12, 0xf9, 0x04, 0xbc, 0x01, 0x3a,
+	0xf7, 0xd1, 0x51, 0xe7, 0x79, 0x20, 0x00, 0xf0, 0x0b, 0xf9, 0x00, 0xf0,
+	0xd6, 0xf8, 0x9d, 0x48, 0x9d, 0x49, 0x01, 0x60, 0xfe, 0xe7, 0x79, 0x20,
+	0x00, 0xf0, 0x02, 0xf9, 0x00, 0xf0, 0xcd, 0xf8, 0x4b, 0x46, 0x08, 0x33,
+	0x00, 0xf0, 0xb2, 0xf8, 0x48, 0x46, 0x41, 0x68, 0x94, 0x48, 0x41, 0x60,
+	0x00, 0x21, 0x81, 0x60, 0x05, 0x21, 0x01, 0x60, 0x01, 0x21, 0x79, 0x64,
+	0x00, 0xf0, 0xcc, 0xf8, 0x32, 0xe7, 0x00, 0x21, 0x79, 0x64, 0x8e, 0x48,
+	0x01, 0x60, 0x7b, 0x68, 0x00, 0xf0, 0x9e, 0xf8, 0x00, 0xf0, 0xc2, 0xf8,
+	0x28, 0xe7, 0x41, 0x88, 0x02, 0x29, 0x19, 0xd3, 0x41, 0x18, 0x08, 0x31,
+	0x88, 0x46, 0x03, 0x46, 0x0a, 0x33, 0xb9, 0x6c, 0x8a, 0x46, 0xfa, 0x6c,
+	0x52, 0x18, 0x94, 0x46, 0x00, 0xf0, 0x39, 0xf8, 0x00, 0x28, 0x0b, 0xd0,
+	0xb9, 0x6c, 0x52, 0x46, 0x52, 0x1a, 0x48, 0x46, 0x03, 0x89, 0x9a, 0x42,
+	0x04, 0xd1, 0x92, 0x46, 0x89, 0x46, 0x41, 0x68, 0x88, 0x46, 0x5a, 0xe7,
+	0x4f, 0xe7, 0x41, 0x88, 0x04, 0x29, 0x25, 0xd1, 0x41, 0x68, 0x88, 0x46,
+	0x82, 0x68, 0x92, 0x46, 0x3b, 0x6d, 0x00, 0x2b, 0x15, 0xd0, 0x11, 0x43,
+	0x89, 0x07, 0x12, 0xd1, 0x01, 0x20, 0x98, 0x60, 0x50, 0x46, 0x00, 0x28,
+	0x0a, 0xd0, 0x04, 0x38, 0x82, 0x46, 0x40, 0x46, 0x01, 0x68, 0x04, 0x30,
+	0x80, 0x46, 0x38, 0x6d, 0x01, 0x60, 0x00, 0xf0, 0x8b, 0xf8, 0xf1, 0xe7,
+	0x3b, 0x6d, 0x1b, 0x68, 0x04, 0xe0, 0x40, 0x46, 0x51, 0x46, 0x00, 0xf0,
+	0xbe, 0xf8, 0x03, 0x46, 0x79, 0x20, 0x00, 0xf0, 0x9f, 0xf8, 0x85, 0xe7,
+	0x25, 0xe7, 0x00, 0xb5, 0x43, 0x45, 0x33, 0xd2, 0x18, 0x78, 0x01, 0x33,
+	0x01, 0xb4, 0x01, 0x09, 0x00, 0xf0, 0x30, 0xf8, 0x58, 0x18, 0x40, 0x45,
+	0x27, 0xd8, 0x50, 0x46, 0x40, 0x18, 0x60, 0x45, 0x23, 0xd8, 0x1a, 0x46,
+	0x00, 0xf0, 0x30, 0xf8, 0x13, 0x46, 0x01, 0xbc, 0x43, 0x45, 0x1f, 0xd2,
+	0x99, 0x1c, 0x41, 0x45, 0x1a, 0xd8, 0x19, 0x78, 0x5a, 0x78, 0x12, 0x02,
+	0x0a, 0x43, 0x02, 0x33, 0x0f, 0x21, 0x01, 0x40, 0x00, 0xf0, 0x16, 0xf8,
+	0x04, 0x31, 0x00, 0x2a, 0x0e, 0xd0, 0xb8, 0x6c, 0x80, 0x18, 0x50, 0x45,
+	0x0a, 0xd8, 0x50, 0x46, 0x40, 0x18, 0x60, 0x45, 0x06, 0xd8, 0x50, 0x46,
+	0x80, 0x1a, 0x02, 0x46, 0x00, 0xf0, 0x10, 0xf8, 0xcc, 0xe7, 0x01, 0xb0,
+	0x00, 0x20, 0x00, 0xbd, 0x01, 0x20, 0x00, 0xbd, 0x0f, 0x29, 0x06, 0xd1,
+	0x43, 0x45, 0x04, 0xd2, 0x18, 0x78, 0x01, 0x33, 0x09, 0x18, 0xff, 0x28,
+	0xf8, 0xd0, 0x70, 0x47, 0x00, 0xb5, 0x00, 0x29, 0x0b, 0xd0, 0x10, 0x78,
+	0x01, 0x32, 0x06, 0xb4, 0x51, 0x46, 0x08, 0x70, 0x01, 0x31, 0x8a, 0x46,
+	0x00, 0xf0, 0x2e, 0xf8, 0x06, 0xbc, 0x01, 0x39, 0xf1, 0xe7, 0x00, 0xbd,
+	0x18, 0x68, 0x00, 0x28, 0x12, 0xd0, 0x41, 0x08, 0x07, 0xd2, 0x01, 0x68,
+	0x5a, 0x68, 0x91, 0x43, 0x9a, 0x68, 0x11, 0x43, 0x01, 0x60, 0x0c, 0x33,
+	0xf2, 0xe7, 0x01, 0x38, 0x01, 0x68, 0x5a, 0x68, 0x11, 0x40, 0x9a, 0x68,
+	0x91, 0x42, 0xf9, 0xd1, 0x0c, 0x33, 0xe9, 0xe7, 0x70, 0x47, 0x78, 0x6a,
+	0x40, 0x22, 0x01, 0x68, 0x11, 0x42, 0xfc, 0xd0, 0x70, 0x47, 0x01, 0x69,
+	0x7a, 0x69, 0x11, 0x42, 0x03, 0xd0, 0x2f, 0x49, 0x41, 0x60, 0x2f, 0x49,
+	0x41, 0x60, 0x70, 0x47, 0x34, 0x46, 0x35, 0x46, 0x08, 0x35, 0x70, 0x47,
+	0x38, 0x6b, 0x08, 0x21, 0x01, 0x60, 0xac, 0x42, 0x19, 0xd2, 0x78, 0x6a,
+	0x01, 0x68, 0x20, 0x22, 0x11, 0x42, 0x14, 0xd0, 0xb8, 0x6a, 0x01, 0x68,
+	0xc9, 0xb2, 0xb4, 0x42, 0x01, 0xd1, 0x5a, 0x29, 0x0d, 0xd1, 0x21, 0x70,
+	0x01, 0x34, 0x30, 0x46, 0x08, 0x30, 0x84, 0x42, 0x07, 0xd1, 0x71, 0x88,
+	0xfa, 0x6b, 0x91, 0x42, 0x00, 0xd9, 0x00, 0x21, 0x40, 0x18, 0x04, 0x30,
+	0x05, 0x46, 0x70, 0x47, 0x08, 0xb5, 0x03, 0x46, 0xff, 0xf7, 0xdc, 0xff,
+	0x78, 0x6a, 0x00, 0x68, 0x80, 0x21, 0x08, 0x42, 0xf8, 0xd0, 0xf8, 0x6a,
+	0x03, 0x60, 0x08, 0xbd, 0x4b, 0x40, 0x59, 0x46, 0x0f, 0x22, 0x1a, 0x40,
+	0x92, 0x00, 0x8a, 0x58, 0x1b, 0x09, 0x53, 0x40, 0x0f, 0x22, 0x1a, 0x40,
+	0x92, 0x00, 0x8a, 0x58, 0x1b, 0x09, 0x53, 0x40, 0x70, 0x47, 0x00, 0xb5,
+	0x80, 0x46, 0x8a, 0x46, 0x00, 0x23, 0xdb, 0x43, 0x50, 0x46, 0x00, 0x28,
+	0x0a, 0xd0, 0x01, 0x38, 0x82, 0x46, 0x40, 0x46, 0x01, 0x78, 0x01, 0x30,
+	0x80, 0x46, 0xff, 0xf7, 0xe1, 0xff, 0xff, 0xf7, 0xb3, 0xff, 0xf1, 0xe7,
+	0xd8, 0x43, 0x00, 0xbd, 0x10, 0xe0, 0x00, 0xe0, 0x0c, 0xed, 0x00, 0xe0,
+	0x04, 0x00, 0xfa, 0x05, 0x23, 0x01, 0x67, 0x45, 0xab, 0x89, 0xef, 0xcd
+};
+
+const unsigned int applet_code_length = sizeof(applet_code);
+
+/* parameter block, see stm32_applet.S */
+enum {
+	P_SP, P_SCRIPT, P_FLASH, P_FLASH2, P_SPLIT, P_LOCK, P_PG, P_BSY, P_ERR,
+	P_ISR, P_RDR, P_TDR, P_ICR, P_BUF0, P_BUF1, P_BUFSZ, P_DUMMY, P_PROBATION,
+	P_ZBUF, P_ZSZ, P_CRC
+};
+
+typedef struct {
+	uint32_t	addr, clear, set;
+} applet_reg_t;
+
+/* What the applet needs to know of a family: the flash interface, USART1
+ * and the register writes which bring the clock back to HSI and set up
+ * USART1 on PA9/PA10 for 8E1 (GO resets the peripherals the bootloader used).
+ * The fast script runs the core from the PLL for rates HSI can't make.
+ */
+typedef struct {
+	uint32_t	hsi;			/* Hz */
+	uint32_t	fast_core, fast_usart;	/* Hz after the fast script, 0 - none */
+	uint32_t	flash, flash2, split;
+	uint32_t	lock, pg, bsy, err;
+	uint32_t	isr, rdr, tdr, icr;	/* icr 0 - none */
+	uint32_t	crc;			/* CRC unit, clocked by the script */
+	applet_reg_t	script[APPLET_SCRIPT_LEN];
+	applet_reg_t	fast[APPLET_SCRIPT_LEN];
+} applet_family_t;
+
+/* F1: FPEC flash interface, USART with SR/DR, 64 MHz from the PLL */
+static const applet_family_t applet_f1 = {
+	8000000, 64000000, 64000000,
+	0x40022000, 0x40022000, 0xFFFFFFFF,
+	0x80, 0x1, 0x1, 0x14,
+	0x40013800, 0x40013804, 0x40013804, 0,
+	0x40023000,
+	{
+		{0x40021004, 0x3FF3, 0},		/* RCC_CFGR: HSI, no prescalers */
+		{0x40021014, 0, 0x40},			/* RCC_AHBENR: CRC */
+		{0x40021018, 0, 0x4005},		/* RCC_APB2ENR: USART1, GPIOA, AFIO */
+		{0x40010804, 0xFF0, 0x4B0},		/* GPIOA_CRH: PA9 AF push-pull, PA10 input */
+		{0x4001380C, 0xFFFFFFFF, 0},		/* USART1_CR1: off */
+		{0x40013808, 0xFFFFFFFF, APPLET_BRR},	/* USART1_BRR */
+		{0x4001380C, 0, 0x340C},		/* USART1_CR1: UE, 9 bits, even parity, TE, RE */
+		{0, 0, 0}
+	},
+	{
+		{0x4001380C, 0xFFFFFFFF, 0},		/* USART1_CR1: off */
+		{0x40021004, 0x3, 0},			/* RCC_CFGR: HSI */
+		{0x40021004 | APPLET_WAIT, 0xC, 0},
+		{0x40021000, 0x01000000, 0},		/* RCC_CR: PLL off */
+		{0x40021000 | APPLET_WAIT, 0x02000000, 0},
+		{0x40022000, 0x7, 0x2},			/* FLASH_ACR: 2 wait states */
+		{0x40021004, 0x3F0700, 0x380400},	/* RCC_CFGR: PLL HSI/2 x16, APB1 /2 */
+		{0x40021000, 0, 0x01000000},		/* RCC_CR: PLL on */
+		{0x40021000 | APPLET_WAIT, 0x02000000, 0x02000000},
+		{0x40021004, 0x3, 0x2},			/* RCC_CFGR: PLL */
+		{0x40021004 | APPLET_WAIT, 0xC, 0x8},
+		{0x40013808, 0xFFFFFFFF, APPLET_BRR},	/* USART1_BRR */
+		{0x4001380C, 0, 0x340C},		/* USART1_CR1: UE, 9 bits, even parity, TE, RE */
+		{0, 0, 0}
+	}
+};
+
+/* F1 value line: 24 MHz parts, HSI only */
+static const applet_family_t applet_f1vl = {
+	8000000, 0, 0,
+	0x40022000, 0x40022000, 0xFFFFFFFF,
+	0x80, 0x1, 0x1, 0x14,
+	0x40013800, 0x40013804, 0x40013804, 0,
+	0x40023000,
+	{
+		{0x40021004, 0x3FF3, 0},
+		{0x40021014, 0, 0x40},
+		{0x40021018, 0, 0x4005},
+		{0x40010804, 0xFF0, 0x4B0},
+		{0x4001380C, 0xFFFFFFFF, 0},
+		{0x40013808, 0xFFFFFFFF, APPLET_BRR},
+		{0x4001380C, 0, 0x340C},
+		{0, 0, 0}
+	},
+	{
+		{0, 0, 0}
+	}
+};
+
+/* F1 XL-density: the second bank has its own registers */
+static const applet_family_t applet_f1xl = {
+	8000000, 64000000, 64000000,
+	0x40022000, 0x40022040, 0x08080000,
+	0x80, 0x1, 0x1, 0x14,
+	0x40013800, 0x40013804, 0x40013804, 0,
+	0x40023000,
+	{
+		{0x40021004, 0x3FF3, 0},
+		{0x40021014, 0, 0x40},
+		{0x40021018, 0, 0x4005},
+		{0x40010804, 0xFF0, 0x4B0},
+		{0x4001380C, 0xFFFFFFFF, 0},
+		{0x40013808, 0xFFFFFFFF, APPLET_BRR},
+		{0x4001380C, 0, 0x340C},
+		{0, 0, 0}
+	},
+	{
+		{0x4001380C, 0xFFFFFFFF, 0},
+		{0x40021004, 0x3, 0},
+		{0x40021004 | APPLET_WAIT, 0xC, 0},
+		{0x40021000, 0x01000000, 0},
+		{0x40021000 | APPLET_WAIT, 0x02000000, 0},
+		{0x40022000, 0x7, 0x2},
+		{0x40021004, 0x3F0700, 0x380400},
+		{0x40021000, 0, 0x01000000},
+		{0x40021000 | APPLET_WAIT, 0x02000000, 0x02000000},
+		{0x40021004, 0x3, 0x2},
+		{0x40021004 | APPLET_WAIT, 0xC, 0x8},
+		{0x40013808, 0xFFFFFFFF, APPLET_BRR},
+		{0x4001380C, 0, 0x340C},
+		{0, 0, 0}
+	}
+};
+
+/* F0: FPEC, USART with ISR/ICR/RDR/TDR, PA9/PA10 on AF1, 48 MHz from the PLL */
+static const applet_family_t applet_f0 = {
+	8000000, 48000000, 48000000,
+	0x40022000, 0x40022000, 0xFFFFFFFF,
+	0x80, 0x1, 0x1, 0x14,
+	0x4001381C, 0x40013824, 0x40013828, 0x40013820,
+	0x40023000,
+	{
+		{0x40021004, 0x07F3, 0},		/* RCC_CFGR: HSI, no prescalers */
+		{0x40021014, 0, 0x20040},		/* RCC_AHBENR: GPIOA, CRC */
+		{0x40021018, 0, 0x4000},		/* RCC_APB2ENR: USART1 */
+		{0x48000000, 0x3C0000, 0x280000},	/* GPIOA_MODER: PA9, PA10 alternate */
+		{0x48000024, 0xFF0, 0x110},		/* GPIOA_AFRH: AF1 */
+		{0x40013800, 0xFFFFFFFF, 0},		/* USART1_CR1: off */
+		{0x4001380C, 0xFFFFFFFF, APPLET_BRR},	/* USART1_BRR */
+		{0x40013800, 0, 0x140D},		/* USART1_CR1: 9 bits, even parity, TE, RE, UE */
+		{0, 0, 0}
+	},
+	{
+		{0x40013800, 0xFFFFFFFF, 0},		/* USART1_CR1: off */
+		{0x40021004, 0x3, 0},			/* RCC_CFGR: HSI */
+		{0x40021004 | APPLET_WAIT, 0xC, 0},
+		{0x40021000, 0x01000000, 0},		/* RCC_CR: PLL off */
+		{0x40021000 | APPLET_WAIT, 0x02000000, 0},
+		{0x40022000, 0x17, 0x11},		/* FLASH_ACR: prefetch, 1 wait state */
+		{0x40021004, 0x3F0700, 0x280000},	/* RCC_CFGR: PLL HSI/2 x12 */
+		{0x40021000, 0, 0x01000000},		/* RCC_CR: PLL on */
+		{0x40021000 | APPLET_WAIT, 0x02000000, 0x02000000},
+		{0x40021004, 0x3, 0x2},			/* RCC_CFGR: PLL */
+		{0x40021004 | APPLET_WAIT, 0xC, 0x8},
+		{0x4001380C, 0xFFFFFFFF, APPLET_BRR},	/* USART1_BRR */
+		{0x40013800, 0, 0x140D},		/* USART1_CR1: 9 bits, even parity, TE, RE, UE */
+		{0, 0, 0}
+	}
+};
+
+/* F3: as F0 with PA9/PA10 on AF7, 64 MHz as F1 */
+static const applet_family_t applet_f3 = {
+	8000000, 64000000, 64000000,
+	0x40022000, 0x40022000, 0xFFFFFFFF,
+	0x80, 0x1, 0x1, 0x14,
+	0x4001381C, 0x40013824, 0x40013828, 0x40013820,
+	0x40023000,
+	{
+		{0x40021004, 0x3FF3, 0},
+		{0x40021014, 0, 0x20040},
+		{0x40021018, 0, 0x4000},
+		{0x48000000, 0x3C0000, 0x280000},
+		{0x48000024, 0xFF0, 0x770},		/* GPIOA_AFRH: AF7 */
+		{0x40013800, 0xFFFFFFFF, 0},
+		{0x4001380C, 0xFFFFFFFF, APPLET_BRR},
+		{0x40013800, 0, 0x140D},
+		{0, 0, 0}
+	},
+	{
+		{0x40013800, 0xFFFFFFFF, 0},		/* USART1_CR1: off */
+		{0x40021004, 0x3, 0},			/* RCC_CFGR: HSI */
+		{0x40021004 | APPLET_WAIT, 0xC, 0},
+		{0x40021000, 0x01000000, 0},		/* RCC_CR: PLL off */
+		{0x40021000 | APPLET_WAIT, 0x02000000, 0},
+		{0x40022000, 0x7, 0x2},
+		{0x40021004, 0x3F0700, 0x380400},
+		{0x40021000, 0, 0x01000000},		/* RCC_CR: PLL on */
+		{0x40021000 | APPLET_WAIT, 0x02000000, 0x02000000},
+		{0x40021004, 0x3, 0x2},			/* RCC_CFGR: PLL */
+		{0x40021004 | APPLET_WAIT, 0xC, 0x8},
+		{0x4001380C, 0xFFFFFFFF, APPLET_BRR},	/* USART1_BRR */
+		{0x40013800, 0, 0x140D},		/* USART1_CR1: 9 bits, even parity, TE, RE, UE */
+		{0, 0, 0}
+	}
+};
+
+/* F2/F4: sector flash interface programmed by half-words (PSIZE x16),
+ * 120 MHz from the PLL with USART1 on 60 MHz APB2
+ */
+static const applet_family_t applet_f4 = {
+	16000000, 120000000, 60000000,
+	0x40023C00, 0x40023C00, 0xFFFFFFFF,
+	0x80000000, 0x101, 0x10000, 0xF0,
+	0x40011000, 0x40011004, 0x40011004, 0,
+	0x40023000,
+	{
+		{0x40023808, 0xFCF3, 0},		/* RCC_CFGR: HSI, no prescalers */
+		{0x40023830, 0, 0x1001},		/* RCC_AHB1ENR: GPIOA, CRC */
+		{0x40023844, 0, 0x10},			/* RCC_APB2ENR: USART1 */
+		{0x40020000, 0x3C0000, 0x280000},	/* GPIOA_MODER: PA9, PA10 alternate */
+		{0x40020024, 0xFF0, 0x770},		/* GPIOA_AFRH: AF7 */
+		{0x4001100C, 0xFFFFFFFF, 0},		/* USART1_CR1: off */
+		{0x40011008, 0xFFFFFFFF, APPLET_BRR},	/* USART1_BRR */
+		{0x4001100C, 0, 0x340C},		/* USART1_CR1: UE, 9 bits, even parity, TE, RE */
+		{0, 0, 0}
+	},
+	{
+		{0x4001100C, 0xFFFFFFFF, 0},		/* USART1_CR1: off */
+		{0x40023808, 0x3, 0},			/* RCC_CFGR: HSI */
+		{0x40023808 | APPLET_WAIT, 0xC, 0},
+		{0x40023800, 0x01000000, 0},		/* RCC_CR: PLL off */
+		{0x40023800 | APPLET_WAIT, 0x02000000, 0},
+		{0x40023804, 0x0F437FFF, 0x05003C10},	/* RCC_PLLCFGR: HSI /16 x240 /2 */
+		{0x40023C00, 0xF, 0x3},			/* FLASH_ACR: 3 wait states */
+		{0x40023808, 0xFCF0, 0x9400},		/* RCC_CFGR: APB1 /4, APB2 /2 */
+		{0x40023800, 0, 0x01000000},		/* RCC_CR: PLL on */
+		{0x40023800 | APPLET_WAIT, 0x02000000, 0x02000000},
+		{0x40023808, 0x3, 0x2},			/* RCC_CFGR: PLL */
+		{0x40023808 | APPLET_WAIT, 0xC, 0x8},
+		{0x40011008, 0xFFFFFFFF, APPLET_BRR},	/* USART1_BRR */
+		{0x4001100C, 0, 0x340C},		/* USART1_CR1: UE, 9 bits, even parity, TE, RE */
+		{0, 0, 0}
+	}
+};
+
+struct applet {
+	stm32_t			*stm;
+	const applet_family_t	*fam;
+	unsigned int		frame;	/* largest payload of a write frame */
+	unsigned int		wlen;	/* payload of the next write frames */
+	unsigned int		rlen;	/* bytes of the next read requests */
+	unsigned int		baud;	/* rate the bootloader was found at */
+	unsigned int		zsz;	/* staging buffer, 0 if there is none */
+	char			compress;
+	applet_stats_t		stats;
+};
+
+/* internal functions */
+const applet_family_t* applet_family(uint16_t pid);
+void    applet_put_u32(uint8_t *p, uint32_t v);
+char    applet_send(applet_t *ap, uint8_t op, uint32_t arg, const uint8_t *payload, unsigned int len);
+int     applet_reply(applet_t *ap, unsigned int timeout);
+unsigned int applet_timeout(const applet_t *ap, unsigned int len, unsigned int prog);
+unsigned int applet_chunk(const applet_t *ap, uint32_t address, unsigned int len, unsigned int max);
+unsigned int applet_pack(applet_t *ap, uint32_t address, const uint8_t data[], unsigned int len, uint8_t frame[], unsigned int *plen);
+char    applet_read_chunk(applet_t *ap, uint32_t address, uint8_t data[], unsigned int len);
+unsigned int applet_resize(unsigned int size, char ok, unsigned int max);
+uint32_t applet_brr(uint32_t clock, unsigned int baud);
+unsigned int applet_script(uint8_t *p, const applet_reg_t *script, uint32_t brr);
+char    applet_check(applet_t *ap);
+uint32_t applet_ticks(uint32_t core);
+
+
+/* the STM32L flash interface (PECR, half-page writes) has no applet yet */
+const applet_family_t* applet_family(uint16_t pid) {
+	switch(pid) {
+		case 0x412: case 0x410: case 0x414: case 0x418:
+			return &applet_f1;
+		case 0x420: case 0x428:
+			return &applet_f1vl;
+		case 0x430:
+			return &applet_f1xl;
+		case 0x440: case 0x444:
+			return &applet_f0;
+		case 0x422: case 0x432:
+			return &applet_f3;
+		case 0x411: case 0x413:
+			return &applet_f4;
+		default:
+			return NULL;
+	}
+}
+
+void applet_put_u32(uint8_t *p, uint32_t v) {
+	uint32_t le = le_u32(v);
+	memcpy(p, &le, sizeof(le));
+}
+
+char applet_send(applet_t *ap, uint8_t op, uint32_t arg, const uint8_t *payload, unsigned int len) {
+	uint8_t frame[1 + 1 + 2 + 4 + APPLET_FRAME_MAX + 4];
+	unsigned int flen = 0;
+
+	frame[flen++] = APPLET_MAGIC;
+	frame[flen++] = op;
+	frame[flen++] = len & 0xFF;
+	frame[flen++] = len >> 8;
+	applet_put_u32(&frame[flen], arg);
+	flen += 4;
+	memcpy(&frame[flen], payload, len);
+	flen += len;
+	applet_put_u32(&frame[flen], crc32_update(0, &frame[1], flen - 1));
+	flen += 4;
+
+	return serial_write(ap->stm->serial, frame, flen) == SERIAL_ERR_OK;
+}
+
+/* reply byte, -1 on timeout */
+int applet_reply(applet_t *ap, unsigned int timeout) {
+	uint8_t byte;
+
+	serial_set_timeout(ap->stm->serial, timeout);
+	if (serial_read(ap->stm->serial, &byte, 1, NULL) != SERIAL_ERR_OK)
+		return -1;
+	return byte;
+}
+
+/* ms to wait for the reply to len bytes sent: they have to go out first and
+ * a full write frame, or prog bytes of it, has to be programmed
+ */
+unsigned int applet_timeout(const applet_t *ap, unsigned int len, unsigned int prog) {
+	return APPLET_TIMEOUT + ap->stm->rtt / 1000 + serial_get_wire_us(ap->stm->serial, len) / 1000 +
+		prog / 2 * APPLET_PROG_US / 1000;
+}
+
+/* bytes of the next write frame, which must not span the two flash banks.
+ * Only the end of the data may be odd, the next frame starts on a half-word.
+ */
+unsigned int applet_chunk(const applet_t *ap, uint32_t address, unsigned int len, unsigned int max) {
+	unsigned int l = len > max ? max : len;
+
+	if (address < ap->fam->split && address + l > ap->fam->split)
+		l = ap->fam->split - address;
+	return l < len ? l & ~1u : l;
+}
+
+/* Payload of the next write frame into frame[], returns the bytes it covers
+ * and sets *plen. The largest block up to the staging buffer which packs
+ * into the frame and saves bytes is sent as 'Z', else the data as 'W'.
+ */
+unsigned int applet_pack(applet_t *ap, uint32_t address, const uint8_t data[], unsigned int len, uint8_t frame[], unsigned int *plen) {
+	uint8_t block[APPLET_ZBUF_MAX + 1];
+	unsigned int l, z;
+
+	if (ap->compress) {
+		for(l = applet_chunk(ap, address, len, ap->zsz); l > 0; l = (l / 2) & ~1u) {
+			memcpy(block, data, l);
+			if (l % 2)
+				block[l] = 0xFF;
+			z = lz4_compress(block, l + l % 2, frame + 2, ap->wlen - 2);
+			if (z && z + 2 < l) {
+				frame[0] = (l + l % 2) & 0xFF;
+				frame[1] = (l + l % 2) >> 8;
+				*plen = z + 2;
+				return l;
+			}
+			/* it won't pack any better below a frame */
+			if (l <= ap->wlen)
+				break;
+		}
+	}
+
+	l = applet_chunk(ap, address, len, ap->wlen);
+	memcpy(frame, data, l);
+	/* the flash is programmed by half-words */
+	if (l % 2)
+		frame[l] = 0xFF;
+	*plen = l + l % 2;
+	return l;
+}
+
+/* double the size after a success, halve it after a failure */
+unsigned int applet_resize(unsigned int size, char ok, unsigned int max) {
+	if (ok)
+		return size * 2 > max ? max : size * 2;
+	return size / 2 < APPLET_FRAME_MIN ? APPLET_FRAME_MIN : size / 2;
+}
+
+/* USART divider for the rate, 0 if it is more than APPLET_BAUD_ERROR off */
+uint32_t applet_brr(uint32_t clock, unsigned int baud) {
+	uint32_t brr = (clock + baud / 2) / baud;
+	uint32_t rate = brr ? clock / brr : 0;
+
+	if (brr < 16 || (rate > baud ? rate - baud : baud - rate) * 100 > baud * APPLET_BAUD_ERROR)
+		return 0;
+	return brr;
+}
+
+/* script as the applet reads it, with its terminator; returns the bytes */
+unsigned int applet_script(uint8_t *p, const applet_reg_t *script, uint32_t brr) {
+	unsigned int i = 0;
+
+	do {
+		applet_put_u32(p    , script[i].addr);
+		applet_put_u32(p + 4, script[i].clear);
+		applet_put_u32(p + 8, script[i].set == APPLET_BRR ? brr : script[i].set);
+		p += 12;
+	} while(script[i++].addr);
+	return 12 * i;
+}
+
+/* SysTick cycles of the trial of a new rate, it has 24 bits */
+uint32_t applet_ticks(uint32_t core) {
+	uint32_t ticks = core / 1000 * APPLET_PROBATION;
+
+	return ticks > 0xFFFFFF ? 0xFFFFFF : ticks;
+}
+
+/* a read of the applet itself goes through at the current rate */
+char applet_check(applet_t *ap) {
+	uint8_t check[APPLET_CHECK_LEN];
+
+	return applet_read_chunk(ap, ap->stm->dev->ram_bl_res + 8, check, sizeof(check));
+}
+
+/* Upload and start the applet, NULL if there is none for the device or it
+ * doesn't answer (then the target is left running it, reset it).
+ */
+applet_t* applet_start(stm32_t *stm) {
+	const applet_family_t *fam = applet_family(stm->pid);
+	unsigned int baud, n, size;
+	uint32_t base, script, buf0, fsize, stack, brr, zsz;
+	uint8_t *image, *p;
+	applet_t *ap;
+
+	if (!fam) {
+		fprintf(stderr, "No RAM applet for %s\n", stm->dev->name);
+		return NULL;
+	}
+
+	/* the applet runs the USART from HSI, its divider must hit the host rate */
+	baud = serial_get_baud_actual(stm->serial);
+	if (!(brr = applet_brr(fam->hsi, baud))) {
+		fprintf(stderr, "The RAM applet can't make %u baud from %u MHz, use a lower rate\n", baud, fam->hsi / 1000000);
+		return NULL;
+	}
+
+	/* code and script above the bootloader's RAM, then the buffers and the stack */
+	for(n = 0; fam->script[n].addr; n++);
+	base   = stm->dev->ram_bl_res;
+	script = (base + 8 + applet_code_length + 3) & ~3;
+	buf0   = script + 12 * (n + 1);
+	for(size = APPLET_FRAME_MAX; size >= APPLET_FRAME_MIN; size /= 2) {
+		fsize = (8 + size + 4 + 3) & ~3;
+		stack = buf0 + 2 * fsize + APPLET_STACK;
+		if (stack <= stm->dev->ram_end)
+			break;
+	}
+	if (size < APPLET_FRAME_MIN) {
+		fprintf(stderr, "Not enough RAM for the applet\n");
+		return NULL;
+	}
+	/* the staging buffer goes above the stack, if there is room */
+	for(zsz = APPLET_ZBUF_MAX; zsz > size && stack + zsz > stm->dev->ram_end; zsz /= 2);
+	if (stack + zsz > stm->dev->ram_end)
+		zsz = 0;
+
+	image = calloc(buf0 - (base + 8), 1);
+	if (!image)
+		return NULL;
+	memcpy(image, applet_code, applet_code_length);
+
+	p = image + APPLET_PARAMS;
+	applet_put_u32(p + 4 * P_SP    , stack);
+	applet_put_u32(p + 4 * P_SCRIPT, script);
+	applet_put_u32(p + 4 * P_FLASH , fam->flash);
+	applet_put_u32(p + 4 * P_FLASH2, fam->flash2);
+	applet_put_u32(p + 4 * P_SPLIT , fam->split);
+	applet_put_u32(p + 4 * P_LOCK  , fam->lock);
+	applet_put_u32(p + 4 * P_PG    , fam->pg);
+	applet_put_u32(p + 4 * P_BSY   , fam->bsy);
+	applet_put_u32(p + 4 * P_ERR   , fam->err);
+	applet_put_u32(p + 4 * P_ISR   , fam->isr);
+	applet_put_u32(p + 4 * P_RDR   , fam->rdr);
+	applet_put_u32(p + 4 * P_TDR   , fam->tdr);
+	/* without an interrupt clear register the applet clears a word of its own */
+	applet_put_u32(p + 4 * P_ICR   , fam->icr ? fam->icr : base + 8 + APPLET_PARAMS + 4 * P_DUMMY);
+	applet_put_u32(p + 4 * P_BUF0  , buf0);
+	applet_put_u32(p + 4 * P_BUF1  , buf0 + fsize);
+	applet_put_u32(p + 4 * P_BUFSZ , size);
+	applet_put_u32(p + 4 * P_ZBUF  , stack);
+	applet_put_u32(p + 4 * P_ZSZ   , zsz);
+	applet_put_u32(p + 4 * P_CRC   , fam->crc);
+
+	applet_script(image + script - (base + 8), fam->script, brr);
+
+	if (!stm32_run_raw_code(stm, base, image, buf0 - (base + 8))) {
+		fprintf(stderr, "Failed to start the RAM applet\n");
+		free(image);
+		return NULL;
+	}
+	free(image);
+
+	ap = calloc(sizeof(applet_t), 1);
+	if (!ap) {
+		fprintf(stderr, "Failed to allocate memory for the RAM applet, reset the target\n");
+		return NULL;
+	}
+	ap->stm   = stm;
+	ap->fam   = fam;
+	ap->frame = size;
+	ap->wlen  = size;
+	ap->rlen  = APPLET_READ_MAX;
+	ap->baud  = serial_get_baud_actual(stm->serial);
+	ap->zsz   = zsz;
+	if (applet_reply(ap, APPLET_HELLO_TIMEOUT) != APPLET_ACK) {
+		fprintf(stderr, "The RAM applet doesn't answer, reset the target\n");
+		free(ap);
+		return NULL;
+	}
+	return ap;
+}
+
+unsigned int applet_frame(const applet_t *ap) {
+	return ap->frame;
+}
+
+/* send LZ4 blocks where they save bytes, 0 if the applet has no room for them */
+char applet_compress(applet_t *ap, char on) {
+	if (on && !ap->zsz)
+		return 0;
+	ap->compress = on;
+	return 1;
+}
+
+const applet_stats_t* applet_stats(const applet_t *ap) {
+	return &ap->stats;
+}
+
+/* Keep up to APPLET_WINDOW frames on the way. After a lost or refused frame
+ * everything from it on is sent again, the applet skips half-words which
+ * already hold the data.
+ */
+char applet_write(applet_t *ap, uint32_t address, const uint8_t data[], unsigned int len) {
+	unsigned int lens[APPLET_WINDOW], plens[APPLET_WINDOW], head = 0, count = 0;
+	unsigned int sent = 0, acked = 0, tries = 0, prog, l, i;
+	uint8_t frame[APPLET_FRAME_MAX];
+	int reply;
+
+	while(acked < len) {
+		while(count < APPLET_WINDOW && sent < len) {
+			i = (head + count) % APPLET_WINDOW;
+			l = applet_pack(ap, address + sent, data + sent, len - sent, frame, &plens[i]);
+			if (!applet_send(ap, plens[i] < l ? APPLET_OP_UNPACK : APPLET_OP_WRITE, address + sent, frame, plens[i]))
+				return 0;
+			lens[i] = l;
+			count++;
+			sent += l;
+		}
+
+		for(prog = 0, i = 0; i < count; i++)
+			prog += lens[(head + i) % APPLET_WINDOW];
+		reply = applet_reply(ap, applet_timeout(ap, count * (12 + ap->wlen), prog));
+		if (reply == APPLET_ACK) {
+			ap->wlen = applet_resize(ap->wlen, 1, ap->frame);
+			ap->stats.data += lens[head];
+			ap->stats.wire += plens[head];
+			if (plens[head] < lens[head])
+				ap->stats.packed++;
+			else
+				ap->stats.raw++;
+			acked += lens[head];
+			head = (head + 1) % APPLET_WINDOW;
+			count--;
+			continue;
+		}
+		if (reply == APPLET_FAIL) {
+			fprintf(stderr, "Applet failed to program flash at 0x%08x\n", address + acked);
+			return 0;
+		}
+		if (++tries == APPLET_TRIES)
+			return 0;
+		ap->wlen = applet_resize(ap->wlen, 0, ap->frame);
+		applet_resync(ap);
+		sent  = acked;
+		count = 0;
+	}
+	return 1;
+}
+
+/* one read request, 0 if anything went wrong */
+char applet_read_chunk(applet_t *ap, uint32_t address, uint8_t data[], unsigned int len) {
+	serial_t *serial = ap->stm->serial;
+	uint8_t arg[4], crc[4], want[4];
+
+	applet_put_u32(arg, len);
+	if (!applet_send(ap, APPLET_OP_READ, address, arg, sizeof(arg)) ||
+	    applet_reply(ap, applet_timeout(ap, 12 + sizeof(arg), 0)) != APPLET_ACK)
+		return 0;
+	/* the serial layer adds the time the bytes take on the wire */
+	if (serial_read(serial, data, len, NULL) != SERIAL_ERR_OK ||
+	    serial_read(serial, crc, sizeof(crc), NULL) != SERIAL_ERR_OK)
+		return 0;
+	applet_put_u32(want, crc32_update(0, data, len));
+	return memcmp(crc, want, sizeof(crc)) == 0;
+}
+
+/* Compare flash with data by a CRC on the target, 1 if they match. 0 when
+ * they don't or the CRC doesn't come through, read back to find out.
+ */
+char applet_verify(applet_t *ap, uint32_t address, const uint8_t data[], unsigned int len) {
+	uint8_t arg[4], crc[4], want[4];
+	unsigned int tries;
+	char unit = ap->fam->crc && !(address % 4) && !(len % 4);
+
+	applet_put_u32(arg, len);
+	applet_put_u32(want, unit ? crc32_unit(data, len) : crc32_update(0, data, len));
+	for(tries = 0; tries < APPLET_TRIES; tries++) {
+		if (applet_send(ap, APPLET_OP_CRC, address, arg, sizeof(arg)) &&
+		    applet_reply(ap, applet_timeout(ap, 12 + sizeof(arg), 0) + (unit ? 0 : len * APPLET_CRC_NS / 1000000)) == APPLET_ACK &&
+		    serial_read(ap->stm->serial, crc, sizeof(crc), NULL) == SERIAL_ERR_OK)
+			return memcmp(crc, want, sizeof(crc)) == 0;
+		applet_resync(ap);
+	}
+	return 0;
+}
+
+char applet_read(applet_t *ap, uint32_t address, uint8_t data[], unsigned int len) {
+	unsigned int l, tries = 0;
+
+	while(len > 0) {
+		l = len > ap->rlen ? ap->rlen : len;
+		if (!applet_read_chunk(ap, address, data, l)) {
+			if (++tries == APPLET_TRIES)
+				return 0;
+			ap->rlen = applet_resize(ap->rlen, 0, APPLET_READ_MAX);
+			applet_resync(ap);
+			continue;
+		}
+		ap->rlen = applet_resize(ap->rlen, 1, APPLET_READ_MAX);
+		address += l;
+		data    += l;
+		len     -= l;
+	}
+	return 1;
+}
+
+/* Move the applet and the port to a rate the bootloader can't do, from HSI
+ * or the PLL. The applet goes back to the old rate by itself unless a good
+ * frame comes in at the new one before SysTick runs out; the port follows.
+ * Return 0 if the old rate is kept.
+ */
+char applet_set_baud(applet_t *ap, unsigned int baud) {
+	const applet_family_t *fam = ap->fam;
+	serial_t *serial = ap->stm->serial;
+	unsigned int old = serial_get_baud_actual(serial);
+	uint8_t payload[12 * APPLET_SCRIPT_LEN];
+	uint32_t brr, core;
+	unsigned int len, i;
+
+	if ((brr = applet_brr(fam->hsi, baud))) {
+		core = fam->hsi;
+		len  = applet_script(payload, fam->script, brr);
+	} else if (fam->fast_core && (brr = applet_brr(fam->fast_usart, baud))) {
+		core = fam->fast_core;
+		len  = applet_script(payload, fam->fast, brr);
+	} else {
+		fprintf(stderr, "The RAM applet can't make %u baud\n", baud);
+		return 0;
+	}
+
+	if (applet_send(ap, APPLET_OP_BAUD, applet_ticks(core), payload, len) &&
+	    applet_reply(ap, applet_timeout(ap, 12 + len, 0)) == APPLET_ACK &&
+	    serial_setup(serial, baud, SERIAL_BITS_8, SERIAL_PARITY_EVEN, SERIAL_STOPBIT_1) == SERIAL_ERR_OK) {
+		sleep_us(APPLET_SWITCH_TIME * 1000);
+		if (applet_check(ap))
+			return 1;
+
+		/* A request may have come through where the reply didn't, then
+		 * the new rate is no longer on trial: ask for the startup rate.
+		 * The applet ends up there either way when its trial runs out.
+		 */
+		len = applet_script(payload, fam->script, applet_brr(fam->hsi, old));
+		for(i = 0; i < APPLET_BACK_TRIES; i++) {
+			applet_resync(ap);
+			if (applet_send(ap, APPLET_OP_BAUD, applet_ticks(fam->hsi), payload, len) &&
+			    applet_reply(ap, applet_timeout(ap, 12 + len, 0)) == APPLET_ACK)
+				break;
+		}
+	}
+
+	sleep_us((APPLET_SWITCH_TIME + 2 * APPLET_PROBATION) * 1000);
+	if (serial_setup(serial, old, SERIAL_BITS_8, SERIAL_PARITY_EVEN, SERIAL_STOPBIT_1) == SERIAL_ERR_OK &&
+	    applet_resync(ap) && applet_check(ap)) {
+		fprintf(stderr, "No link at %u baud, back to %u\n", baud, old);
+		return 0;
+	}
+	fprintf(stderr, "Lost the RAM applet after the rate change, reset the target\n");
+	return 0;
+}
+
+/* Bytes before MAGIC are dropped, so enough 0xFF complete a broken frame
+ * (which gets NACK) and are ignored after it. Then drop the replies.
+ */
+char applet_resync(applet_t *ap) {
+	serial_t *serial = ap->stm->serial;
+	unsigned int len = 8 + ap->frame + 4;
+	uint8_t *burst = malloc(len), byte;
+
+	if (!burst)
+		return 0;
+	memset(burst, 0xFF, len);
+	if (serial_write(serial, burst, len) != SERIAL_ERR_OK) {
+		free(burst);
+		return 0;
+	}
+	free(burst);
+
+	serial_set_timeout(serial, APPLET_DRAIN_TIME + serial_get_wire_us(serial, len) / 1000);
+	while(serial_read(serial, &byte, 1, NULL) == SERIAL_ERR_OK);
+	return 1;
+}
+
+/* reset the chip from the applet and INIT the bootloader again, frees ap */
+char applet_stop(applet_t *ap) {
+	stm32_t *stm = ap->stm;
+	unsigned int tries;
+	char ret;
+
+	/* replies to frames a failed transfer gave up on may still come */
+	applet_resync(ap);
+	for(tries = 0; ; tries++) {
+		if (applet_send(ap, APPLET_OP_RESET, 0, NULL, 0) &&
+		    applet_reply(ap, applet_timeout(ap, 12, 0)) == APPLET_ACK)
+			break;
+		if (tries == APPLET_TRIES) {
+			fprintf(stderr, "The RAM applet doesn't answer the reset\n");
+			break;
+		}
+		applet_resync(ap);
+	}
+
+	/* the bootloader measures the rate it was found at again */
+	if (serial_get_baud_actual(stm->serial) != ap->baud &&
+	    serial_setup(stm->serial, ap->baud, SERIAL_BITS_8, SERIAL_PARITY_EVEN, SERIAL_STOPBIT_1) != SERIAL_ERR_OK)
+		fprintf(stderr, "Can't set the port back to %u baud\n", ap->baud);
+	free(ap);
+
+	sleep_us(APPLET_BOOT_TIME * 1000);
+	serial_flush(stm->serial);
+	ret = stm32_probe(stm->serial, 5);
+	if (!ret)
+		fprintf(stderr, "No bootloader after the RAM applet, reset the target\n");
+	return ret;
+}
@@ -0,0 +1,88 @@
+/*
+  stmflasher - Open Source ST MCU flash program for *nix
+  Copyright (C) 2010 Geoffrey McRae <geoff@spacevs.com>
+  Copyright (C) 2011 Steve Markgraf <steve@steve-m.de>
+  Copyright (C) 2012 Tormod Volden
+  Copyright (C) 2012-2013 Alatar <alatar_@list.ru>
+
+  This program is free software; you can redistribute it and/or
+  modify it under the terms of the GNU General Public License
+  as published by the Free Software Foundation; either version 2
+  of the License, or (at your option) any later version.
+
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with this program; if not, write to the Free Software
+  Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+*/
+
+
+#ifndef _H_APPLET
+#define _H_APPLET
+
+#include <stdint.h>
+#include "stm32.h"
+
+/* RAM applet protocol, frames from the host:
+ *   MAGIC, op, payload length (2, LE), argument (4, LE), payload, CRC-32 (4, LE)
+ * the CRC covers everything between MAGIC and itself. Replies:
+ *   'W' program the payload at the argument address: ACK, NACK or FAIL
+ *   'R' read as many bytes as the 4 byte payload says from the argument
+ *       address: ACK, the data and its CRC-32, or NACK
+ *   'X' ACK and reset the chip
+ *   'Z' as 'W' with the payload an LZ4 block (see lz4.h) after its unpacked
+ *       length (2, LE), NACK if it doesn't unpack to that length
+ *   'C' ACK and the CRC of as many bytes as the 4 byte payload says from the
+ *       argument address (4, LE): crc32_unit() if the part has a CRC unit
+ *       and both are word aligned, else crc32_update(), or NACK
+ *   'B' ACK, run the register script in the payload and put the new rate
+ *       on trial for as many SysTick cycles as the argument says
+ * Bytes before MAGIC are dropped, so a burst of 0xFF resynchronises.
+ */
+#define APPLET_MAGIC	0x5A
+#define APPLET_ACK	0x79
+#define APPLET_NACK	0x1F
+#define APPLET_FAIL	0xEE	/* flash interface error */
+
+#define APPLET_OP_WRITE	'W'
+#define APPLET_OP_READ	'R'
+#define APPLET_OP_RESET	'X'
+#define APPLET_OP_BAUD	'B'
+#define APPLET_OP_UNPACK	'Z'
+#define APPLET_OP_CRC	'C'
+
+/* the parameter block follows the first instruction of applet_code[] */
+#define APPLET_PARAMS		4
+#define APPLET_PARAMS_LEN	84
+#define APPLET_P_BUFSZ		60	/* largest payload */
+#define APPLET_P_ZSZ		76	/* bytes a 'Z' block may unpack to */
+#define APPLET_P_CRC		80	/* CRC unit, 0 - none */
+
+extern const uint8_t		applet_code[];
+extern const unsigned int	applet_code_length;
+
+typedef struct applet applet_t;
+
+typedef struct {
+	unsigned long	data;	/* bytes written */
+	unsigned long	wire;	/* payload bytes sent for them */
+	unsigned int	packed;	/* frames sent as LZ4 blocks */
+	unsigned int	raw;	/* frames sent as they are */
+} applet_stats_t;
+
+applet_t*    applet_start (stm32_t *stm);
+unsigned int applet_frame (const applet_t *ap);
+char         applet_write (applet_t *ap, uint32_t address, const uint8_t data[], unsigned int len);
+char         applet_read  (applet_t *ap, uint32_t address, uint8_t data[], unsigned int len);
+char         applet_verify(applet_t *ap, uint32_t address, const uint8_t data[], unsigned int len);
+char         applet_resync(applet_t *ap);
+char         applet_set_baud(applet_t *ap, unsigned int baud);
+char         applet_compress(applet_t *ap, char on);
+const applet_stats_t* applet_stats(const applet_t *ap);
+char         applet_stop  (applet_t *ap);
+
+#endif
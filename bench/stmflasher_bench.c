@@ -0,0 +1,406 @@
+/*
+  stmflasher - Open Source ST MCU flash program for *nix
+  Copyright (C) 2010 Geoffrey McRae <geoff@spacevs.com>
+  Copyright (C) 2011 Steve Markgraf <steve@steve-m.de>
+  Copyright (C) 2012 Tormod Volden
+  Copyright (C) 2012-2013 Alatar <alatar_@list.ru>
+
+  This program is free software; you can redistribute it and/or
+  modify it under the terms of the GNU General Public License
+  as published by the Free Software Foundation; either version 2
+  of the License, or (at your option) any later version.
+
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with this program; if not, write to the Free Software
+  Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+*/
+
+/* stmflasher_bench - end to end throughput of stmflasher against stm32sim.
+ *
+ * Every point of the matrix (image size x image format x baud rate x link
+ * latency x framing mode) starts a fresh simulator and runs the real
+ * stmflasher binary on it, so the whole main.c write loop with erase, write
+ * and verify is measured. One CSV line is printed per run.
+ */
+
+#define _GNU_SOURCE
+#include <sys/types.h>
+#include <sys/wait.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <signal.h>
+#include <libgen.h>
+
+#include "utils.h"
+
+#define BENCH_MAX_LIST	16
+
+typedef enum {
+	FMT_BIN,	/* raw binary */
+	FMT_DENSE,	/* Intel HEX, every byte present */
+	FMT_SPARSE	/* Intel HEX, last 1 KiB of every 4 KiB present */
+} bench_fmt_t;
+
+static const char *fmt_names[] = {"bin", "dense", "sparse"};
+
+typedef enum {
+	MODE_LOCKSTEP,	/* wait for every ACK */
+	MODE_DEFERRED	/* -A, ACKs of a read/write checked together */
+} bench_mode_t;
+
+static const char *mode_names[] = {"lockstep", "deferred"};
+
+typedef struct {
+	unsigned long	written;
+	unsigned long	tx_calls, rx_calls, turns;
+	double		write_bps;
+} bench_result_t;
+
+/* settings */
+static unsigned int	sizes[BENCH_MAX_LIST]	 = {16, 64, 256, 1024};
+static unsigned int	n_sizes			 = 4;
+static unsigned int	fmts[BENCH_MAX_LIST]	 = {FMT_DENSE, FMT_SPARSE};
+static unsigned int	n_fmts			 = 2;
+static unsigned int	bauds[BENCH_MAX_LIST]	 = {115200, 921600};
+static unsigned int	n_bauds			 = 2;
+static unsigned int	latencies[BENCH_MAX_LIST]= {0, 1000};
+static unsigned int	n_latencies		 = 2;
+static unsigned int	modes[BENCH_MAX_LIST]	 = {MODE_LOCKSTEP, MODE_DEFERRED};
+static unsigned int	n_modes			 = 2;
+static const char	*device_id		 = "430";
+static const char	*bl_version		 = "31";
+static const char	*tag			 = "-";
+static const char	*bin_dir		 = NULL;
+static char		verify			 = 0;
+
+static char		tmp_dir[]		 = "/tmp/stmbenchXXXXXX";
+
+static void show_help(char *name);
+
+/* comma separated list of numbers, return the count or 0 on error */
+static unsigned int parse_list(const char *str, unsigned int *list) {
+	unsigned int n = 0;
+	char *end;
+
+	while(*str && n < BENCH_MAX_LIST) {
+		list[n++] = strtoul(str, &end, 0);
+		if (end == str || (*end != ',' && *end != 0))
+			return 0;
+		str = *end ? end + 1 : end;
+	}
+	return n;
+}
+
+/* comma separated list of names, return the count or 0 on error */
+static unsigned int parse_names(const char *str, const char **names, unsigned int n_names, unsigned int *list) {
+	unsigned int n = 0, i;
+	size_t len;
+
+	while(*str && n < BENCH_MAX_LIST) {
+		len = strcspn(str, ",");
+		for(i = 0; i < n_names; i++)
+			if (strlen(names[i]) == len && strncmp(str, names[i], len) == 0)
+				break;
+		if (i == n_names)
+			return 0;
+		list[n++] = i;
+		str += len;
+		if (*str) str++;
+	}
+	return n;
+}
+
+static void hex_record(FILE *f, uint8_t type, uint16_t address, const uint8_t *data, unsigned int len) {
+	uint8_t cs = len + (address >> 8) + (address & 0xFF) + type;
+	unsigned int i;
+
+	fprintf(f, ":%02X%04X%02X", len, address, type);
+	for(i = 0; i < len; i++) {
+		fprintf(f, "%02X", data[i]);
+		cs += data[i];
+	}
+	fprintf(f, "%02X\n", (uint8_t)-cs);
+}
+
+/* image of size bytes at the start of flash */
+static int make_image(const char *name, bench_fmt_t fmt, unsigned int size) {
+	FILE *f = fopen(name, "w");
+	uint32_t seed = size;
+	uint32_t addr;
+	uint8_t data[16];
+	unsigned int i;
+
+	if (!f)
+		return 0;
+
+	for(addr = 0; addr < size; addr += sizeof(data)) {
+		for(i = 0; i < sizeof(data); i++) {
+			seed = seed * 1103515245 + 12345;
+			data[i] = seed >> 16;
+		}
+
+		if (fmt == FMT_BIN) {
+			fwrite(data, 1, sizeof(data), f);
+			continue;
+		}
+		if (addr % 0x10000 == 0) {
+			uint8_t ela[2] = {0x08, addr >> 16};
+			hex_record(f, 4, 0, ela, 2);
+		}
+		/* the parser fills the gaps with 0xFF */
+		if (fmt == FMT_SPARSE && addr % 4096 < 3072)
+			continue;
+		hex_record(f, 0, addr & 0xFFFF, data, sizeof(data));
+	}
+	if (fmt != FMT_BIN)
+		hex_record(f, 1, 0, NULL, 0);
+
+	return fclose(f) == 0;
+}
+
+/* start the simulator, return its pid once the pty is there */
+static pid_t start_sim(const char *link, unsigned int baud, unsigned int latency) {
+	char path[1024], baud_s[16], lat_s[16], line[256];
+	int fds[2];
+	pid_t pid;
+	FILE *f;
+
+	snprintf(path, sizeof(path), "%s/stm32sim", bin_dir);
+	snprintf(baud_s, sizeof(baud_s), "%u", baud);
+	snprintf(lat_s, sizeof(lat_s), "%u", latency);
+
+	if (pipe(fds) != 0)
+		return -1;
+	pid = fork();
+	if (pid == 0) {
+		dup2(fds[1], 1);
+		close(fds[0]);
+		execl(path, path, "-d", device_id, "-V", bl_version, "-b", baud_s, "-L", lat_s,
+			"-l", link, (char*)NULL);
+		perror(path);
+		_exit(1);
+	}
+	close(fds[1]);
+
+	/* the simulator prints the pty name when it is ready */
+	f = fdopen(fds[0], "r");
+	if (pid < 0 || !fgets(line, sizeof(line), f)) {
+		fclose(f);
+		return -1;
+	}
+	fclose(f);
+	return pid;
+}
+
+/* run stmflasher and collect the statistics it prints with -V2 */
+static int run_flasher(const char *link, const char *image, unsigned int baud, bench_mode_t mode, bench_result_t *res) {
+	char path[1024], baud_s[16], line[256];
+	const char *argv[16];
+	int argc = 0, fds[2], status;
+	pid_t pid;
+	FILE *f;
+
+	snprintf(path, sizeof(path), "%s/stmflasher", bin_dir);
+	snprintf(baud_s, sizeof(baud_s), "%u", baud);
+	argv[argc++] = path;
+	argv[argc++] = "-p";
+	argv[argc++] = link;
+	argv[argc++] = "-b";
+	argv[argc++] = baud_s;
+	argv[argc++] = "-w";
+	argv[argc++] = image;
+	argv[argc++] = "-K";
+	argv[argc++] = "-V2";
+	if (verify)
+		argv[argc++] = "-v";
+	if (mode == MODE_DEFERRED)
+		argv[argc++] = "-A";
+	argv[argc] = NULL;
+
+	if (pipe(fds) != 0)
+		return -1;
+	pid = fork();
+	if (pid == 0) {
+		dup2(fds[1], 1);
+		close(fds[0]);
+		execv(path, (char * const *)argv);
+		perror(path);
+		_exit(1);
+	}
+	close(fds[1]);
+
+	memset(res, 0, sizeof(*res));
+	f = fdopen(fds[0], "r");
+	while(fgets(line, sizeof(line), f)) {
+		char *p;
+		if ((p = strstr(line, "Wrote ")) && strstr(p, "B/s)")) {
+			sscanf(p, "Wrote %lu bytes", &res->written);
+			if ((p = strchr(p, '(')))
+				res->write_bps = strtod(p + 1, NULL);
+		}
+		sscanf(line, "Serial writes : %lu", &res->tx_calls);
+		sscanf(line, "Serial reads  : %lu", &res->rx_calls);
+		sscanf(line, "Round trips   : %lu", &res->turns);
+	}
+	fclose(f);
+
+	if (pid < 0 || waitpid(pid, &status, 0) != pid || !WIFEXITED(status))
+		return -1;
+	return WEXITSTATUS(status);
+}
+
+static void bench_one(unsigned int size_kib, bench_fmt_t fmt, unsigned int baud, unsigned int latency, bench_mode_t mode) {
+	char link[256], image[256];
+	bench_result_t res;
+	uint64_t t;
+	double wall, kib;
+	unsigned int payload;
+	pid_t sim;
+	int ret;
+
+	snprintf(link, sizeof(link), "%s/tty", tmp_dir);
+	snprintf(image, sizeof(image), "%s/image.%s", tmp_dir, fmt == FMT_BIN ? "bin" : "hex");
+	payload = fmt == FMT_SPARSE ? size_kib * 256 : size_kib * 1024;
+
+	if (!make_image(image, fmt, size_kib * 1024)) {
+		perror(image);
+		return;
+	}
+	sim = start_sim(link, baud, latency);
+	if (sim < 0) {
+		fprintf(stderr, "Failed to start the simulator\n");
+		return;
+	}
+
+	t   = now_us();
+	ret = run_flasher(link, image, baud, mode, &res);
+	t   = now_us() - t;
+
+	kill(sim, SIGTERM);
+	waitpid(sim, NULL, 0);
+	unlink(image);
+
+	wall = t / 1e6;
+	kib  = payload / 1024.0;
+	printf("%s,%u,%s,%u,%u,%s,%u,%lu,%.3f,%.0f,%.0f,%.2f,%.2f,%d\n",
+		tag, size_kib, fmt_names[fmt], baud, latency, mode_names[mode],
+		payload, res.written, wall,
+		payload / wall, res.write_bps,
+		res.turns / kib, (res.tx_calls + res.rx_calls) / kib,
+		ret
+	);
+	fflush(stdout);
+}
+
+int main(int argc, char *argv[]) {
+	unsigned int s, f, b, l, m;
+	int c;
+
+	while((c = getopt(argc, argv, "s:f:b:L:m:d:V:t:B:vh")) != -1) {
+		switch(c) {
+			case 's':
+				if (!(n_sizes = parse_list(optarg, sizes))) {
+					fprintf(stderr, "ERROR: Invalid size list\n");
+					return 1;
+				}
+				break;
+			case 'f':
+				if (!(n_fmts = parse_names(optarg, fmt_names, 3, fmts))) {
+					fprintf(stderr, "ERROR: Invalid format list\n");
+					return 1;
+				}
+				break;
+			case 'b':
+				if (!(n_bauds = parse_list(optarg, bauds))) {
+					fprintf(stderr, "ERROR: Invalid baud rate list\n");
+					return 1;
+				}
+				break;
+			case 'L':
+				if (!(n_latencies = parse_list(optarg, latencies))) {
+					fprintf(stderr, "ERROR: Invalid latency list\n");
+					return 1;
+				}
+				break;
+			case 'm':
+				if (!(n_modes = parse_names(optarg, mode_names, 2, modes))) {
+					fprintf(stderr, "ERROR: Invalid framing mode list\n");
+					return 1;
+				}
+				break;
+			case 'd':
+				device_id = optarg;
+				break;
+			case 'V':
+				bl_version = optarg;
+				break;
+			case 't':
+				tag = optarg;
+				break;
+			case 'B':
+				bin_dir = optarg;
+				break;
+			case 'v':
+				verify = 1;
+				break;
+			case 'h':
+				show_help(argv[0]);
+				return 0;
+			default:
+				show_help(argv[0]);
+				return 1;
+		}
+	}
+
+	/* stmflasher and stm32sim are built next to the benchmark */
+	if (!bin_dir)
+		bin_dir = dirname(strdup(argv[0]));
+	if (!mkdtemp(tmp_dir)) {
+		perror(tmp_dir);
+		return 1;
+	}
+
+	printf("tag,size_kib,format,baud,latency_us,mode,payload_bytes,written_bytes,wall_s,"
+		"bytes_per_s,write_bytes_per_s,round_trips_per_kib,syscalls_per_kib,exit\n");
+	for(s = 0; s < n_sizes; s++)
+		for(f = 0; f < n_fmts; f++)
+			for(b = 0; b < n_bauds; b++)
+				for(l = 0; l < n_latencies; l++)
+					for(m = 0; m < n_modes; m++)
+						bench_one(sizes[s], fmts[f], bauds[b], latencies[l], modes[m]);
+
+	rmdir(tmp_dir);
+	return 0;
+}
+
+static void show_help(char *name) {
+	fprintf(stderr,
+		"Usage: %s [-s sizes] [-f formats] [-b rates] [-L latencies] [-m modes] [-d id] [-V version]\n"
+		"	[-t tag] [-B dir] [-vh]\n"
+		"\n"
+		"	-s sizes	Image sizes in KiB (default 16,64,256,1024)\n"
+		"	-f formats	Image formats: bin, dense, sparse (default dense,sparse)\n"
+		"			sparse has data in the last 1 KiB of every 4 KiB\n"
+		"	-b rates	Baud rates (default 115200,921600)\n"
+		"	-L latencies	Link latencies in us, per turn of the line (default 0,1000)\n"
+		"	-m modes	Framing: lockstep, deferred (-A) (default lockstep,deferred)\n"
+		"	-d id		Simulated device ID (default 430, 1 MiB of flash)\n"
+		"	-V version	Simulated bootloader version (default 31)\n"
+		"	-t tag		Text for the first column, e.g. the version under test\n"
+		"	-B dir		Directory of stmflasher and stm32sim (default: next to %s)\n"
+		"	-v		Verify writes\n"
+		"	-h		Show this help\n"
+		"\n"
+		"Prints one CSV line per run: bytes_per_s is the image payload over the\n"
+		"whole run wall time, write_bytes_per_s is the write loop goodput.\n",
+		name, name
+	);
+}
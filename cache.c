@@ -0,0 +1,168 @@
+/*
+  stmflasher - Open Source ST MCU flash program for *nix
+  Copyright (C) 2010 Geoffrey McRae <geoff@spacevs.com>
+  Copyright (C) 2011 Steve Markgraf <steve@steve-m.de>
+  Copyright (C) 2012 Tormod Volden
+  Copyright (C) 2012-2013 Alatar <alatar_@list.ru>
+
+  This program is free software; you can redistribute it and/or
+  modify it under the terms of the GNU General Public License
+  as published by the Free Software Foundation; either version 2
+  of the License, or (at your option) any later version.
+
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with this program; if not, write to the Free Software
+  Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "cache.h"
+
+struct cache {
+	char		*file;
+	cache_entry_t	*e;
+	unsigned int	count, size;
+};
+
+/* internal functions */
+char cache_parse_uid(const char *hex, uint8_t uid[]);
+char cache_append(cache_t *c, const cache_entry_t *e);
+
+
+char cache_parse_uid(const char *hex, uint8_t uid[]) {
+	unsigned int i, b;
+
+	if (strlen(hex) != 2 * STM32_UID_LEN)
+		return 0;
+	for(i = 0; i < STM32_UID_LEN; i++) {
+		if (sscanf(hex + 2 * i, "%2x", &b) != 1)
+			return 0;
+		uid[i] = b;
+	}
+	return 1;
+}
+
+/* a file that isn't there yet is an empty cache */
+cache_t* cache_load(const char *file) {
+	cache_t *c;
+	cache_entry_t e;
+	char line[128], hex[2 * STM32_UID_LEN + 1];
+	unsigned int page, n = 0;
+	FILE *f;
+
+	c = calloc(1, sizeof(cache_t));
+	if (!c || !(c->file = strdup(file))) {
+		free(c);
+		return NULL;
+	}
+	if (!(f = fopen(file, "r")))
+		return c;
+	while(fgets(line, sizeof(line), f)) {
+		n++;
+		if (line[0] == '#' || line[0] == '\n')
+			continue;
+		if (sscanf(line, "%24s %u %x %x %x", hex, &page, &e.address, &e.len, &e.crc) != 5 ||
+		    !cache_parse_uid(hex, e.uid) || page >= CACHE_ALL) {
+			fprintf(stderr, "%s:%u: invalid cache entry\n", file, n);
+			break;
+		}
+		e.page = page;
+		if (!cache_append(c, &e))
+			break;
+	}
+	if (ferror(f) || !feof(f)) {
+		fclose(f);
+		cache_free(c);
+		return NULL;
+	}
+	fclose(f);
+	return c;
+}
+
+const cache_entry_t* cache_find(const cache_t *c, const uint8_t uid[], unsigned int page) {
+	unsigned int i;
+
+	for(i = 0; i < c->count; i++)
+		if (c->e[i].page == page && memcmp(c->e[i].uid, uid, STM32_UID_LEN) == 0)
+			return &c->e[i];
+	return NULL;
+}
+
+void cache_forget(cache_t *c, const uint8_t uid[], unsigned int page) {
+	unsigned int i, n;
+
+	for(i = n = 0; i < c->count; i++)
+		if (memcmp(c->e[i].uid, uid, STM32_UID_LEN) != 0 || (page != CACHE_ALL && c->e[i].page != page))
+			c->e[n++] = c->e[i];
+	c->count = n;
+}
+
+char cache_append(cache_t *c, const cache_entry_t *e) {
+	cache_entry_t *grown;
+
+	if (c->count == c->size) {
+		grown = realloc(c->e, (c->size + 256) * sizeof(cache_entry_t));
+		if (!grown) {
+			fprintf(stderr, "Failed to allocate memory for the cache\n");
+			return 0;
+		}
+		c->e     = grown;
+		c->size += 256;
+	}
+	c->e[c->count++] = *e;
+	return 1;
+}
+
+/* replaces what the cache has for the page */
+char cache_add(cache_t *c, const cache_entry_t *e) {
+	cache_forget(c, e->uid, e->page);
+	return cache_append(c, e);
+}
+
+/* to a new file first, a write cut short leaves the old one */
+char cache_save(const cache_t *c) {
+	char tmp[strlen(c->file) + 5];
+	unsigned int i, j;
+	FILE *f;
+
+	sprintf(tmp, "%s.new", c->file);
+	if (!(f = fopen(tmp, "w"))) {
+		perror(tmp);
+		return 0;
+	}
+	fprintf(f, "# stmflasher page cache: uid page address length crc\n");
+	for(i = 0; i < c->count; i++) {
+		for(j = 0; j < STM32_UID_LEN; j++)
+			fprintf(f, "%02x", c->e[i].uid[j]);
+		fprintf(f, " %u 0x%08x 0x%x 0x%08x\n", c->e[i].page, c->e[i].address, c->e[i].len, c->e[i].crc);
+	}
+	if (fclose(f) != 0) {
+		perror(tmp);
+		remove(tmp);
+		return 0;
+	}
+#ifdef __WIN32__
+	remove(c->file);
+#endif
+	if (rename(tmp, c->file) != 0) {
+		perror(c->file);
+		return 0;
+	}
+	return 1;
+}
+
+void cache_free(cache_t *c) {
+	if (!c)
+		return;
+	free(c->file);
+	free(c->e);
+	free(c);
+}
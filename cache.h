@@ -0,0 +1,52 @@
+/*
+  stmflasher - Open Source ST MCU flash program for *nix
+  Copyright (C) 2010 Geoffrey McRae <geoff@spacevs.com>
+  Copyright (C) 2011 Steve Markgraf <steve@steve-m.de>
+  Copyright (C) 2012 Tormod Volden
+  Copyright (C) 2012-2013 Alatar <alatar_@list.ru>
+
+  This program is free software; you can redistribute it and/or
+  modify it under the terms of the GNU General Public License
+  as published by the Free Software Foundation; either version 2
+  of the License, or (at your option) any later version.
+
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with this program; if not, write to the Free Software
+  Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+*/
+
+
+#ifndef _H_CACHE
+#define _H_CACHE
+
+#include <stdint.h>
+#include "stm32.h"
+
+/* Host side record of what was last written to each unit, by its unique
+ * ID: the CRC (crc32_unit) of the bytes an image put in each page. A
+ * text file, one page a line:
+ *   uid (24 hex digits) page address length crc
+ */
+#define CACHE_ALL	0xFFFF	/* every page of a unit, for cache_forget() */
+
+typedef struct {
+	uint8_t		uid[STM32_UID_LEN];
+	uint16_t	page;
+	uint32_t	address, len, crc;
+} cache_entry_t;
+
+typedef struct cache cache_t;
+
+cache_t*             cache_load  (const char *file);
+const cache_entry_t* cache_find  (const cache_t *c, const uint8_t uid[], unsigned int page);
+void                 cache_forget(cache_t *c, const uint8_t uid[], unsigned int page);
+char                 cache_add   (cache_t *c, const cache_entry_t *e);
+char                 cache_save  (const cache_t *c);
+void                 cache_free  (cache_t *c);
+
+#endif
@@ -0,0 +1,216 @@
+/*
+  stmflasher - Open Source ST MCU flash program for *nix
+  Copyright (C) 2010 Geoffrey McRae <geoff@spacevs.com>
+  Copyright (C) 2011 Steve Markgraf <steve@steve-m.de>
+  Copyright (C) 2012 Tormod Volden
+  Copyright (C) 2012-2013 Alatar <alatar_@list.ru>
+
+  This program is free software; you can redistribute it and/or
+  modify it under the terms of the GNU General Public License
+  as published by the Free Software Foundation; either version 2
+  of the License, or (at your option) any later version.
+
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with this program; if not, write to the Free Software
+  Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+*/
+
+/* Bootloader discovery: the probes of all candidate ports run as resumable
+ * operations in one poll loop, so the scan takes about one INIT timeout
+ * whatever the number of ports.
+ */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <limits.h>
+#ifndef __WIN32__
+#include <glob.h>
+#endif
+
+#include "discover.h"
+#include "serial.h"
+#include "stm32.h"
+#include "stm32_op.h"
+
+#define DISCOVER_TRIES	2	/* INITs per port, the second one gets NACK from a resumed bootloader */
+#define DISCOVER_MAX	256	/* candidate ports */
+
+typedef enum {
+	PROBE_NO_PORT,
+	PROBE_NO_SETUP,
+	PROBE_NO_ANSWER,
+	PROBE_NO_INFO,
+	PROBE_FOUND
+} probe_state_t;
+
+static const char *probe_str[] = {
+	"can't open",
+	"can't setup",
+	"no answer",
+	"unknown device"
+};
+
+typedef struct {
+	char			*name;
+	serial_t		*serial;
+	stm32_t			*stm;
+	probe_state_t		state;
+} probe_t;
+
+/* open and set up every port, the ones which fail are done */
+static void discover_open(probe_t *probes, int n, unsigned int baud) {
+	int i;
+
+	for(i = 0; i < n; i++) {
+		probe_t *p = &probes[i];
+
+		p->state = PROBE_NO_PORT;
+		p->serial = serial_open(p->name);
+		if (!p->serial)
+			continue;
+
+		p->state = PROBE_NO_SETUP;
+		if (serial_setup(p->serial, baud, SERIAL_BITS_8, SERIAL_PARITY_EVEN, SERIAL_STOPBIT_1) != SERIAL_ERR_OK) {
+			serial_close(p->serial);
+			p->serial = NULL;
+			continue;
+		}
+		p->state = PROBE_NO_ANSWER;
+	}
+}
+
+/* run one operation on each port in state, the ports which succeed move on to next */
+static void discover_step(probe_t *probes, int n, probe_state_t state, probe_state_t next) {
+	stm32_op_t **ops = calloc(sizeof(stm32_op_t*), n ? n : 1);
+	int i;
+
+	for(i = 0; i < n; i++) {
+		probe_t *p = &probes[i];
+
+		if (p->state != state)
+			continue;
+		if (state == PROBE_NO_ANSWER) {
+			ops[i] = stm32_op_probe(p->serial, DISCOVER_TRIES);
+		} else {
+			p->stm = stm32_new(p->serial);
+			ops[i] = stm32_op_init(p->stm, 0);
+			stm32_op_quiet(ops[i]);
+		}
+	}
+
+	/* ports without an operation count as failed */
+	stm32_op_run_all(ops, n);
+
+	for(i = 0; i < n; i++) {
+		if (stm32_op_state(ops[i]) == STM32_OP_DONE)
+			probes[i].state = next;
+		stm32_op_free(ops[i]);
+	}
+	free(ops);
+}
+
+/* add a port, unless the same device is already there under another name */
+static int discover_add(probe_t *probes, int n, const char *name) {
+	int i;
+#ifndef __WIN32__
+	char real[PATH_MAX], other[PATH_MAX];
+
+	if (realpath(name, real)) {
+		for(i = 0; i < n; i++)
+			if (realpath(probes[i].name, other) && strcmp(real, other) == 0)
+				return n;
+	}
+#endif
+	for(i = 0; i < n; i++)
+		if (strcmp(name, probes[i].name) == 0)
+			return n;
+	if (n == DISCOVER_MAX)
+		return n;
+
+	probes[n].name = strdup(name);
+	return n + 1;
+}
+
+/* expand the comma separated pattern list into probes[] */
+static int discover_candidates(const char *pattern, probe_t *probes) {
+	int n = 0;
+	char *list, *item, *next;
+
+	if (!pattern) {
+#ifdef __WIN32__
+		char name[16];
+		int i;
+		for(i = 1; i <= 64; i++) {
+			snprintf(name, sizeof(name), "COM%d", i);
+			n = discover_add(probes, n, name);
+		}
+		return n;
+#else
+		pattern = "/dev/serial/by-id/*,/dev/ttyUSB*,/dev/ttyACM*";
+#endif
+	}
+
+	list = strdup(pattern);
+	for(item = list; item; item = next) {
+		next = strchr(item, ',');
+		if (next)
+			*next++ = 0;
+		if (!*item)
+			continue;
+#ifdef __WIN32__
+		n = discover_add(probes, n, item);
+#else
+		{
+			glob_t g;
+			size_t i;
+			/* names without wildcards (tcp://...) are taken as they are */
+			int flags = strpbrk(item, "*?[") ? 0 : GLOB_NOCHECK;
+
+			if (glob(item, flags, NULL, &g) == 0) {
+				for(i = 0; i < g.gl_pathc; i++)
+					n = discover_add(probes, n, g.gl_pathv[i]);
+				globfree(&g);
+			}
+		}
+#endif
+	}
+	free(list);
+	return n;
+}
+
+int discover(const char *pattern, unsigned int baud, char verbose, FILE *out) {
+	probe_t *probes = calloc(sizeof(probe_t), DISCOVER_MAX);
+	int n, i, found = 0;
+
+	n = discover_candidates(pattern, probes);
+	discover_open(probes, n, baud);
+	discover_step(probes, n, PROBE_NO_ANSWER, PROBE_NO_INFO);
+	discover_step(probes, n, PROBE_NO_INFO, PROBE_FOUND);
+
+	fprintf(out, "%-32s %-6s %-32s %s\n", "Port", "ID", "Device", "Bootloader");
+	for(i = 0; i < n; i++) {
+		probe_t *p = &probes[i];
+
+		if (p->state == PROBE_FOUND) {
+			fprintf(out, "%-32s 0x%03x  %-32s 0x%02x\n", p->name, p->stm->pid, p->stm->dev->name, p->stm->bl_version);
+			found++;
+		} else if (verbose > 1) {
+			fprintf(out, "%-32s -      (%s)\n", p->name, probe_str[p->state]);
+		}
+		stm32_close(p->stm);
+		if (p->serial)
+			serial_close(p->serial);
+		free(p->name);
+	}
+	if (verbose)
+		fprintf(out, "\n%d of %d ports have a bootloader\n", found, n);
+
+	free(probes);
+	return found;
+}
@@ -0,0 +1,125 @@
+/*
+  stmflasher - Open Source ST MCU flash program for *nix
+  Copyright (C) 2010 Geoffrey McRae <geoff@spacevs.com>
+  Copyright (C) 2011 Steve Markgraf <steve@steve-m.de>
+  Copyright (C) 2012 Tormod Volden
+  Copyright (C) 2012-2013 Alatar <alatar_@list.ru>
+
+  This program is free software; you can redistribute it and/or
+  modify it under the terms of the GNU General Public License
+  as published by the Free Software Foundation; either version 2
+  of the License, or (at your option) any later version.
+
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with this program; if not, write to the Free Software
+  Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+*/
+
+
+#include <string.h>
+
+#include "lz4.h"
+
+#define LZ4_HASH_BITS	12
+
+/* internal functions */
+uint32_t     lz4_hash(const uint8_t *p);
+unsigned int lz4_put_len(uint8_t *dst, unsigned int pos, unsigned int max, unsigned int len);
+
+uint32_t lz4_hash(const uint8_t *p) {
+	uint32_t v = p[0] | (p[1] << 8) | (p[2] << 16) | ((uint32_t)p[3] << 24);
+	return (v * 2654435761U) >> (32 - LZ4_HASH_BITS);
+}
+
+/* the length bytes after a 15 in the token, returns the new position or 0 */
+unsigned int lz4_put_len(uint8_t *dst, unsigned int pos, unsigned int max, unsigned int len) {
+	for(; len >= 255; len -= 255) {
+		if (pos >= max) return 0;
+		dst[pos++] = 255;
+	}
+	if (pos >= max) return 0;
+	dst[pos++] = len;
+	return pos;
+}
+
+/* greedy, one candidate per hash: fast and good enough for padding and tables */
+unsigned int lz4_compress(const uint8_t *src, unsigned int len, uint8_t *dst, unsigned int max) {
+	uint32_t table[1 << LZ4_HASH_BITS];
+	unsigned int i = 0, anchor = 0, pos = 0;
+
+	memset(table, 0, sizeof(table));
+	while(1) {
+		unsigned int lit, mlen = 0, ref = 0;
+
+		/* the next match, or the end of the input */
+		for(; i + LZ4_MIN_MATCH <= len; i++) {
+			uint32_t h = lz4_hash(src + i);
+			ref = table[h];
+			table[h] = i + 1;
+			if (ref && i - (ref - 1) <= LZ4_MAX_OFFSET && !memcmp(src + ref - 1, src + i, LZ4_MIN_MATCH)) {
+				ref--;
+				for(mlen = LZ4_MIN_MATCH; i + mlen < len && src[ref + mlen] == src[i + mlen]; mlen++);
+				break;
+			}
+		}
+		if (!mlen) i = len;
+
+		lit = i - anchor;
+		if (pos >= max) return 0;
+		dst[pos++] = (lit < 15 ? lit : 15) << 4 | (!mlen ? 0 : mlen - LZ4_MIN_MATCH < 15 ? mlen - LZ4_MIN_MATCH : 15);
+		if (lit >= 15 && !(pos = lz4_put_len(dst, pos, max, lit - 15))) return 0;
+		if (pos + lit > max) return 0;
+		memcpy(dst + pos, src + anchor, lit);
+		pos += lit;
+		if (!mlen) return pos;
+
+		if (pos + 2 > max) return 0;
+		dst[pos++] = (i - ref) & 0xFF;
+		dst[pos++] = (i - ref) >> 8;
+		if (mlen - LZ4_MIN_MATCH >= 15 && !(pos = lz4_put_len(dst, pos, max, mlen - LZ4_MIN_MATCH - 15))) return 0;
+		i += mlen;
+		anchor = i;
+	}
+}
+
+int lz4_decompress(const uint8_t *src, unsigned int len, uint8_t *dst, unsigned int max) {
+	unsigned int i = 0, out = 0;
+
+	while(i < len) {
+		unsigned int token = src[i++], n, offset;
+
+		n = token >> 4;
+		if (n == 15) {
+			while(i < len) {
+				n += src[i];
+				if (src[i++] != 255) break;
+			}
+		}
+		if (n > len - i || n > max - out) return -1;
+		memcpy(dst + out, src + i, n);
+		i += n;
+		out += n;
+		if (i == len) break;
+
+		if (len - i < 2) return -1;
+		offset = src[i] | (src[i + 1] << 8);
+		i += 2;
+		n = token & 15;
+		if (n == 15) {
+			while(i < len) {
+				n += src[i];
+				if (src[i++] != 255) break;
+			}
+		}
+		n += LZ4_MIN_MATCH;
+		if (!offset || offset > out || n > max - out) return -1;
+		for(; n; n--, out++)
+			dst[out] = dst[out - offset];
+	}
+	return out;
+}
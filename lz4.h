@@ -0,0 +1,43 @@
+/*
+  stmflasher - Open Source ST MCU flash program for *nix
+  Copyright (C) 2010 Geoffrey McRae <geoff@spacevs.com>
+  Copyright (C) 2011 Steve Markgraf <steve@steve-m.de>
+  Copyright (C) 2012 Tormod Volden
+  Copyright (C) 2012-2013 Alatar <alatar_@list.ru>
+
+  This program is free software; you can redistribute it and/or
+  modify it under the terms of the GNU General Public License
+  as published by the Free Software Foundation; either version 2
+  of the License, or (at your option) any later version.
+
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with this program; if not, write to the Free Software
+  Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+*/
+
+
+#ifndef _H_LZ4
+#define _H_LZ4
+
+#include <stdint.h>
+
+/* LZ4 block format: sequences of a token (literal count << 4 | match length
+ * - 4, 15 in either half means more length bytes follow, each added until
+ * one is not 255), the literals, then a 2 byte LE offset back into the
+ * output and the extra match length bytes. The last sequence stops after
+ * its literals.
+ */
+#define LZ4_MIN_MATCH	4
+#define LZ4_MAX_OFFSET	65535
+
+/* returns the size of the block, 0 if it takes more than max bytes */
+unsigned int lz4_compress  (const uint8_t *src, unsigned int len, uint8_t *dst, unsigned int max);
+/* returns the unpacked length, -1 if the block is broken or needs more than max bytes */
+int          lz4_decompress(const uint8_t *src, unsigned int len, uint8_t *dst, unsigned int max);
+
+#endif
@@ -26,16 +26,28 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <unistd.h>
+#include <getopt.h>
 #include <string.h>
 
 #include "utils.h"
 #include "serial.h"
 #include "stm32.h"
+#include "applet.h"
+#include "discover.h"
+#include "plan.h"
+#include "cache.h"
 #include "parsers/parser.h"
 
 #include "parsers/binary.h"
 #include "parsers/hex.h"
 
+#define AUTOBAUD_CEILING	921600	/* -b auto without a ceiling */
+#define AUTOBAUD_FLOOR		9600	/* slowest rate -b auto goes down to */
+#define DOWNSHIFT_WINDOW	16	/* blocks failed tries are counted over */
+#define DOWNSHIFT_ERRORS	2	/* failed tries in the window that lower the rate */
+#define VERIFY_SPAN		16384	/* bytes -v takes one Get Checksum over */
+#define CACHE_SPOT_CHECKS	2	/* pages -C reads back to check the cache, without Get Checksum */
+
 enum {
 	MEM_TYPE_ANY,
 	MEM_TYPE_FLASH,
@@ -48,16 +60,29 @@ enum {
 	EXEC_FLAG_ABS
 };
 
+enum {
+	OPT_DRY_RUN = 0x100	/* long options only */
+};
+
 /* device globals */
 serial_t	*serial		= NULL;
 stm32_t		*stm		= NULL;
+applet_t	*applet		= NULL;
+uint8_t		uid[STM32_UID_LEN];	//unique ID of the target, if have_uid
+char		have_uid	= 0;
+cache_t		*cache		= NULL;
 
 void		*p_st		= NULL;
 parser_t	*parser		= NULL;
+char		*touched	= NULL; //flash pages the image sets data in, NULL - all
+uint16_t	*erase_list	= NULL; //the same as page numbers
+unsigned int	erase_count	= 0;    //entries of erase_list
+uint8_t		*image		= NULL; //the whole image read in, for -d
 
 /* settings */
 char		*device		= NULL;
-serial_baud_t	baudRate	= SERIAL_BAUD_57600;
+unsigned int	baudRate	= 57600;
+char		auto_baud	= 0; //find the fastest reliable rate up to baudRate
 char		rd	 	= 0; //read memory
 char		wr		= 0; //write memory
 char		wu		= 0; //write unprotect
@@ -68,6 +93,7 @@ char		mem_type	= MEM_TYPE_FLASH; //target memory region
 char		relative_addr	= 1; //use relative addresation for -S option
 int		npages		= 0; //pages to erase
 int		spage		= -1; //first page to erase
+char		pages_given	= 0; //-E or -s chose the pages to erase
 uint32_t	readwrite_len	= 0; //number of read/write bytes
 uint32_t	start_addr	= 0; //addr for read/write
 char		verify		= 0; //verify data after writing
@@ -76,18 +102,53 @@ char		reset_flag	= 1; //reset device after operation
 char		exec_flag	= EXEC_FLAG_NONE; //execute code after operation
 uint32_t	execute		= 0; //execution address
 char		init_flag	= 1; //send INIT to device
+char		low_latency	= 0; //tune USB-serial adapter for low latency
+char		*trace_file	= NULL; //record wire trace of the session
+char		*fault_spec	= NULL; //inject faults into serial traffic
+char		discover_flag	= 0; //find bootloaders on all ports
+char		deferred_ack	= 0; //don't wait for the ACK of every read/write phase
+char		use_applet	= 0; //read/write flash through a RAM applet
+unsigned int	applet_baud	= 0; //rate the RAM applet switches to, 0 - keep
+char		compress_flag	= 0; //write LZ4 blocks through the RAM applet
 char		force_binary	= 0; //force to use binary parser
 char		show_info	= 0; //print device configuration
+char		dry_run		= 0; //print the write plan, don't erase or write
+char		diff_flag	= 0; //erase and write only the pages that differ
+char		*cache_file	= NULL; //page CRCs of the image last written to each unit
 char		verbose		= 1; //output messages level
 char		*filename;	     //name of file to read or write
 
+/* statistics */
+unsigned long	retries		= 0; //blocks transferred again
+uint64_t	recover_us	= 0; //time lost to failed transfers
+unsigned int	downshifts	= 0; //baud rate lowered during the transfer
+unsigned int	link_errors	= 0; //failed tries in the current window
+unsigned int	link_blocks	= 0; //blocks in the current window
+unsigned int	applet_len	= 0; //write frame of the RAM applet, 0 if not used
+
 /* functions */
 int  parse_options(int argc, char *argv[]);
 void show_help(char *name, char *ser_port);
 int calc_workspace(FILE *diag, uint32_t *start, uint32_t *end);
+void show_goodput(FILE *diag, const char *what, uint32_t bytes, uint64_t t_start);
+void show_compression(FILE *diag, uint64_t t_start);
+unsigned int baud_below(unsigned int baud);
+stm32_t* auto_baud_init(FILE *diag);
+void recover(FILE *diag);
+void link_ok(void);
+void start_applet(FILE *diag);
+char verify_span(FILE *diag, uint32_t address, uint8_t *data, unsigned int len);
+unsigned int image_pages(uint32_t start, uint32_t end);
+char page_differs(FILE *diag, uint32_t address, const uint8_t *data, unsigned int len, char *differs);
+void page_part(cache_entry_t *e, unsigned int page, uint32_t start, uint32_t end);
+char diff_page(FILE *diag, unsigned int page, uint32_t start, uint32_t end, char *differs);
+char diff_pages(FILE *diag, uint32_t start, uint32_t end, uint32_t size);
+void cache_written(uint32_t start, uint32_t end);
+void choose_plan(plan_t *best, uint32_t start, uint32_t end, uint32_t size);
 
 int main(int argc, char* argv[]) {
 	int ret = 1;
+	unsigned int i;
 	parser_err_t perr;
 	FILE *diag = stdout;
 
@@ -98,6 +159,11 @@ int main(int argc, char* argv[]) {
 		diag = stderr;
 	}
 
+	if (discover_flag) {
+		ret = discover(device, baudRate, verbose, diag) > 0 ? 0 : 1;
+		goto close;
+	}
+
 	if (wr) {
 		/* first try hex */
 		if (!force_binary) {
@@ -164,21 +230,57 @@ int main(int argc, char* argv[]) {
 		goto close;
 	}
 
-	if (serial_setup(
-		serial,
-		baudRate,
-		SERIAL_BITS_8,
-		SERIAL_PARITY_EVEN,
-		SERIAL_STOPBIT_1
-	) != SERIAL_ERR_OK) {
-		perror(device);
+	if (trace_file && serial_record(serial, trace_file) != SERIAL_ERR_OK) {
+		fprintf(stderr, "Failed to create trace file: ");
+		perror(trace_file);
+		goto close;
+	}
+
+	if (fault_spec && serial_inject_faults(serial, fault_spec) != SERIAL_ERR_OK) {
+		fprintf(stderr, "ERROR: Invalid fault specification \"%s\"\n", fault_spec);
 		goto close;
 	}
 
+	if (low_latency && serial_set_low_latency(serial) != SERIAL_ERR_OK)
+		fprintf(stderr, "WARNING: Can't set low latency mode on %s\n", device);
+
+	if (auto_baud) {
+		if (!(stm = auto_baud_init(diag))) goto close;
+		if(verbose) fprintf(diag, "Baud rate     : %u (auto)\n", baudRate);
+	} else {
+		serial_err_t serr = serial_setup(
+			serial,
+			baudRate,
+			SERIAL_BITS_8,
+			SERIAL_PARITY_EVEN,
+			SERIAL_STOPBIT_1
+		);
+		if (serr == SERIAL_ERR_INVALID_BAUD) {
+			serial_baud_t std_baud;
+			fprintf(stderr, "Baud rate %u is not supported by the port, standard rates are:\n", baudRate);
+			for(std_baud = SERIAL_BAUD_1200; std_baud != SERIAL_BAUD_INVALID; ++std_baud)
+				fprintf(stderr, " %d\n", serial_get_baud_int(std_baud));
+			goto close;
+		} else if (serr != SERIAL_ERR_OK) {
+			perror(device);
+			goto close;
+		}
+	}
+
 	if(verbose > 1) {
-		fprintf(diag, "Serial Config: %s\n", serial_get_setup_str(serial));
+		fprintf(diag, "Serial Config: %s (%s)\n", serial_get_setup_str(serial), serial_get_backend_name(serial));
+	}
+	if (!stm && !(stm = stm32_init(serial, init_flag))) goto close;
+	stm->deferred_ack = deferred_ack;
+
+	if (cache_file || show_info)
+		have_uid = stm32_read_uid(stm, uid);
+	if (cache_file) {
+		if (!have_uid)
+			fprintf(stderr, "WARNING: Can't read the unique ID, not using the cache\n");
+		else if (!(cache = cache_load(cache_file)))
+			fprintf(stderr, "WARNING: Can't read the cache %s, not using it\n", cache_file);
 	}
-	if (!(stm = stm32_init(serial, init_flag))) goto close;
 
 	if(verbose > 1 || show_info) {
 		fprintf(diag, "MCU info\n");
@@ -186,24 +288,55 @@ int main(int argc, char* argv[]) {
 		fprintf(diag, "Bootloader Ver: 0x%02x\n", stm->bl_version);
 		fprintf(diag, "Option 1      : 0x%02x\n", stm->option1);
 		fprintf(diag, "Option 2      : 0x%02x\n", stm->option2);
+		if (have_uid) {
+			fprintf(diag, "Unique ID     : ");
+			for(i = 0; i < STM32_UID_LEN; i++)
+				fprintf(diag, "%02x", uid[i]);
+			fprintf(diag, "\n");
+		}
+		fprintf(diag, "ACK round trip: %u.%03u ms\n", stm->rtt / 1000, stm->rtt % 1000);
+		fprintf(diag, "Commands      :");
+		for(i = 0; i < stm->cmd->count; i++)
+			fprintf(diag, " %02x", stm->cmd->list[i]);
+		fprintf(diag, "%s\n", stm->cmd->crc != STM32_CMD_NONE ? " (with Get Checksum)" : "");
 		fprintf(diag, "- RAM up to   :%4dKiB at 0x%08x\n", (stm->dev->ram_end - stm->dev->ram_start) / 1024, stm->dev->ram_start);
 		fprintf(diag, "              :  (%db to 0x%08x reserved by bootloader)\n", stm->dev->ram_bl_res - stm->dev->ram_start , stm->dev->ram_bl_res);
 		fprintf(diag, "- System mem  :%4dKiB at 0x%08x\n", (stm->dev->mem_end - stm->dev->mem_start) / 1024, stm->dev->mem_start);
 		fprintf(diag, "- Option mem  :  %4dB at 0x%08x\n", stm->dev->opt_end - stm->dev->opt_start + 1, stm->dev->opt_start);
-		fprintf(diag, "- Flash up to :%4dKiB at 0x%08x\n", (stm->dev->fl_end - stm->dev->fl_start ) / 1024, stm->dev->fl_start);
-		fprintf(diag, "- Flash org.  : %d sectors x %d pages x %d bytes\n", (stm->dev->fl_end - stm->dev->fl_start ) / (stm->dev->fl_ps * stm->dev->fl_pps), stm->dev->fl_pps, stm->dev->fl_ps);
+		if (stm->fl_end != stm->dev->fl_end)
+			fprintf(diag, "- Flash       :%4dKiB at 0x%08x (size register, up to %dKiB)\n", (stm->fl_end - stm->dev->fl_start) / 1024, stm->dev->fl_start, (stm->dev->fl_end - stm->dev->fl_start) / 1024);
+		else
+			fprintf(diag, "- Flash up to :%4dKiB at 0x%08x\n", (stm->dev->fl_end - stm->dev->fl_start ) / 1024, stm->dev->fl_start);
+		if (stm->dev->fl_map) {
+			const stm32_sector_t *s;
+			uint32_t a = stm->dev->fl_start;
+
+			fprintf(diag, "- Flash org.  :");
+			for(s = stm->dev->fl_map; s->count && a < stm->fl_end; s++) {
+				i = (stm->fl_end - a) / s->size;
+				if (i > s->count)
+					i = s->count;
+				fprintf(diag, "%s %u x %uKiB", a == stm->dev->fl_start ? "" : ",", i, s->size / 1024);
+				a += s->count * s->size;
+			}
+			fprintf(diag, " sectors\n");
+		} else
+			fprintf(diag, "- Flash org.  : %d sectors x %d pages x %d bytes\n", (stm->fl_end - stm->dev->fl_start ) / (stm->dev->fl_ps * stm->dev->fl_pps), stm->dev->fl_pps, stm->dev->fl_ps);
 		if(stm->dev->eep_end - stm->dev->eep_start)
 			fprintf(diag, "- EEPROM      :%4dKiB at 0x%08x\n", (stm->dev->eep_end - stm->dev->eep_start ) / 1024, stm->dev->eep_start);
 		fprintf(diag, "\n");
-		fprintf(diag, "Note: specified RAM/Flash sizes are maximum for this chip type.\n");
+		fprintf(diag, "Note: specified RAM%s sizes are maximum for this chip type.\n", stm->fl_end != stm->dev->fl_end ? "" : "/Flash");
 		fprintf(diag, "      Your chip may have less memory amount!\n");
 		fprintf(diag, "\n");
 	}
 
-	uint8_t		buffer[256];
-	uint32_t	addr, start, end;
-	unsigned int	len;
+	uint8_t		buffer[16384];	/* the applet pipelines frames within a block */
+	uint8_t		span[VERIFY_SPAN + 3];	/* written, waiting for a Get Checksum */
+	uint32_t	addr, start, end, span_addr = 0;
+	unsigned int	len, block = 256, span_len = 0;
+	char		crc_span;
 	int		failed = 0;
+	uint64_t	t_start, t_block, t_try;
 
 	if (!calc_workspace(diag, &start, &end)) {
 		goto close;
@@ -216,16 +349,33 @@ int main(int argc, char* argv[]) {
 			goto close;
 		}
 
+		start_applet(diag);
+		if (applet)
+			block = sizeof(buffer);
+
 		addr = start;
+		t_start = now_us();
 
 		fflush(diag);
 		while(addr < end) {
 			uint32_t left	= end - addr;
-			len		= sizeof(buffer) > left ? left : sizeof(buffer);
-			if (!stm32_read_memory(stm, addr, buffer, len)) {
-				fprintf(stderr, "Failed to read memory at address 0x%08x, target write-protected?\n", addr);
-				goto close;
+			len		= block > left ? left : block;
+			t_block = t_try = now_us();
+			while (!(applet ? applet_read(applet, addr, buffer, len) : stm32_read_memory(stm, addr, buffer, len))) {
+				if (failed == retry) {
+					fprintf(stderr, "Failed to read memory at address 0x%08x, target write-protected?\n", addr);
+					goto close;
+				}
+				++failed;
+				recover(diag);
+				t_try = now_us();
+			}
+			if (failed) {
+				retries    += failed;
+				recover_us += t_try - t_block;
+				failed = 0;
 			}
+			link_ok();
 			if (parser->write(p_st, buffer, len) != PARSER_ERR_OK)
 			{
 				fprintf(stderr, "Failed to write data to file\n");
@@ -243,6 +393,7 @@ int main(int argc, char* argv[]) {
 			}
 		}
 		if(verbose) fprintf(diag,	"Done.\n");
+		if(verbose > 1) show_goodput(diag, "Read", addr - start, t_start);
 		ret = 0;
 		goto close;
 	} else if (rp) {
@@ -275,8 +426,9 @@ int main(int argc, char* argv[]) {
 		if(verbose) fprintf(diag,	"Done.\n");
 
 	} else if (wr) {
-		off_t 	offset = 0;
+		off_t 	offset = 0, skipped = 0;
 		ssize_t r;
+		plan_t	plan;
 		unsigned int size;
 
 		if (readwrite_len > (end - start)) {
@@ -295,25 +447,65 @@ int main(int argc, char* argv[]) {
 
 		// TODO: If writes are not page aligned, we should probably read out existing flash
 		//       contents first, so it can be preserved and combined with new data
-		if(mem_type == MEM_TYPE_FLASH) {
+		if (diff_flag && !diff_pages(diag, start, end, size))
+			goto close;
+		choose_plan(&plan, start, end, size);
+		if (dry_run || verbose > 1)
+			plan_show(&plan, diag);
+		if (dry_run) {
+			reset_flag = 0;
+			ret = 0;
+			goto close;
+		}
+
+		if(mem_type == MEM_TYPE_FLASH && (plan.erase != PLAN_ERASE_LIST || plan.pages)) {
 			if(verbose) {
-				fprintf(diag, "Erasing flash... ");
+				if (diff_flag)
+					fprintf(diag, "Erasing %u pages that differ... ", plan.pages);
+				else if (plan.erase == PLAN_ERASE_LIST)
+					fprintf(diag, "Erasing %u pages the image sets data in... ", plan.pages);
+				else
+					fprintf(diag, "Erasing flash... ");
 				fflush(diag);
 			}
-			if (!stm32_erase_memory(stm, spage, npages)) {
+			if (!(plan.erase == PLAN_ERASE_LIST  ? stm32_erase_pages (stm, erase_list, plan.pages) :
+			      plan.erase == PLAN_ERASE_RANGE ? stm32_erase_memory(stm, spage, plan.pages) :
+			                                       stm32_erase_memory(stm, 0, 0xFFFF))) {
 				fprintf(stderr, "Failed to erase memory\n");
 				goto close;
 			}
 			if(verbose) fprintf(diag, "Done.\n");
+			start_applet(diag);
+			if (applet)
+				block = sizeof(buffer);
 		}
 		if(verbose) fflush(diag);
 
+		/* the bootloader checks a CRC much faster than it is read back */
+		crc_span = verify && !applet && stm->cmd->crc != STM32_CMD_NONE;
+
+		t_start = now_us();
 		while(addr < end && offset < size) {
 			uint32_t left	= end - addr;
-			len		= sizeof(buffer) > left ? left : sizeof(buffer);
+			unsigned int	page = 0;
+			len		= block > left ? left : block;
 			len		= len > size - offset ? size - offset : len;
 
-			if (parser->read(p_st, buffer, &len) != PARSER_ERR_OK) {
+			/* stop at the page where the image starts or stops setting data */
+			if (touched) {
+				uint32_t	next;
+				page = stm32_page_of(stm->dev, addr);
+				for(i = page + 1; (next = stm32_page_addr(stm->dev, i)) < addr + len; i++) {
+					if (touched[i] != touched[page]) {
+						len = next - addr;
+						break;
+					}
+				}
+			}
+
+			if (image) {
+				memcpy(buffer, image + offset, len);
+			} else if (parser->read(p_st, buffer, &len) != PARSER_ERR_OK) {
 				fprintf(stderr, "Failed to read data block from input file\n");
 				goto close;
 			}
@@ -327,18 +519,44 @@ int main(int argc, char* argv[]) {
 				}
 			}
 
+			/* a gap of the image or a page that didn't change, not erased */
+			if (touched && !touched[page]) {
+				if (span_len && !verify_span(diag, span_addr, span, span_len))
+					goto close;
+				span_len = 0;
+				addr	+= len;
+				offset	+= len;
+				skipped	+= len;
+				continue;
+			}
+
+			t_block = now_us();
 			do {
 				r = len;
-				if (!stm32_write_memory(stm, addr, buffer, len)) {
-					fprintf(stderr, "Failed to write memory at address 0x%08x\n", addr);
-					goto close;
+				t_try = now_us();
+				if (!(applet ? applet_write(applet, addr, buffer, len) : stm32_write_memory(stm, addr, buffer, len))) {
+					if (failed == retry) {
+						fprintf(stderr, "Failed to write memory at address 0x%08x\n", addr);
+						goto close;
+					}
+					++failed;
+					recover(diag);
+					r = 0;
+					continue;
 				}
 
-				if (verify) {
+				/* with the applet a CRC on the target does, unless it differs */
+				if (verify && !crc_span && !(applet && applet_verify(applet, addr, buffer, len))) {
 					uint8_t compare[len];
-					if (!stm32_read_memory(stm, addr, compare, len)) {
-						fprintf(stderr, "Failed to read memory at address 0x%08x\n", addr);
-						goto close;
+					if (!(applet ? applet_read(applet, addr, compare, len) : stm32_read_memory(stm, addr, compare, len))) {
+						if (failed == retry) {
+							fprintf(stderr, "Failed to read memory at address 0x%08x\n", addr);
+							goto close;
+						}
+						++failed;
+						recover(diag);
+						r = 0;
+						continue;
 					}
 
 					for(r = 0; r < len; ++r) {
@@ -350,12 +568,30 @@ int main(int argc, char* argv[]) {
 								goto close;
 							}
 							++failed;
+							recover(diag);
 							break;
 						}
 					}
-					failed = 0;
 				}
 			} while (r != len);
+			if (failed) {
+				retries    += failed;
+				recover_us += t_try - t_block;
+				failed = 0;
+			}
+			link_ok();
+
+			if (crc_span) {
+				if (!span_len)
+					span_addr = addr;
+				memcpy(span + span_len, buffer, len);
+				span_len += len;
+				if (span_len + block > VERIFY_SPAN) {
+					if (!verify_span(diag, span_addr, span, span_len))
+						goto close;
+					span_len = 0;
+				}
+			}
 
 			addr	+= len;
 			offset	+= len;
@@ -371,13 +607,25 @@ int main(int argc, char* argv[]) {
 			}
 		}
 
+		if (span_len && !verify_span(diag, span_addr, span, span_len))
+			goto close;
+
 		if(verbose) fprintf(diag,	"Done.\n");
+		if(verbose > 1) show_goodput(diag, "Wrote", offset - skipped, t_start);
+		if(verbose && applet && compress_flag) show_compression(diag, t_start);
+		if (cache)
+			cache_written(start, end > start + size ? start + size : end);
 		ret = 0;
 		goto close;
 	} else
 		ret = 0;
 
 close:
+	/* the applet resets the chip into the bootloader again */
+	if (applet && !applet_stop(applet))
+		ret = 1;
+	applet = NULL;
+
 	if (stm && exec_flag && ret == 0) {
 		if (execute == 0)
 			execute = stm->dev->fl_start;
@@ -406,6 +654,25 @@ close:
 		}
 	}
 
+	if (serial && verbose > 1) {
+		serial_stats_t stats;
+		serial_get_stats(serial, &stats);
+		fprintf(diag, "\nSerial writes : %lu (%lu bytes)\n", stats.tx_calls, stats.tx_bytes);
+		fprintf(diag, "Serial reads  : %lu (%lu bytes)\n", stats.rx_calls, stats.rx_bytes);
+		fprintf(diag, "Round trips   : %lu\n", stats.turns);
+		if (auto_baud)
+			fprintf(diag, "Baud rate     : %u (auto, lowered %u times)\n", baudRate, downshifts);
+		if (applet_len)
+			fprintf(diag, "Framing       : RAM applet, %u byte frames\n", applet_len);
+		else if (stm)
+			fprintf(diag, "Framing       : %s\n", stm->deferred_ack ? "deferred ACK" :
+				deferred_ack ? "lock-step (deferred ACK fell back)" : "lock-step");
+	}
+
+	free(touched);
+	free(erase_list);
+	free(image);
+	cache_free(cache);
 	if (p_st  ) parser->close(p_st);
 	if (stm   ) stm32_close  (stm);
 	if (serial) serial_close (serial);
@@ -449,7 +716,7 @@ int calc_workspace(FILE *diag, uint32_t *start, uint32_t *end)
 	{
 	case MEM_TYPE_FLASH:
 		allowed_start = stm->dev->fl_start;
-		allowed_end  =  stm->dev->fl_end;
+		allowed_end  =  stm->fl_end;
 		if(verbose > 1)
 			fprintf(diag, "Working with Flash\n");
 		break;
@@ -484,14 +751,14 @@ int calc_workspace(FILE *diag, uint32_t *start, uint32_t *end)
 /*Step 2. claculate start_addr, spage and execution addr*/
 	tmp_start = allowed_start;
 	if (spage >= 0) {
-		tmp_start = allowed_start + (spage * stm->dev->fl_ps);
+		tmp_start = stm32_page_addr(stm->dev, spage);
 	} else {
 		if(relative_addr)
 			tmp_start += start_addr;
 		else
 			tmp_start = start_addr;
 		if(mem_type == MEM_TYPE_FLASH)
-			spage = (tmp_start - stm->dev->fl_start) / stm->dev->fl_ps;
+			spage = stm32_page_of(stm->dev, tmp_start);
 	}
 	if(exec_flag == EXEC_FLAG_REL) {
 		execute += allowed_start;
@@ -500,7 +767,7 @@ int calc_workspace(FILE *diag, uint32_t *start, uint32_t *end)
 
 /*Step 3. claculate readwrite_len and npages*/
 	if (!readwrite_len && npages)
-		readwrite_len = (npages == 0xFFFF)?(allowed_end - allowed_start):(npages * stm->dev->fl_ps);
+		readwrite_len = (npages == 0xFFFF)?(allowed_end - allowed_start):(stm32_page_addr(stm->dev, spage + npages) - tmp_start);
 	if (readwrite_len) {
 		tmp_end = tmp_start + readwrite_len;
 	} else {
@@ -508,13 +775,9 @@ int calc_workspace(FILE *diag, uint32_t *start, uint32_t *end)
 		readwrite_len = tmp_end - tmp_start;
 	}
 	if (mem_type == MEM_TYPE_FLASH) {
-		if (npages == 0) {
-			npages = 1; //clear spage
-			int spage_offset = tmp_start - ((spage * stm->dev->fl_ps) + stm->dev->fl_start);
-			int len_from_spage = spage_offset + readwrite_len - 1;
-			npages += (len_from_spage) / stm->dev->fl_ps;
-		}
-		if((spage == 0) && (npages*stm->dev->fl_ps) >= stm->dev->fl_end - stm->dev->fl_start)
+		if (npages == 0)
+			npages = stm32_page_of(stm->dev, tmp_end - 1) - spage + 1;
+		if((spage == 0) && stm32_page_addr(stm->dev, npages) >= stm->fl_end)
 		{
 			npages = 0xFFFF;	//full memory
 		}
@@ -527,7 +790,7 @@ int calc_workspace(FILE *diag, uint32_t *start, uint32_t *end)
 		return 0;
 	}
 	if ((exec_flag == EXEC_FLAG_ABS) &&
-	    (execute < stm->dev->fl_start   || execute >= stm->dev->fl_end) &&
+	    (execute < stm->dev->fl_start   || execute >= stm->fl_end) &&
 	    (execute < stm->dev->ram_bl_res || execute >= stm->dev->ram_end)) {
 		fprintf(stderr, "ERROR: Execution address (0x%08x) must be in flash or RAM\n", execute);
 		return 0;
@@ -556,17 +819,25 @@ int parse_options(int argc, char *argv[]) {
 	char full_erase = 0;
 	char show_help_and_exit = 0;
 
-	while((c = getopt(argc, argv, "p:b:r:w:vn:g:ujkeiM:REKfchs:S:V:")) != -1) {
+	static const struct option long_options[] = {
+		{"dry-run", no_argument, NULL, OPT_DRY_RUN},
+		{NULL, 0, NULL, 0}
+	};
+
+	while((c = getopt_long(argc, argv, "p:b:r:w:vdC:n:g:ujkeiLM:REKfcAXzB:lhs:S:T:F:V:", long_options, NULL)) != -1) {
 		switch(c) {
 			case 'p':
 				device = optarg;
 				break;
 			case 'b':
-				baudRate = serial_get_baud(strtoul(optarg, NULL, 0));
-				if (baudRate == SERIAL_BAUD_INVALID) {
-					fprintf(stderr,	"Invalid baud rate, valid options are:\n");
-					for(baudRate = SERIAL_BAUD_1200; baudRate != SERIAL_BAUD_INVALID; ++baudRate)
-						fprintf(stderr, " %d\n", serial_get_baud_int(baudRate));
+				if (strncmp(optarg, "auto", 4) == 0 && (optarg[4] == 0 || optarg[4] == ':')) {
+					auto_baud = 1;
+					baudRate = optarg[4] ? strtoul(optarg + 5, NULL, 0) : AUTOBAUD_CEILING;
+				} else {
+					baudRate = strtoul(optarg, NULL, 0);
+				}
+				if (baudRate == 0) {
+					fprintf(stderr,	"ERROR: Invalid baud rate\n");
 					return 1;
 				}
 				break;
@@ -624,12 +895,22 @@ int parse_options(int argc, char *argv[]) {
 				}
 				spage = 0;
 				npages = 0xFFFF;
+				pages_given = 1;
 				break;
 
 			case 'v':
 				verify = 1;
 				break;
 
+			case 'd':
+				diff_flag = 1;
+				break;
+
+			case 'C':
+				cache_file = optarg;
+				diff_flag  = 1;
+				break;
+
 			case 'n':
 				retry = strtoul(optarg, NULL, 0);
 				break;
@@ -651,6 +932,7 @@ int parse_options(int argc, char *argv[]) {
 					return 1;
 				} else {
 					char *pLen;
+					pages_given = 1;
 					spage = strtoul(optarg, &pLen, 0);
 					if (*pLen == ':') {
 						pLen++;
@@ -716,9 +998,39 @@ int parse_options(int argc, char *argv[]) {
 			case 'i':
 				show_info = 1;
 				break;
+			case 'L':
+				discover_flag = 1;
+				break;
 			case 'c':
 				init_flag = 0;
 				break;
+			case 'A':
+				deferred_ack = 1;
+				break;
+			case 'X':
+				use_applet = 1;
+				break;
+			case 'z':
+				use_applet = 1;
+				compress_flag = 1;
+				break;
+			case 'B':
+				use_applet = 1;
+				applet_baud = strtoul(optarg, NULL, 0);
+				if (applet_baud == 0) {
+					fprintf(stderr,	"ERROR: Invalid baud rate\n");
+					return 1;
+				}
+				break;
+			case 'l':
+				low_latency = 1;
+				break;
+			case 'T':
+				trace_file = optarg;
+				break;
+			case 'F':
+				fault_spec = optarg;
+				break;
 			case 'V':
 				verbose = strtoul(optarg, NULL, 0);
 				if (verbose > 3 || verbose < 0) {
@@ -726,6 +1038,9 @@ int parse_options(int argc, char *argv[]) {
 					return 1;
 				}
 				break;
+			case OPT_DRY_RUN:
+				dry_run = 1;
+				break;
 			case 'h':
 				show_help_and_exit = 1;
 			default:
@@ -742,17 +1057,29 @@ int parse_options(int argc, char *argv[]) {
 		device = argv[c];
 	}
 
-	if (device == NULL) {
+	if (device == NULL && !discover_flag) {
 		fprintf(stderr, "ERROR: Device not specified\n");
 		show_help(argv[0], SERIAL_DEFAULT_PORTNAME);
 		return 1;
 	}
 
 	if (show_help_and_exit) {
-		show_help(argv[0], device);
+		show_help(argv[0], device ? device : SERIAL_DEFAULT_PORTNAME);
 		return 1;
 	}
 
+	if (use_applet && !(rd || wr)) {
+		fprintf(stderr, "ERROR: Invalid usage, -X, -z and -B are only valid when reading or writing\n");
+		return 1;
+	}
+	if (!wr && dry_run) {
+		fprintf(stderr, "ERROR: Invalid usage, --dry-run is only valid when writing\n");
+		return 1;
+	}
+	if (diff_flag && (!wr || mem_type != MEM_TYPE_FLASH || full_erase || filename[0] == '-')) {
+		fprintf(stderr, "ERROR: Invalid usage, -d and -C are only valid when writing flash from a file, without -E\n");
+		return 1;
+	}
 	if (!wr && verify) {
 		fprintf(stderr, "ERROR: Invalid usage, -v is only valid when writing\n");
 		show_help(argv[0], device);
@@ -776,8 +1103,8 @@ int parse_options(int argc, char *argv[]) {
 	} else if (disable_reset) {
 		reset_flag = 0;
 	}
-	if (!(rd || wr || rp || ru || wu || eraseOnly || exec_flag || show_info || reset)) {
-		fprintf(stderr, "ERROR: Nothing to do, use at least one of -rwujkegiR\n");
+	if (!(rd || wr || rp || ru || wu || eraseOnly || exec_flag || show_info || reset || discover_flag)) {
+		fprintf(stderr, "ERROR: Nothing to do, use at least one of -rwujkegiLR\n");
 		return 1;
 	}
 	return 0;
@@ -786,11 +1113,16 @@ int parse_options(int argc, char *argv[]) {
 void show_help(char *name, char *ser_port) {
 	fprintf(stderr, "stmflasher v0.6.3 current - http://developer.berlios.de/projects/stmflasher/\n\n");
 	fprintf(stderr,
-		"Usage: %s -p ser_port [-b rate] [-EvKfc] [-S [+]address[:length]] [-s start_page[:n_pages]]\n"
-		"	[-n count] [-r|w filename] [-M f|r|e|a] [-ujkeiR] [-g [+]address] [-V level] [-h]\n"
+		"Usage: %s -p ser_port [-b rate] [-EvdKfcAXzl] [-C cache_file] [-S [+]address[:length]] [-s start_page[:n_pages]]\n"
+		"	[-n count] [-r|w filename] [-M f|r|e|a] [-ujkeiLR] [-g [+]address] [-T trace_file]\n"
+		"	[-B rate] [-F faults] [-V level] [--dry-run] [-h]\n"
 		"\n"
-		"	-p ser_port	Serial port name\n"
-		"	-b ser_port	Serial port baud rate (default 57600)\n"
+		"	-p ser_port	Serial port name, tcp://host:port of serial server\n"
+		"			or replay://trace_file to play back a recorded session\n"
+		"	-b rate		Serial port baud rate (default 57600), any rate on Linux\n"
+		"	-b auto[:rate]	Fastest reliable rate up to the given one (default 921600),\n"
+		"			lowered during the transfer if the link gets unreliable\n"
+		"			(the target is restarted, BOOT0 must stay high)\n"
 		"\n"
 		"	-r filename	Read flash to file (stdout if \"-\")\n"
 		"	-w filename	Write flash from file (stdin if \"-\")\n"
@@ -800,11 +1132,20 @@ void show_help(char *name, char *ser_port) {
 		"	-e		Erase only\n"
 		"	-g [+]address	Start execution at specified address (0 = flash start)\n"
 		"	-i		Print information about target device and serial mode\n"
+		"	-L		Look for bootloaders on all USB-serial ports at once, or on the\n"
+		"			ports matching -p (comma separated globs), and list them\n"
 		"	-R 		Reset controller (default for read/write/erase/etc)\n"
 		"\n"
 		"	-E		Full erase\n"
-		"	-v		Verify writes\n"
-		"	-n count	Retry failed writes up to count times (default 10)\n"
+		"	-v		Verify writes (by CRC on the target with -X or when the\n"
+		"			bootloader has Get Checksum, what differs is read back)\n"
+		"	-d		Erase and write only the pages that differ from the image,\n"
+		"			by a CRC of each page (Get Checksum) or reading it back\n"
+		"	-C cache_file	As -d, but the pages the cache file has for the unique ID\n"
+		"			of the target as last written are only checked by a CRC\n"
+		"			of each run of them (a few read back without Get Checksum);\n"
+		"			the file is updated after the write\n"
+		"	-n count	Retry failed block transfers up to count times (default 10)\n"
 		"	-S [+]address[:length]	Specify start address and optionally length for\n"
 		"				read/write/erase operations\n"
 		"	-s start_page[:n_pages]	Specify start address at page <start_page> (0 = flash start)\n"
@@ -816,6 +1157,21 @@ void show_help(char *name, char *ser_port) {
 		"	-c		Resume the connection (don't send initial INIT)\n"
 		"			*Baud rate must be kept the same as the first init*\n"
 		"			This is useful with -K or if the reset fails\n"
+		"	-A		Send read/write command, address and data without waiting\n"
+		"			for each ACK (falls back to lock-step if the target can't keep up)\n"
+		"	-X		Read/write flash through a RAM applet, faster than the\n"
+		"			bootloader (USART1, F0/F1/F2/F3/F4)\n"
+		"	-z		Compress the image and write it through the RAM applet (-X),\n"
+		"			blocks which don't shrink are sent as they are\n"
+		"	-B rate		RAM applet (-X) at this rate, the bootloader's is kept\n"
+		"			if there is no link at it\n"
+		"	--dry-run	Print how a write (-w) would erase, the commands, bytes\n"
+		"			on the wire and estimated time, then stop\n"
+		"	-l		Low latency mode of USB-serial adapter (Linux, restored on exit)\n"
+		"	-T trace_file	Record all serial traffic with timestamps to trace_file\n"
+		"	-F faults	Inject faults into serial traffic (testing), comma separated:\n"
+		"			seed=N, drop=P, flip=P, nack=P, delay=P[:ms], stall=P[:ms]\n"
+		"			P is the probability per byte (per transfer for stall)\n"
 		"	-V level	Verbose output level (0 - silent, 1 - default, 2 - debug)\n"
 		"\n"
 		"	-h		Show this help\n"
@@ -843,3 +1199,477 @@ void show_help(char *name, char *ser_port) {
 	);
 }
 
+/* throughput of the payload, with the share lost to retries */
+void show_goodput(FILE *diag, const char *what, uint32_t bytes, uint64_t t_start) {
+	uint64_t t = now_us() - t_start;
+
+	fprintf(diag, "%s %u bytes in %u.%03u s (%.0f B/s), %lu retries, %u.%03u s recovering\n",
+		what, bytes,
+		(unsigned int)(t / 1000000), (unsigned int)(t / 1000 % 1000),
+		t ? bytes * 1e6 / t : 0.0,
+		retries,
+		(unsigned int)(recover_us / 1000000), (unsigned int)(recover_us / 1000 % 1000)
+	);
+}
+
+/* -v with Get Checksum: compare the CRC of data written at address, read
+ * it back only if that differs, to find the bad byte. data has room for
+ * the padding of the last word, as the bootloader wrote it.
+ */
+char verify_span(FILE *diag, uint32_t address, uint8_t *data, unsigned int len) {
+	uint8_t compare[256];
+	unsigned int i, l, r, failed = 0;
+	uint32_t crc;
+
+	while(len % 4)
+		data[len++] = 0xFF;
+	while(!stm32_crc_memory(stm, address, len, &crc)) {
+		if (failed++ == retry) {
+			fprintf(stderr, "Failed to get the CRC at address 0x%08x\n", address);
+			return 0;
+		}
+		recover(diag);
+	}
+	if (crc == crc32_unit(data, len))
+		return 1;
+
+	for(i = 0; i < len; i += l) {
+		l = len - i > sizeof(compare) ? sizeof(compare) : len - i;
+		while(!stm32_read_memory(stm, address + i, compare, l)) {
+			if (failed++ == retry) {
+				fprintf(stderr, "Failed to read memory at address 0x%08x\n", address + i);
+				return 0;
+			}
+			recover(diag);
+		}
+		for(r = 0; r < l; r++) {
+			if (data[i + r] != compare[r]) {
+				fprintf(stderr, "Failed to verify at address 0x%08x, expected 0x%02x and found 0x%02x\n",
+					address + i + r, data[i + r], compare[r]);
+				return 0;
+			}
+		}
+	}
+	return 1;
+}
+
+/* Pages of [start, end) the image sets data in, a hex file may leave gaps
+ * which are not erased then. Fills touched and erase_list with them and
+ * returns their count, 0 if the parser can't tell: choose_plan weighs a
+ * list erase of them against the range.
+ */
+unsigned int image_pages(uint32_t start, uint32_t end) {
+	const parser_range_t *ranges;
+	unsigned int n, i, page, last, count = 0;
+	unsigned int pages = stm32_page_of(stm->dev, stm->fl_end - 1) + 1;
+
+	if (pages_given || !parser->ranges || !(n = parser->ranges(p_st, &ranges)))
+		return 0;
+
+	touched    = calloc(pages, 1);
+	erase_list = malloc(pages * sizeof(uint16_t));
+	if (!touched || !erase_list) {
+		fprintf(stderr, "Failed to allocate the page map\n");
+		free(touched);
+		free(erase_list);
+		touched    = NULL;
+		erase_list = NULL;
+		return 0;
+	}
+	for(i = 0; i < n; i++) {
+		uint32_t	from = start + ranges[i].offset;
+		uint32_t	to   = from + ranges[i].len;
+
+		if (to > end)
+			to = end;
+		if (from >= to)
+			continue;
+		last = stm32_page_of(stm->dev, to - 1);
+		for(page = stm32_page_of(stm->dev, from); page <= last; page++)
+			touched[page] = 1;
+	}
+	for(page = 0; page < pages; page++)
+		if (touched[page])
+			erase_list[count++] = page;
+
+	return erase_count = count;
+}
+
+/* -d: whether len bytes of flash at address hold data, by a CRC of them
+ * if the bootloader has Get Checksum, else reading them back. data has
+ * the 0xFF padding of the last word, as the bootloader wrote it.
+ */
+char page_differs(FILE *diag, uint32_t address, const uint8_t *data, unsigned int len, char *differs) {
+	uint8_t compare[256];
+	unsigned int i, l, failed = 0;
+	uint32_t crc;
+
+	if (stm->cmd->crc != STM32_CMD_NONE) {
+		len = (len + 3) & ~3;
+		while(!stm32_crc_memory(stm, address, len, &crc)) {
+			if (failed++ == retry) {
+				fprintf(stderr, "Failed to get the CRC at address 0x%08x\n", address);
+				return 0;
+			}
+			recover(diag);
+		}
+		*differs = crc != crc32_unit(data, len);
+		return 1;
+	}
+
+	*differs = 0;
+	for(i = 0; i < len && !*differs; i += l) {
+		l = len - i > sizeof(compare) ? sizeof(compare) : len - i;
+		while(!stm32_read_memory(stm, address + i, compare, l)) {
+			if (failed++ == retry) {
+				fprintf(stderr, "Failed to read memory at address 0x%08x\n", address + i);
+				return 0;
+			}
+			recover(diag);
+		}
+		*differs = memcmp(data + i, compare, l) != 0;
+	}
+	return 1;
+}
+
+/* the part of a page from start to end the image sets, with its CRC as
+ * Get Checksum takes it
+ */
+void page_part(cache_entry_t *e, unsigned int page, uint32_t start, uint32_t end) {
+	uint32_t from = stm32_page_addr(stm->dev, page);
+	uint32_t to   = stm32_page_addr(stm->dev, page + 1);
+
+	if (from < start)
+		from = start;
+	if (to > end)
+		to = end;
+	memcpy(e->uid, uid, STM32_UID_LEN);
+	e->page    = page;
+	e->address = from;
+	e->len     = to - from;
+	e->crc     = crc32_unit(image + (from - start), (e->len + 3) & ~3);
+}
+
+char diff_page(FILE *diag, unsigned int page, uint32_t start, uint32_t end, char *differs) {
+	cache_entry_t e;
+
+	page_part(&e, page, start, end);
+	return page_differs(diag, e.address, image + (e.address - start), e.len, differs);
+}
+
+/* -d: read the image in and leave in touched and erase_list only the
+ * pages of it that differ from the flash, the rest is neither erased
+ * nor written. With -C the pages the cache has as they are in the image
+ * are not compared one by one, only checked together.
+ * return value: 0 if error; 1 if OK
+ */
+char diff_pages(FILE *diag, uint32_t start, uint32_t end, uint32_t size) {
+	unsigned int pages = stm32_page_of(stm->dev, stm->fl_end - 1) + 1;
+	unsigned int page, first, last, i, j, n = 0, hits = 0;
+	const cache_entry_t *c;
+	cache_entry_t e;
+	uint32_t offset, to;
+	uint16_t *list, tmp;
+	unsigned int len;
+	char differs;
+
+	if (!(image = malloc(size + 3))) {
+		fprintf(stderr, "Failed to allocate memory for the image\n");
+		return 0;
+	}
+	memset(image + size, 0xFF, 3);
+	for(offset = 0; offset < size; offset += len) {
+		len = size - offset > 16384 ? 16384 : size - offset;
+		if (parser->read(p_st, image + offset, &len) != PARSER_ERR_OK || len == 0) {
+			fprintf(stderr, "Failed to read input file\n");
+			return 0;
+		}
+	}
+
+	if (end > start + size)
+		end = start + size;
+	first = stm32_page_of(stm->dev, start);
+	last  = stm32_page_of(stm->dev, end - 1);
+
+	/* the pages of the range for a contiguous image */
+	if (!touched)
+		image_pages(start, end);
+	if (!touched) {
+		touched    = calloc(pages, 1);
+		erase_list = malloc(pages * sizeof(uint16_t));
+		if (!touched || !erase_list) {
+			fprintf(stderr, "Failed to allocate the page map\n");
+			return 0;
+		}
+		memset(touched + first, 1, last - first + 1);
+	}
+
+	/* the pages of the image, those the cache has first */
+	list = erase_list;
+	for(page = first; page <= last; page++) {
+		if (!touched[page])
+			continue;
+		list[n++] = page;
+		if (!cache || !(c = cache_find(cache, uid, page)))
+			continue;
+		page_part(&e, page, start, end);
+		if (c->address == e.address && c->len == e.len && c->crc == e.crc) {
+			list[n - 1] = list[hits];
+			list[hits++] = page;
+		}
+	}
+
+	if(verbose) {
+		fprintf(diag, "Comparing pages by %s... ", stm->cmd->crc != STM32_CMD_NONE ? "CRC" : "reading back");
+		fflush(diag);
+	}
+	/* check what the cache has: a CRC of each run of pages in it, or read
+	 * back a few of them at random if the bootloader has no Get Checksum
+	 */
+	srand(now_us());
+	for(i = 0; i < hits; i = j) {
+		if (stm->cmd->crc != STM32_CMD_NONE) {
+			for(j = i + 1; j < hits && list[j] == list[j - 1] + 1; j++);
+		} else if (i < CACHE_SPOT_CHECKS) {
+			j = i + rand() % (hits - i);
+			tmp = list[i], list[i] = list[j], list[j] = tmp;
+			j = i + 1;
+		} else
+			break;
+		page_part(&e, list[j - 1], start, end);
+		to = e.address + e.len;
+		page_part(&e, list[i], start, end);
+		if (!page_differs(diag, e.address, image + (e.address - start), to - e.address, &differs))
+			return 0;
+		if (differs) {
+			fprintf(stderr, "\nWARNING: The flash differs from the cache, comparing all pages\n");
+			hits = 0;
+			break;
+		}
+	}
+	for(i = 0; i < n; i++) {
+		differs = 0;
+		if (i >= hits && !diff_page(diag, list[i], start, end, &differs))
+			return 0;
+		touched[list[i]] = differs;
+	}
+
+	/* the cache keeps what is known to be in flash until the write is done */
+	if (cache && !dry_run) {
+		cache_forget(cache, uid, CACHE_ALL);
+		for(i = 0; i < n; i++) {
+			page_part(&e, list[i], start, end);
+			if (!touched[list[i]] && !cache_add(cache, &e))
+				return 0;
+		}
+		if (!cache_save(cache))
+			fprintf(stderr, "WARNING: Failed to write the cache\n");
+	}
+
+	for(erase_count = 0, page = first; page <= last; page++)
+		if (touched[page])
+			erase_list[erase_count++] = page;
+	if(verbose) {
+		fprintf(diag, "%u of %u pages differ, %u skipped", erase_count, n, n - erase_count);
+		if (cache)
+			fprintf(diag, " (%u as the cache has them)", hits);
+		fprintf(diag, ".\n");
+	}
+	return 1;
+}
+
+/* -C: the pages just written go into the cache, those that don't fit
+ * are compared on the target next time
+ */
+void cache_written(uint32_t start, uint32_t end) {
+	cache_entry_t e;
+	unsigned int i;
+
+	for(i = 0; i < erase_count; i++) {
+		page_part(&e, erase_list[i], start, end);
+		if (!cache_add(cache, &e))
+			break;
+	}
+	if (i < erase_count)
+		fprintf(stderr, "WARNING: %u of the pages written are not in the cache\n", erase_count - i);
+	if (!cache_save(cache))
+		fprintf(stderr, "WARNING: Failed to write the cache\n");
+}
+
+/* The cheapest way to erase for a write of size bytes from start, by
+ * estimated time: the whole flash only if the range covers it, the pages
+ * the image sets data in if it has gaps, or the range of pages. -E and -s
+ * decide themselves.
+ */
+void choose_plan(plan_t *best, uint32_t start, uint32_t end, uint32_t size) {
+	unsigned int all = stm32_page_of(stm->dev, stm->fl_end - 1) + 1;
+	unsigned int range = npages == 0xFFFF ? all : (unsigned int)npages;
+	unsigned int n, page, i;
+	char crc = verify && (use_applet || stm->cmd->crc != STM32_CMD_NONE);
+	uint32_t bytes = size;
+	plan_t p;
+
+	plan_init(best, stm, baudRate, use_applet, applet_baud, crc);
+	if (mem_type != MEM_TYPE_FLASH) {
+		plan_write(best, bytes, verify);
+		return;
+	}
+
+	n = touched ? erase_count : image_pages(start, end);
+	if (touched) {
+		/* the gaps over pages without data aren't written */
+		if (end > start + size)
+			end = start + size;
+		for(bytes = 0, page = stm32_page_of(stm->dev, start); page < all && stm32_page_addr(stm->dev, page) < end; page++) {
+			uint32_t from = stm32_page_addr(stm->dev, page);
+			uint32_t to   = stm32_page_addr(stm->dev, page + 1);
+
+			if (touched[page])
+				bytes += (to > end ? end : to) - (from < start ? start : from);
+		}
+	}
+
+	/* -d: the pages that didn't change keep their data */
+	if (diff_flag) {
+		plan_erase(best, PLAN_ERASE_LIST, n);
+		plan_write(best, bytes, verify);
+		return;
+	}
+
+	for(i = 0; i < 3; i++) {
+		plan_init(&p, stm, baudRate, use_applet, applet_baud, crc);
+		if (i == 0 && npages == 0xFFFF)
+			plan_erase(&p, PLAN_ERASE_MASS, all);
+		else if (i == 0 || (i == 1 && npages == 0xFFFF && !pages_given &&
+			 (stm->cmd->er == STM32_CMD_EE || all <= 256)))
+			plan_erase(&p, PLAN_ERASE_RANGE, range);
+		else if (i == 2 && touched && !pages_given && n < range)
+			plan_erase(&p, PLAN_ERASE_LIST, n);
+		else
+			continue;
+		plan_write(&p, bytes, verify);
+		if (i == 0 || plan_time(&p) < plan_time(best))
+			*best = p;
+	}
+}
+
+/* bytes on the wire against bytes written, and what that made of the rate */
+void show_compression(FILE *diag, uint64_t t_start) {
+	const applet_stats_t *st = applet_stats(applet);
+	uint64_t t = now_us() - t_start;
+
+	fprintf(diag, "Compressed %lu bytes to %lu (%.1f%%), %u of %u frames packed, %.0f B/s effective\n",
+		st->data, st->wire,
+		st->data ? 100.0 * st->wire / st->data : 0.0,
+		st->packed, st->packed + st->raw,
+		t ? st->data * 1e6 / t : 0.0
+	);
+}
+
+/* next standard rate below baud, 0 under AUTOBAUD_FLOOR */
+unsigned int baud_below(unsigned int baud) {
+	int b;
+
+	for(b = SERIAL_BAUD_INVALID - 1; b >= 0; b--) {
+		unsigned int rate = serial_get_baud_int(b);
+		if (rate < baud)
+			return rate >= AUTOBAUD_FLOOR ? rate : 0;
+	}
+	return 0;
+}
+
+/* -b auto: walk the standard rates down from the ceiling and take the first
+ * one the bootloader answers at and passes the link check at. The bootloader
+ * only measures the rate on its first INIT, so once it has answered it is
+ * restarted for every lower rate.
+ * return value: initialized target or NULL
+ */
+stm32_t* auto_baud_init(FILE *diag) {
+	stm32_t *target = NULL;
+	unsigned int rate, next;
+
+	for(rate = baudRate; rate; rate = next) {
+		next = baud_below(rate);
+		if (!target) {
+			if (serial_setup(serial, rate, SERIAL_BITS_8, SERIAL_PARITY_EVEN, SERIAL_STOPBIT_1) != SERIAL_ERR_OK)
+				continue;
+			if (!stm32_probe(serial, 2)) {
+				if(verbose > 1) fprintf(diag, "%7u baud: no answer\n", rate);
+				continue;
+			}
+			if (!(target = stm32_init(serial, 0))) {
+				fprintf(stderr, "Bootloader answered at %u baud but can't be read, reset it and use a lower rate\n", rate);
+				return NULL;
+			}
+		}
+		if (stm32_check_link(target)) {
+			if(verbose > 1) fprintf(diag, "%7u baud: OK\n", rate);
+			baudRate = rate;
+			return target;
+		}
+		if(verbose > 1) fprintf(diag, "%7u baud: link check failed\n", rate);
+		if (next && !stm32_set_baud(target, next)) {
+			fprintf(stderr, "Failed to restart the bootloader at %u baud\n", next);
+			break;
+		}
+	}
+
+	if (rate == 0)
+		fprintf(stderr, "No reliable baud rate between %u and %u\n", AUTOBAUD_FLOOR, baudRate);
+	stm32_close(target);
+	return NULL;
+}
+
+/* A block transfer failed: bring the bootloader back in sync. With -b auto
+ * DOWNSHIFT_ERRORS failures within DOWNSHIFT_WINDOW blocks lower the rate
+ * to about 2/3 instead.
+ */
+void recover(FILE *diag) {
+	unsigned int rate;
+
+	/* the applet runs at the rate it was started at */
+	if (applet) {
+		applet_resync(applet);
+		return;
+	}
+
+	stm32_resync(stm);
+	if (!auto_baud || ++link_errors < DOWNSHIFT_ERRORS)
+		return;
+
+	link_errors = link_blocks = 0;
+	rate = baud_below(baudRate * 2 / 3 + 1);
+	if (!rate)
+		return;
+	if (!stm32_set_baud(stm, rate)) {
+		fprintf(stderr, "\nFailed to restart the bootloader at %u baud\n", rate);
+		return;
+	}
+	if(verbose) fprintf(diag, "\nLink unreliable, baud rate lowered to %u\n", rate);
+	baudRate = rate;
+	downshifts++;
+}
+
+/* a block went through, failures older than the window are forgotten */
+void link_ok(void) {
+	if (++link_blocks == DOWNSHIFT_WINDOW)
+		link_errors = link_blocks = 0;
+}
+
+/* -X: move the flash transfer to the RAM applet, the bootloader does it if
+ * the applet can't be used here
+ */
+void start_applet(FILE *diag) {
+	if (!use_applet || mem_type != MEM_TYPE_FLASH)
+		return;
+	if (!(applet = applet_start(stm))) {
+		fprintf(stderr, "RAM applet not available, using the bootloader\n");
+		return;
+	}
+	applet_len = applet_frame(applet);
+	if(verbose > 1) fprintf(diag, "RAM applet running, %u byte frames\n", applet_len);
+	if (compress_flag && !applet_compress(applet, 1))
+		fprintf(stderr, "No RAM for LZ4 blocks, the image goes out as it is\n");
+	if (applet_baud && applet_set_baud(applet, applet_baud))
+		if(verbose > 1) fprintf(diag, "RAM applet at %u baud\n", applet_baud);
+}
@@ -138,6 +138,7 @@ parser_t PARSER_BINARY = {
 	binary_close,
 	binary_size,
 	binary_read,
-	binary_write
+	binary_write,
+	NULL
 };
 
@@ -35,13 +35,57 @@
 typedef struct {
 	size_t		data_len, offset;
 	uint8_t		*data;
-	uint8_t		base;
+	uint32_t	base;		/* address of data[0] */
+	char		based;		/* base is fixed */
+	parser_range_t	*ranges;	/* bytes the records set */
+	unsigned int	n_ranges;
 } hex_t;
 
+/* internal functions */
+char hex_record(hex_t *st, uint32_t address, unsigned int len, uint8_t **record);
+
+
 void* hex_init() {
 	return calloc(sizeof(hex_t), 1);
 }
 
+/* room for a data record at address, the gap before it is 0xff */
+char hex_record(hex_t *st, uint32_t address, unsigned int len, uint8_t **record) {
+	parser_range_t *r;
+	size_t pos;
+
+	st->based = 1;	/* data before any address record is at 0 */
+
+	/* we cant cope with files out of order */
+	if (address < st->base)
+		return 0;
+	pos = address - st->base;
+
+	if (pos + len > st->data_len) {
+		uint8_t *data = realloc(st->data, pos + len);
+		if (!data)
+			return 0;
+		st->data = data;
+		memset(&st->data[st->data_len], 0xff, pos + len - st->data_len);
+		st->data_len = pos + len;
+	}
+	*record = &st->data[pos];
+
+	r = st->n_ranges ? &st->ranges[st->n_ranges - 1] : NULL;
+	if (r && r->offset + r->len == pos) {
+		r->len += len;
+	} else if (len) {
+		r = realloc(st->ranges, (st->n_ranges + 1) * sizeof(parser_range_t));
+		if (!r)
+			return 0;
+		st->ranges = r;
+		r = &st->ranges[st->n_ranges++];
+		r->offset = pos;
+		r->len    = len;
+	}
+	return 1;
+}
+
 parser_err_t hex_open(void *storage, const char *filename, const char write) {
 	hex_t *st = storage;
 	if (write) {
@@ -51,8 +95,7 @@ parser_err_t hex_open(void *storage, const char *filename, const char write) {
 		int i, fd;
 		uint8_t checksum;
 		unsigned int c;
-		uint32_t base = 0;
-		unsigned int last_address = 0x0;
+		uint32_t base = 0, value = 0;
 
 		fd = open(filename, O_RDONLY);
 		if (fd < 0)
@@ -62,17 +105,18 @@ parser_err_t hex_open(void *storage, const char *filename, const char write) {
 
 		while(read(fd, &mark, 1) != 0) {
 			if (mark == '\n' || mark == '\r') continue;
-			if (mark != ':')
+			if (mark != ':') {
+				close(fd);
 				return PARSER_ERR_INVALID_FILE;
+			}
 
 			char buffer[9];
 			unsigned int reclen, address, type;
-			uint8_t *record;
+			uint8_t *record = NULL;
 
 			/* get the reclen, address, and type */
 			buffer[8] = 0;
-			if (read(fd, &buffer, 8) != 8) return PARSER_ERR_INVALID_FILE;
-			if (sscanf(buffer, "%2x%4x%2x", &reclen, &address, &type) != 3) {
+			if (read(fd, &buffer, 8) != 8 || sscanf(buffer, "%2x%4x%2x", &reclen, &address, &type) != 3) {
 				close(fd);
 				return PARSER_ERR_INVALID_FILE;
 			}
@@ -84,34 +128,13 @@ parser_err_t hex_open(void *storage, const char *filename, const char write) {
 				((address & 0x00FF) >> 0) +
 				type;
 
-			switch(type) {
-				/* data record */
-				case 0:
-					c = address - last_address;
-					st->data = realloc(st->data, st->data_len + c + reclen);
-
-					/* if there is a gap, set it to 0xff and increment the length */
-					if (c > 0) {
-						memset(&st->data[st->data_len], 0xff, c);
-						st->data_len += c;
-					}
-
-					last_address = address + reclen;
-					record = &st->data[st->data_len];
-					st->data_len += reclen;
-					break;
-
-				/* extended segment address record */
-				case 2:
-					base = 0;
-					break;
-
-				/* extended linear address record */
-				case 4:
-					base = address;
-					break;
+			/* data record */
+			if (type == 0 && !hex_record(st, base + address, reclen, &record)) {
+				close(fd);
+				return PARSER_ERR_INVALID_FILE;
 			}
 
+			value = 0;
 			buffer[2] = 0;
 			for(i = 0; i < reclen; ++i) {
 				if (read(fd, &buffer, 2) != 2 || sscanf(buffer, "%2x", &c) != 1) {
@@ -122,16 +145,10 @@ parser_err_t hex_open(void *storage, const char *filename, const char write) {
 				/* add the byte to the checksum */
 				checksum += c;
 
-				switch(type) {
-					case 0:
-						record[i] = c;
-						break;
-
-					case 2:
-					case 4:
-						base = (base << 8) | c;
-						break;
-				}
+				if (type == 0)
+					record[i] = c;
+				else
+					value = (value << 8) | c;
 			}
 
 			/* read, scan, and verify the checksum */
@@ -150,31 +167,17 @@ parser_err_t hex_open(void *storage, const char *filename, const char write) {
 					close(fd);
 					return PARSER_ERR_OK;
 
-				/* address record */
-				case 2: base = base << 4;
-				case 4:	base = be_u32(base);
-					/* Reset last_address since our base changed */
-					last_address = 0;
-
-					if (st->base == 0) {
-						st->base = base;
-						break;
-					}
-
-					/* we cant cope with files out of order */
-					if (base < st->base) {
-						close(fd);
-						return PARSER_ERR_INVALID_FILE;
-					}
-
-					/* if there is a gap, enlarge and fill with zeros */
-					unsigned int len = base - st->base;
-					if (len > st->data_len) {
-						st->data = realloc(st->data, len);
-						memset(&st->data[st->data_len], 0, len - st->data_len);
-						st->data_len = len;
-					}
-					break;
+				/* extended segment address record */
+				case 2: base = value << 4;  break;
+
+				/* extended linear address record */
+				case 4: base = value << 16; break;
+			}
+
+			/* data[0] is at the first address record, unless data came before it */
+			if ((type == 2 || type == 4) && !st->based) {
+				st->base  = base;
+				st->based = 1;
 			}
 		}
 
@@ -185,7 +188,10 @@ parser_err_t hex_open(void *storage, const char *filename, const char write) {
 
 parser_err_t hex_close(void *storage) {
 	hex_t *st = storage;
-	if (st) free(st->data);
+	if (st) {
+		free(st->data);
+		free(st->ranges);
+	}
 	free(st);
 	return PARSER_ERR_OK;
 }
@@ -211,6 +217,12 @@ parser_err_t hex_write(void *storage, void *data, unsigned int len) {
 	return PARSER_ERR_RDONLY;
 }
 
+unsigned int hex_ranges(void *storage, const parser_range_t **ranges) {
+	hex_t *st = storage;
+	*ranges = st->ranges;
+	return st->n_ranges;
+}
+
 parser_t PARSER_HEX = {
 	"Intel HEX",
 	hex_init,
@@ -218,6 +230,7 @@ parser_t PARSER_HEX = {
 	hex_close,
 	hex_size,
 	hex_read,
-	hex_write
+	hex_write,
+	hex_ranges
 };
 
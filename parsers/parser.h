@@ -27,6 +27,12 @@
 
 typedef struct parser     parser_t;
 typedef enum   parser_err parser_err_t;
+typedef struct parser_range parser_range_t;
+
+/* bytes of the data the file really sets, from the first byte of it */
+struct parser_range {
+	unsigned int offset, len;
+};
 
 struct parser {
 	const char *name;
@@ -36,6 +42,7 @@ struct parser {
 	unsigned int (*size )(void *storage);						/* get the total data size */
 	parser_err_t (*read )(void *storage, void *data, unsigned int *len);		/* read a block of data */
 	parser_err_t (*write)(void *storage, void *data, unsigned int len);		/* write a block of data */
+	unsigned int (*ranges)(void *storage, const parser_range_t **ranges);		/* parts of the data set, 0 - all, NULL if the format has no gaps */
 };
 
 enum parser_err {
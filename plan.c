@@ -0,0 +1,186 @@
+/*
+  stmflasher - Open Source ST MCU flash program for *nix
+  Copyright (C) 2010 Geoffrey McRae <geoff@spacevs.com>
+  Copyright (C) 2011 Steve Markgraf <steve@steve-m.de>
+  Copyright (C) 2012 Tormod Volden
+  Copyright (C) 2012-2013 Alatar <alatar_@list.ru>
+
+  This program is free software; you can redistribute it and/or
+  modify it under the terms of the GNU General Public License
+  as published by the Free Software Foundation; either version 2
+  of the License, or (at your option) any later version.
+
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with this program; if not, write to the Free Software
+  Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+*/
+
+#include <string.h>
+
+#include "plan.h"
+#include "applet.h"
+
+#define PLAN_BITS		11	/* 8E1 byte on the wire */
+#define PLAN_BLOCK		256	/* bytes of a bootloader read/write */
+#define PLAN_FRAME		1024	/* applet write frame, less if RAM is short */
+#define PLAN_READ		4096	/* applet read request */
+#define PLAN_SPAN		16384	/* bytes -v takes one CRC over */
+#define PLAN_HALFWORD_US	80	/* us to program a half-word, at most */
+
+/* internal functions */
+uint64_t plan_wire(plan_t *p, unsigned int baud, unsigned long tx, unsigned long rx, unsigned int turns);
+uint64_t plan_erase_cmd(plan_t *p, unsigned int pages, char mass);
+
+
+void plan_init(plan_t *p, const stm32_t *stm, unsigned int baud, char applet, unsigned int applet_baud, char crc) {
+	memset(p, 0, sizeof(plan_t));
+	p->stm    = stm;
+	p->baud   = baud;
+	p->applet = applet;
+	p->applet_baud = applet_baud ? applet_baud : baud;
+	p->crc    = crc;
+}
+
+/* us for bytes both ways at baud and turns of the line: the round trip
+ * measured at the bootloader's rate is a 2 byte command and its ACK, the
+ * rest of it is latency
+ */
+uint64_t plan_wire(plan_t *p, unsigned int baud, unsigned long tx, unsigned long rx, unsigned int turns) {
+	uint64_t byte_ns = 1000000000ULL * PLAN_BITS / baud;
+	uint64_t rtt_ns  = 1000000000ULL * PLAN_BITS / p->baud * 3;
+	uint64_t turn_us = p->stm->rtt > rtt_ns / 1000 ? p->stm->rtt - rtt_ns / 1000 : 0;
+
+	p->tx += tx;
+	p->rx += rx;
+	return (tx + rx) * byte_ns / 1000 + turns * turn_us;
+}
+
+/* one erase command: mass erase or a list of pages */
+uint64_t plan_erase_cmd(plan_t *p, unsigned int pages, char mass) {
+	const stm32_t *stm = p->stm;
+	char ee = stm->cmd->er == STM32_CMD_EE;
+	unsigned long frame;
+
+	p->commands++;
+	if (mass) {
+		frame = ee ? 3 : 2;
+		return plan_wire(p, p->baud, 2 + frame, 2, 2) + stm->dev->fl_met * 1000ULL;
+	}
+	frame = ee ? 2 + 2 * pages + 1 : 1 + pages + 1;
+	return plan_wire(p, p->baud, 2 + frame, 2, 2) + pages * stm->dev->fl_pet * 1000ULL;
+}
+
+void plan_erase(plan_t *p, plan_erase_t erase, unsigned int pages) {
+	unsigned int n;
+
+	p->erase = erase;
+	p->pages = pages;
+	switch(erase) {
+		case PLAN_ERASE_NONE:
+			break;
+		case PLAN_ERASE_MASS:
+			/* STM32L15xx does it page by page, see stm32_op_erase() */
+			p->erase_us += plan_erase_cmd(p, pages, p->stm->pid != 0x416 || p->stm->cmd->er != STM32_CMD_EE);
+			break;
+		case PLAN_ERASE_RANGE:
+			p->erase_us += plan_erase_cmd(p, pages, 0);
+			break;
+		case PLAN_ERASE_LIST:
+			for(; pages; pages -= n) {
+				n = pages > STM32_ERASE_BATCH ? STM32_ERASE_BATCH : pages;
+				p->erase_us += plan_erase_cmd(p, n, 0);
+			}
+			break;
+	}
+}
+
+void plan_write(plan_t *p, uint32_t bytes, char verify) {
+	unsigned int turns = p->stm->deferred_ack ? 1 : 3;
+	uint64_t wire, prog;
+	uint32_t n, left;
+
+	p->bytes += bytes;
+	if (p->applet) {
+		/* loaded by the bootloader, then frames with CRC-32 go while the
+		 * one before is programmed
+		 */
+		for(left = applet_code_length; left; left -= n) {
+			n = left > PLAN_BLOCK ? PLAN_BLOCK : left;
+			p->commands++;
+			p->write_us += plan_wire(p, p->baud, n + 9, 3, turns);
+		}
+		p->commands++;
+		p->write_us += plan_wire(p, p->baud, 2 + 5, 2, 2);
+		for(left = bytes; left; left -= n) {
+			n = left > PLAN_FRAME ? PLAN_FRAME : left;
+			p->commands++;
+			wire = plan_wire(p, p->applet_baud, 12 + n, 1, 0);
+			prog = (n + 1) / 2 * PLAN_HALFWORD_US;
+			p->write_us += wire > prog ? wire : prog;
+		}
+		p->write_us += plan_wire(p, p->applet_baud, 0, 0, 1);
+	} else {
+		for(left = bytes; left; left -= n) {
+			n = left > PLAN_BLOCK ? PLAN_BLOCK : left;
+			p->commands++;
+			p->write_us += plan_wire(p, p->baud, n + 9, 3, turns) + (n + 1) / 2 * PLAN_HALFWORD_US;
+		}
+	}
+
+	if (!verify)
+		return;
+	if (p->crc) {
+		for(left = bytes; left; left -= n) {
+			n = left > PLAN_SPAN ? PLAN_SPAN : left;
+			p->commands++;
+			p->verify_us += p->applet ? plan_wire(p, p->applet_baud, 16, 5, 1) : plan_wire(p, p->baud, 22, 11, 6);
+		}
+	} else {
+		for(left = bytes; left; left -= n) {
+			n = left > (p->applet ? PLAN_READ : PLAN_BLOCK) ? (p->applet ? PLAN_READ : PLAN_BLOCK) : left;
+			p->commands++;
+			p->verify_us += p->applet ? plan_wire(p, p->applet_baud, 16, n + 5, 1) : plan_wire(p, p->baud, 9, n + 3, turns);
+		}
+	}
+}
+
+uint64_t plan_time(const plan_t *p) {
+	return p->erase_us + p->write_us + p->verify_us;
+}
+
+const char* plan_name(const plan_t *p) {
+	switch(p->erase) {
+		case PLAN_ERASE_MASS : return "mass erase";
+		case PLAN_ERASE_RANGE: return "page range";
+		case PLAN_ERASE_LIST : return "page list";
+		default:
+			return "no erase";
+	}
+}
+
+void plan_show(const plan_t *p, FILE *out) {
+	uint64_t t = plan_time(p);
+
+	fprintf(out, "Plan          : %s", plan_name(p));
+	if (p->erase != PLAN_ERASE_NONE)
+		fprintf(out, " (%u pages)", p->pages);
+	fprintf(out, ", write %u bytes", p->bytes);
+	if (p->applet && p->applet_baud != p->baud)
+		fprintf(out, " through the RAM applet at %u baud", p->applet_baud);
+	else if (p->applet)
+		fprintf(out, " through the RAM applet");
+	fprintf(out, "%s\n",
+		!p->verify_us ? "" : p->crc ? ", verify by CRC" : ", verify by read-back");
+	fprintf(out, "Commands      : %u\n", p->commands);
+	fprintf(out, "Wire          : %lu bytes out, %lu bytes in\n", p->tx, p->rx);
+	fprintf(out, "Estimated time: %u.%03u s (erase %u.%03u s, write %u.%03u s, verify %u.%03u s)\n",
+		(unsigned int)(t / 1000000), (unsigned int)(t / 1000 % 1000),
+		(unsigned int)(p->erase_us / 1000000), (unsigned int)(p->erase_us / 1000 % 1000),
+		(unsigned int)(p->write_us / 1000000), (unsigned int)(p->write_us / 1000 % 1000),
+		(unsigned int)(p->verify_us / 1000000), (unsigned int)(p->verify_us / 1000 % 1000));
+}
@@ -0,0 +1,64 @@
+/*
+  stmflasher - Open Source ST MCU flash program for *nix
+  Copyright (C) 2010 Geoffrey McRae <geoff@spacevs.com>
+  Copyright (C) 2011 Steve Markgraf <steve@steve-m.de>
+  Copyright (C) 2012 Tormod Volden
+  Copyright (C) 2012-2013 Alatar <alatar_@list.ru>
+
+  This program is free software; you can redistribute it and/or
+  modify it under the terms of the GNU General Public License
+  as published by the Free Software Foundation; either version 2
+  of the License, or (at your option) any later version.
+
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with this program; if not, write to the Free Software
+  Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+*/
+
+
+#ifndef _H_PLAN
+#define _H_PLAN
+
+#include <stdio.h>
+#include <stdint.h>
+#include "stm32.h"
+
+/* Cost model of a write: bootloader commands, bytes on the wire and the
+ * wall time they take at the link's rate and round trip time, with the
+ * erase and program times of the device table (maximum values).
+ */
+typedef enum {
+	PLAN_ERASE_NONE,
+	PLAN_ERASE_MASS,	/* whole flash in one command */
+	PLAN_ERASE_RANGE,	/* pages spage to spage + npages in one command */
+	PLAN_ERASE_LIST		/* the pages the image sets data in */
+} plan_erase_t;
+
+typedef struct {
+	const stm32_t	*stm;
+	unsigned int	baud;
+	char		applet;		/* reads/writes through the RAM applet */
+	unsigned int	applet_baud;	/* rate the applet frames go at (-B) */
+	char		crc;		/* verify by CRC on the target */
+
+	plan_erase_t	erase;
+	unsigned int	pages;		/* erased */
+	uint32_t	bytes;		/* written */
+	unsigned int	commands;	/* bootloader commands or applet frames */
+	unsigned long	tx, rx;		/* bytes on the wire */
+	uint64_t	erase_us, write_us, verify_us;
+} plan_t;
+
+void     plan_init  (plan_t *p, const stm32_t *stm, unsigned int baud, char applet, unsigned int applet_baud, char crc);
+void     plan_erase (plan_t *p, plan_erase_t erase, unsigned int pages);
+void     plan_write (plan_t *p, uint32_t bytes, char verify);
+uint64_t plan_time  (const plan_t *p);
+const char* plan_name(const plan_t *p);
+void     plan_show  (const plan_t *p, FILE *out);
+
+#endif
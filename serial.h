@@ -32,6 +32,12 @@
   #define SERIAL_DEFAULT_PORTNAME			("/dev/ttyS0")
 #endif
 
+/* time to wait for data in serial_read() until serial_set_timeout() is called (ms) */
+#define SERIAL_DEFAULT_TIMEOUT			3000
+
+/* size of the receive buffer kept inside serial_t */
+#define SERIAL_RX_BUF_SIZE			4096
+
 typedef struct serial serial_t;
 
 typedef enum {
@@ -108,17 +114,38 @@ typedef enum {
 	SERIAL_ERR_NODATA
 } serial_err_t;
 
+/* traffic counters, one call is one write()/read() on the port */
+typedef struct {
+	unsigned long	tx_calls;
+	unsigned long	tx_bytes;
+	unsigned long	rx_calls;
+	unsigned long	rx_bytes;
+	unsigned long	turns;		/* round trips: waits for data after sending */
+} serial_stats_t;
+
 #ifdef __cplusplus
 extern "C" {
 #endif
 
 serial_t*    serial_open (const char *device);
 void         serial_close(serial_t *h);
-void         serial_flush(const serial_t *h);
-serial_err_t serial_setup(serial_t *h, const serial_baud_t baud, const serial_bits_t bits, const serial_parity_t parity, const serial_stopbit_t stopbit);
-serial_err_t serial_write(const serial_t *h, const void *buffer, unsigned int len);
-serial_err_t serial_read (const serial_t *h, const void *buffer, unsigned int len, unsigned int *readed);
+void         serial_flush(serial_t *h);
+serial_err_t serial_setup(serial_t *h, const unsigned int baud, const serial_bits_t bits, const serial_parity_t parity, const serial_stopbit_t stopbit);
+serial_err_t serial_write(serial_t *h, const void *buffer, unsigned int len);
+serial_err_t serial_read (serial_t *h, const void *buffer, unsigned int len, unsigned int *readed);
+serial_err_t serial_read_some(serial_t *h, void *buffer, unsigned int len, unsigned int *readed, unsigned int timeout);
+serial_err_t serial_peek (serial_t *h, void *buffer, unsigned int len);
+void         serial_consume(serial_t *h, unsigned int len);
+void         serial_set_timeout(serial_t *h, unsigned int timeout);
+serial_err_t serial_set_low_latency(serial_t *h);
+serial_err_t serial_record(serial_t *h, const char *filename);
+serial_err_t serial_inject_faults(serial_t *h, const char *spec);
 const char*  serial_get_setup_str(const serial_t *h);
+unsigned int serial_get_baud_actual(const serial_t *h);
+const char*  serial_get_backend_name(const serial_t *h);
+int          serial_get_fd(const serial_t *h);
+unsigned int serial_get_wire_us(const serial_t *h, unsigned int len);
+void         serial_get_stats(const serial_t *h, serial_stats_t *stats);
 
 /* common helper functions */
 serial_baud_t serial_get_baud            (const unsigned int baud);
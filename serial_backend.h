@@ -0,0 +1,60 @@
+/*
+  stmflasher - Open Source ST MCU flash program for *nix
+  Copyright (C) 2010 Geoffrey McRae <geoff@spacevs.com>
+  Copyright (C) 2011 Steve Markgraf <steve@steve-m.de>
+  Copyright (C) 2012 Tormod Volden
+  Copyright (C) 2012-2013 Alatar <alatar_@list.ru>
+
+  This program is free software; you can redistribute it and/or
+  modify it under the terms of the GNU General Public License
+  as published by the Free Software Foundation; either version 2
+  of the License, or (at your option) any later version.
+
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with this program; if not, write to the Free Software
+  Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+*/
+
+
+#ifndef _SERIAL_BACKEND_H
+#define _SERIAL_BACKEND_H
+
+#include "serial.h"
+
+typedef struct serial_backend serial_backend_t;
+
+/* Transport under serial_t. serial_common.c keeps the receive buffer,
+ * deadlines and counters, a backend only moves bytes.
+ */
+struct serial_backend {
+	const char *name;
+	const char *prefix;												/* device name prefix, NULL for the default backend */
+	void*        (*open  )(const char *device);									/* open the port */
+	void         (*close )(void *storage);										/* restore settings, close and free */
+	void         (*flush )(void *storage);										/* drop pending input */
+	serial_err_t (*setup )(void *storage, const unsigned int baud, const serial_bits_t bits,
+				const serial_parity_t parity, const serial_stopbit_t stopbit, unsigned int *baud_actual);	/* configure the line */
+	serial_err_t (*write )(void *storage, const void *buffer, unsigned int len, unsigned int *written);		/* one write, may be partial */
+	serial_err_t (*read  )(void *storage, void *buffer, unsigned int len, unsigned int *readed, unsigned int timeout);	/* wait up to timeout ms, read what is there */
+	serial_err_t (*low_latency)(void *storage);									/* tune the port for latency */
+	int          (*fd    )(void *storage);										/* descriptor to poll() for input, -1 if none */
+};
+
+extern serial_backend_t SERIAL_TTY;
+#ifndef __WIN32__
+extern serial_backend_t SERIAL_TCP;
+#endif
+extern serial_backend_t SERIAL_REPLAY;
+
+/* wrappers, created on top of an already opened transport */
+extern serial_backend_t SERIAL_RECORD;
+void* record_wrap(const serial_backend_t *backend, void *storage, const char *filename);
+extern serial_backend_t SERIAL_FAULT;
+void* fault_wrap(const serial_backend_t *backend, void *storage, const char *spec);
+
+#endif
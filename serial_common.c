@@ -20,7 +20,374 @@
   Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
 */
 
-#include "serial.h"
+#include <stdlib.h>
+#include <string.h>
+#include <stdio.h>
+
+#include "serial_backend.h"
+#include "utils.h"
+
+struct serial {
+	const serial_backend_t	*backend;
+	void			*storage;
+
+	char			configured;
+	unsigned int		baud;
+	unsigned int		baud_actual;
+	serial_bits_t		bits;
+	serial_parity_t		parity;
+	serial_stopbit_t	stopbit;
+
+	serial_stats_t		stats;
+	char			sent;    /* written since the last read */
+	unsigned int		timeout; /* ms to wait for data */
+
+	/* receive ring buffer */
+	uint8_t			rx_buf[SERIAL_RX_BUF_SIZE];
+	unsigned int		rx_head;
+	unsigned int		rx_len;
+};
+
+/* backends selected by device name prefix, SERIAL_TTY is the default */
+static serial_backend_t *serial_backends[] = {
+#ifndef __WIN32__
+	&SERIAL_TCP,
+#endif
+	&SERIAL_REPLAY,
+	NULL
+};
+
+static uint64_t     serial_deadline(const serial_t *h, unsigned int len);
+static serial_err_t serial_fill(serial_t *h, uint64_t deadline);
+static void         serial_copy(const serial_t *h, uint8_t *dst, unsigned int len);
+
+serial_t* serial_open(const char *device) {
+	const serial_backend_t *backend = &SERIAL_TTY;
+	serial_t *h;
+	int i;
+
+	for(i = 0; serial_backends[i]; i++) {
+		const char *prefix = serial_backends[i]->prefix;
+		if (strncmp(device, prefix, strlen(prefix)) == 0) {
+			backend = serial_backends[i];
+			device += strlen(prefix);
+			break;
+		}
+	}
+
+	h = calloc(sizeof(serial_t), 1);
+	if (!h)
+		return NULL;
+
+	h->backend = backend;
+	h->timeout = SERIAL_DEFAULT_TIMEOUT;
+	h->storage = backend->open(device);
+	if (!h->storage) {
+		free(h);
+		return NULL;
+	}
+
+	return h;
+}
+
+void serial_close(serial_t *h) {
+	if(!h)
+		return;
+
+	h->backend->close(h->storage);
+	free(h);
+}
+
+void serial_flush(serial_t *h) {
+	if(!h)
+		return;
+
+	h->backend->flush(h->storage);
+	h->rx_head = 0;
+	h->rx_len  = 0;
+}
+
+serial_err_t serial_setup(serial_t *h, const unsigned int baud, const serial_bits_t bits, const serial_parity_t parity, const serial_stopbit_t stopbit) {
+	serial_err_t err;
+	unsigned int baud_actual = baud;
+
+	if(!h)
+		return SERIAL_ERR_NOT_CONFIGURED;
+	if(baud == 0)
+		return SERIAL_ERR_INVALID_BAUD;
+
+	/* if the port is already configured, no need to do anything */
+	if (
+		h->configured        &&
+		h->baud	   == baud   &&
+		h->bits	   == bits   &&
+		h->parity  == parity &&
+		h->stopbit == stopbit
+	) return SERIAL_ERR_OK;
+
+	err = h->backend->setup(h->storage, baud, bits, parity, stopbit, &baud_actual);
+	h->rx_head = 0;
+	h->rx_len  = 0;
+	if (err != SERIAL_ERR_OK)
+		return err;
+
+	h->configured  = 1;
+	h->baud	       = baud;
+	h->baud_actual = baud_actual;
+	h->bits	       = bits;
+	h->parity      = parity;
+	h->stopbit     = stopbit;
+	return SERIAL_ERR_OK;
+}
+
+serial_err_t serial_write(serial_t *h, const void *buffer, unsigned int len) {
+	if(!h || !h->configured)
+		return SERIAL_ERR_NOT_CONFIGURED;
+
+	serial_err_t err;
+	unsigned int r;
+	const uint8_t *pos = buffer;
+
+	while(len > 0) {
+		r = 0;
+		err = h->backend->write(h->storage, pos, len, &r);
+		h->stats.tx_calls++;
+		if (err != SERIAL_ERR_OK) return err;
+		h->stats.tx_bytes += r;
+
+		len -= r;
+		pos += r;
+		h->sent = 1;
+	}
+
+	return SERIAL_ERR_OK;
+}
+
+/* the timeout plus the time len characters take on the wire, in us */
+static uint64_t serial_deadline(const serial_t *h, unsigned int len) {
+	return now_us() + h->timeout * 1000ULL + serial_get_wire_us(h, len);
+}
+
+/* read whatever the port has into the free part of the ring buffer */
+static serial_err_t serial_fill(serial_t *h, uint64_t deadline) {
+	unsigned int tail = (h->rx_head + h->rx_len) % SERIAL_RX_BUF_SIZE;
+	unsigned int room = SERIAL_RX_BUF_SIZE - h->rx_len;
+	uint64_t now;
+	unsigned int r;
+	serial_err_t err;
+
+	/* one read per call, up to the end of the buffer */
+	if (tail + room > SERIAL_RX_BUF_SIZE)
+		room = SERIAL_RX_BUF_SIZE - tail;
+
+	if (h->sent) {
+		h->stats.turns++;
+		h->sent = 0;
+	}
+
+	do {
+		now = now_us();
+		r   = 0;
+		err = h->backend->read(h->storage, &h->rx_buf[tail], room, &r,
+			now < deadline ? (deadline - now + 999) / 1000 : 0);
+		h->stats.rx_calls++;
+	} while (err == SERIAL_ERR_NODATA && now_us() < deadline);
+	if (err != SERIAL_ERR_OK) return err;
+	h->stats.rx_bytes += r;
+
+	h->rx_len += r;
+	return SERIAL_ERR_OK;
+}
+
+/* copy len buffered bytes out without consuming them */
+static void serial_copy(const serial_t *h, uint8_t *dst, unsigned int len) {
+	unsigned int pos = h->rx_head;
+
+	while(len-- > 0) {
+		*dst++ = h->rx_buf[pos];
+		pos = (pos + 1) % SERIAL_RX_BUF_SIZE;
+	}
+}
+
+serial_err_t serial_read(serial_t *h, const void *buffer, unsigned int len, unsigned int *readed) {
+	if(!h || !h->configured)
+		return SERIAL_ERR_NOT_CONFIGURED;
+
+	serial_err_t err;
+	unsigned int r;
+	uint8_t *pos = (uint8_t*)buffer;
+	uint64_t deadline = serial_deadline(h, len);
+
+	while(len > 0) {
+		if (h->rx_len == 0) {
+			err = serial_fill(h, deadline);
+			if (err != SERIAL_ERR_OK) return err;
+		}
+
+		r = len > h->rx_len ? h->rx_len : len;
+		serial_copy(h, pos, r);
+		serial_consume(h, r);
+
+		len -= r;
+		pos += r;
+		if(readed) *readed += r;
+	}
+
+	return SERIAL_ERR_OK;
+}
+
+/* Wait up to timeout ms (0 - don't wait) for data and take what is there,
+ * up to len bytes. For callers which run their own deadlines.
+ */
+serial_err_t serial_read_some(serial_t *h, void *buffer, unsigned int len, unsigned int *readed, unsigned int timeout) {
+	if(!h || !h->configured)
+		return SERIAL_ERR_NOT_CONFIGURED;
+
+	serial_err_t err;
+	unsigned int r;
+
+	*readed = 0;
+	if (h->rx_len == 0) {
+		err = serial_fill(h, now_us() + timeout * 1000ULL);
+		if (err != SERIAL_ERR_OK) return err;
+	}
+
+	if (h->rx_len == 0)
+		return SERIAL_ERR_NODATA;
+
+	r = len > h->rx_len ? h->rx_len : len;
+	serial_copy(h, buffer, r);
+	serial_consume(h, r);
+	*readed = r;
+	return SERIAL_ERR_OK;
+}
+
+serial_err_t serial_peek(serial_t *h, void *buffer, unsigned int len) {
+	if(!h || !h->configured)
+		return SERIAL_ERR_NOT_CONFIGURED;
+	if(len > SERIAL_RX_BUF_SIZE)
+		return SERIAL_ERR_WRONG_ARG;
+
+	serial_err_t err;
+	uint64_t deadline = serial_deadline(h, len);
+
+	while(h->rx_len < len) {
+		err = serial_fill(h, deadline);
+		if (err != SERIAL_ERR_OK) return err;
+	}
+
+	serial_copy(h, buffer, len);
+	return SERIAL_ERR_OK;
+}
+
+void serial_consume(serial_t *h, unsigned int len) {
+	if(!h)
+		return;
+	if(len > h->rx_len)
+		len = h->rx_len;
+
+	h->rx_head = (h->rx_head + len) % SERIAL_RX_BUF_SIZE;
+	h->rx_len -= len;
+}
+
+serial_err_t serial_record(serial_t *h, const char *filename) {
+	void *storage;
+
+	if(!h)
+		return SERIAL_ERR_NOT_CONFIGURED;
+
+	storage = record_wrap(h->backend, h->storage, filename);
+	if (!storage)
+		return SERIAL_ERR_SYSTEM;
+
+	h->backend = &SERIAL_RECORD;
+	h->storage = storage;
+	return SERIAL_ERR_OK;
+}
+
+serial_err_t serial_inject_faults(serial_t *h, const char *spec) {
+	void *storage;
+
+	if(!h)
+		return SERIAL_ERR_NOT_CONFIGURED;
+
+	storage = fault_wrap(h->backend, h->storage, spec);
+	if (!storage)
+		return SERIAL_ERR_WRONG_ARG;
+
+	h->backend = &SERIAL_FAULT;
+	h->storage = storage;
+	return SERIAL_ERR_OK;
+}
+
+serial_err_t serial_set_low_latency(serial_t *h) {
+	if(!h)
+		return SERIAL_ERR_NOT_CONFIGURED;
+	return h->backend->low_latency(h->storage);
+}
+
+void serial_set_timeout(serial_t *h, unsigned int timeout) {
+	if(!h)
+		return;
+	h->timeout = timeout;
+}
+
+const char* serial_get_setup_str(const serial_t *h) {
+	static char str[32];
+	if (!h || !h->configured)
+		snprintf(str, sizeof(str), "INVALID");
+	else if (h->baud_actual != h->baud)
+		snprintf(str, sizeof(str), "%u %d%c%d (real %u)",
+			h->baud,
+			serial_get_bits_int   (h->bits   ),
+			serial_get_parity_str (h->parity ),
+			serial_get_stopbit_int(h->stopbit),
+			h->baud_actual
+		);
+	else
+		snprintf(str, sizeof(str), "%u %d%c%d",
+			h->baud,
+			serial_get_bits_int   (h->bits   ),
+			serial_get_parity_str (h->parity ),
+			serial_get_stopbit_int(h->stopbit)
+		);
+
+	return str;
+}
+
+unsigned int serial_get_baud_actual(const serial_t *h) {
+	if (!h || !h->configured)
+		return 0;
+	return h->baud_actual;
+}
+
+const char* serial_get_backend_name(const serial_t *h) {
+	if (!h)
+		return "INVALID";
+	return h->backend->name;
+}
+
+int serial_get_fd(const serial_t *h) {
+	if (!h)
+		return -1;
+	return h->backend->fd(h->storage);
+}
+
+/* time len characters take on the wire, in us, with 1 ms of slack */
+unsigned int serial_get_wire_us(const serial_t *h, unsigned int len) {
+	uint64_t bits;
+
+	if (!h || !h->configured)
+		return 0;
+	bits = 1 + serial_get_bits_int(h->bits) + serial_get_stopbit_int(h->stopbit) +
+		(h->parity == SERIAL_PARITY_NONE ? 0 : 1);
+	return (len * bits * 1000000ULL) / h->baud_actual + 1000;
+}
+
+void serial_get_stats(const serial_t *h, serial_stats_t *stats) {
+	if (h)
+		*stats = h->stats;
+}
 
 serial_baud_t serial_get_baud(const unsigned int baud) {
 	switch(baud) {
@@ -0,0 +1,299 @@
+/*
+  stmflasher - Open Source ST MCU flash program for *nix
+  Copyright (C) 2010 Geoffrey McRae <geoff@spacevs.com>
+  Copyright (C) 2011 Steve Markgraf <steve@steve-m.de>
+  Copyright (C) 2012 Tormod Volden
+  Copyright (C) 2012-2013 Alatar <alatar_@list.ru>
+
+  This program is free software; you can redistribute it and/or
+  modify it under the terms of the GNU General Public License
+  as published by the Free Software Foundation; either version 2
+  of the License, or (at your option) any later version.
+
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with this program; if not, write to the Free Software
+  Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+*/
+
+/* Fault injection on top of any transport, to exercise retry and
+ * recovery paths on a clean line.
+ *
+ * Spec: comma separated key=value list
+ *	seed=N		PRNG seed, same seed gives the same faults
+ *	drop=P		probability to lose a byte (both directions)
+ *	flip=P		probability to flip one bit of a byte (both directions)
+ *	nack=P		probability to turn a received ACK into NACK
+ *	delay=P[:MS]	probability to hold a received chunk back MS ms (50)
+ *	stall=P[:MS]	probability per transfer that the line goes dead
+ *			for MS ms (500), everything sent or received is lost
+ */
+
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <stdio.h>
+
+#include "serial_backend.h"
+#include "utils.h"
+
+#define FAULT_ACK	0x79
+#define FAULT_NACK	0x1F
+
+typedef struct {
+	const serial_backend_t	*backend;
+	void			*storage;
+
+	uint64_t		rng;
+	double			drop, flip, nack, delay, stall;
+	unsigned int		delay_ms, stall_ms;
+
+	/* received chunk held back by a delay fault */
+	uint8_t			held[SERIAL_RX_BUF_SIZE];
+	unsigned int		held_len;
+	uint64_t		held_until;
+	uint64_t		stall_until;
+
+	unsigned long		n_drop, n_flip, n_nack, n_delay, n_stall;
+} fault_t;
+
+/* xorshift64* */
+static uint64_t fault_rand(fault_t *h) {
+	h->rng ^= h->rng >> 12;
+	h->rng ^= h->rng << 25;
+	h->rng ^= h->rng >> 27;
+	return h->rng * 0x2545F4914F6CDD1DULL;
+}
+
+static char fault_hit(fault_t *h, double p) {
+	if (p <= 0)
+		return 0;
+	return (fault_rand(h) >> 11) * (1.0 / 9007199254740992.0) < p;
+}
+
+/* drop and flip bytes in place, return the new length */
+static unsigned int fault_mangle(fault_t *h, uint8_t *buf, unsigned int len) {
+	unsigned int i, n = 0;
+
+	for(i = 0; i < len; i++) {
+		if (fault_hit(h, h->drop)) {
+			h->n_drop++;
+			continue;
+		}
+		buf[n] = buf[i];
+		if (fault_hit(h, h->flip)) {
+			buf[n] ^= 1 << (fault_rand(h) >> 61);
+			h->n_flip++;
+		}
+		n++;
+	}
+	return n;
+}
+
+/* line is dead until stall_until, maybe start a new stall */
+static char fault_stalled(fault_t *h, uint64_t now) {
+	if (h->stall_until <= now && fault_hit(h, h->stall)) {
+		h->stall_until = now + (uint64_t)h->stall_ms * 1000;
+		h->n_stall++;
+	}
+	return h->stall_until > now;
+}
+
+static int fault_parse(fault_t *h, const char *spec) {
+	const char *p = spec;
+	char *end;
+
+	while(*p) {
+		const char *eq = strchr(p, '=');
+		size_t klen;
+		double v;
+
+		if (!eq)
+			return 0;
+		klen = eq - p;
+		if (klen == 4 && strncmp(p, "seed", 4) == 0) {
+			h->rng = strtoull(eq + 1, &end, 0);
+		} else {
+			v = strtod(eq + 1, &end);
+			if (end == eq + 1 || v < 0 || v > 1)
+				return 0;
+			     if (klen == 4 && strncmp(p, "drop" , 4) == 0) h->drop  = v;
+			else if (klen == 4 && strncmp(p, "flip" , 4) == 0) h->flip  = v;
+			else if (klen == 4 && strncmp(p, "nack" , 4) == 0) h->nack  = v;
+			else if (klen == 5 && strncmp(p, "delay", 5) == 0) h->delay = v;
+			else if (klen == 5 && strncmp(p, "stall", 5) == 0) h->stall = v;
+			else return 0;
+
+			if (*end == ':') {
+				unsigned int ms = strtoul(end + 1, &end, 0);
+				     if (klen == 5 && p[0] == 'd') h->delay_ms = ms;
+				else if (klen == 5 && p[0] == 's') h->stall_ms = ms;
+				else return 0;
+			}
+		}
+		if (end == eq + 1 || (*end != ',' && *end != 0))
+			return 0;
+		p = *end ? end + 1 : end;
+	}
+	return 1;
+}
+
+void* fault_wrap(const serial_backend_t *backend, void *storage, const char *spec) {
+	fault_t *h = calloc(sizeof(fault_t), 1);
+	if (!h)
+		return NULL;
+
+	h->delay_ms = 50;
+	h->stall_ms = 500;
+	if (!fault_parse(h, spec)) {
+		free(h);
+		return NULL;
+	}
+
+	/* xorshift must not start from zero */
+	h->rng ^= 0x9E3779B97F4A7C15ULL;
+	if (!h->rng)
+		h->rng = 1;
+
+	h->backend = backend;
+	h->storage = storage;
+	return h;
+}
+
+void* fault_open(const char *device) {
+	/* only created by fault_wrap() */
+	return NULL;
+}
+
+void fault_close(void *storage) {
+	fault_t *h = storage;
+
+	fprintf(stderr, "Injected faults: %lu dropped, %lu flipped, %lu NACK, %lu delayed, %lu stalls\n",
+		h->n_drop, h->n_flip, h->n_nack, h->n_delay, h->n_stall);
+	h->backend->close(h->storage);
+	free(h);
+}
+
+void fault_flush(void *storage) {
+	fault_t *h = storage;
+
+	h->held_len = 0;
+	h->backend->flush(h->storage);
+}
+
+serial_err_t fault_setup(void *storage, const unsigned int baud, const serial_bits_t bits, const serial_parity_t parity, const serial_stopbit_t stopbit, unsigned int *baud_actual) {
+	fault_t *h = storage;
+
+	return h->backend->setup(h->storage, baud, bits, parity, stopbit, baud_actual);
+}
+
+serial_err_t fault_write(void *storage, const void *buffer, unsigned int len, unsigned int *written) {
+	fault_t *h = storage;
+	uint8_t tmp[512];
+	unsigned int n, sent, w;
+	serial_err_t err;
+
+	if (len > sizeof(tmp))
+		len = sizeof(tmp);
+	*written = len;
+
+	/* a dead line swallows everything */
+	if (fault_stalled(h, now_us()))
+		return SERIAL_ERR_OK;
+
+	memcpy(tmp, buffer, len);
+	n = fault_mangle(h, tmp, len);
+	for(sent = 0; sent < n; sent += w) {
+		err = h->backend->write(h->storage, tmp + sent, n - sent, &w);
+		if (err != SERIAL_ERR_OK)
+			return err;
+	}
+	return SERIAL_ERR_OK;
+}
+
+serial_err_t fault_read(void *storage, void *buffer, unsigned int len, unsigned int *readed, unsigned int timeout) {
+	fault_t *h = storage;
+	uint64_t now = now_us();
+	uint64_t end = now + (uint64_t)timeout * 1000;
+	uint8_t *buf = buffer;
+	serial_err_t err;
+	unsigned int i, n;
+
+	/* a delayed chunk shows up once its time has come */
+	if (h->held_len) {
+		if (h->held_until > end) {
+			sleep_us(end - now);
+			return SERIAL_ERR_NODATA;
+		}
+		if (h->held_until > now)
+			sleep_us(h->held_until - now);
+		n = h->held_len < len ? h->held_len : len;
+		memcpy(buffer, h->held, n);
+		memmove(h->held, h->held + n, h->held_len - n);
+		h->held_len -= n;
+		*readed = n;
+		return SERIAL_ERR_OK;
+	}
+
+	/* wait out the stall, whatever arrives meanwhile is lost */
+	if (fault_stalled(h, now)) {
+		sleep_us((h->stall_until < end ? h->stall_until : end) - now);
+		while(h->backend->read(h->storage, h->held, sizeof(h->held), &n, 0) == SERIAL_ERR_OK);
+		return SERIAL_ERR_NODATA;
+	}
+
+	if (len > sizeof(h->held))
+		len = sizeof(h->held);
+	err = h->backend->read(h->storage, buffer, len, &n, timeout);
+	if (err != SERIAL_ERR_OK)
+		return err;
+
+	n = fault_mangle(h, buf, n);
+	for(i = 0; i < n; i++) {
+		if (buf[i] == FAULT_ACK && fault_hit(h, h->nack)) {
+			buf[i] = FAULT_NACK;
+			h->n_nack++;
+		}
+	}
+	if (n == 0)
+		return SERIAL_ERR_NODATA;
+
+	if (fault_hit(h, h->delay)) {
+		memcpy(h->held, buf, n);
+		h->held_len   = n;
+		h->held_until = now_us() + (uint64_t)h->delay_ms * 1000;
+		h->n_delay++;
+		return SERIAL_ERR_NODATA;
+	}
+
+	*readed = n;
+	return SERIAL_ERR_OK;
+}
+
+serial_err_t fault_low_latency(void *storage) {
+	fault_t *h = storage;
+
+	return h->backend->low_latency(h->storage);
+}
+
+int fault_fd(void *storage) {
+	/* held back data doesn't show up on the descriptor */
+	return -1;
+}
+
+serial_backend_t SERIAL_FAULT = {
+	"fault injector",
+	NULL,
+	fault_open,
+	fault_close,
+	fault_flush,
+	fault_setup,
+	fault_write,
+	fault_read,
+	fault_low_latency,
+	fault_fd
+};
@@ -0,0 +1,124 @@
+/*
+  stmflasher - Open Source ST MCU flash program for *nix
+  Copyright (C) 2010 Geoffrey McRae <geoff@spacevs.com>
+  Copyright (C) 2011 Steve Markgraf <steve@steve-m.de>
+  Copyright (C) 2012 Tormod Volden
+  Copyright (C) 2012-2013 Alatar <alatar_@list.ru>
+
+  This program is free software; you can redistribute it and/or
+  modify it under the terms of the GNU General Public License
+  as published by the Free Software Foundation; either version 2
+  of the License, or (at your option) any later version.
+
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with this program; if not, write to the Free Software
+  Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+*/
+
+/* Linux specific termios2 helpers. They live in their own file because
+ * <asm/termbits.h> can't be included together with <termios.h>.
+ */
+
+#ifdef __linux__
+
+#include <sys/ioctl.h>
+#include <sys/stat.h>
+#include <sys/sysmacros.h>
+#include <asm/termbits.h>
+#include <linux/serial.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <limits.h>
+
+/* set any integer baud rate with BOTHER, return 0 on success */
+int serial_linux_set_baud(int fd, unsigned int baud) {
+	struct termios2 tio;
+
+	if (ioctl(fd, TCGETS2, &tio) != 0)
+		return -1;
+
+	tio.c_cflag &= ~CBAUD;
+	tio.c_cflag |= BOTHER;
+	tio.c_cflag &= ~(CBAUD << IBSHIFT);
+	tio.c_cflag |= BOTHER << IBSHIFT;
+	tio.c_ispeed = baud;
+	tio.c_ospeed = baud;
+
+	return ioctl(fd, TCSETS2, &tio);
+}
+
+/* baud rate the driver actually uses, 0 if not known */
+unsigned int serial_linux_get_baud(int fd) {
+	struct termios2 tio;
+
+	if (ioctl(fd, TCGETS2, &tio) != 0)
+		return 0;
+	return tio.c_ospeed;
+}
+
+/* pseudo terminal slave (UNIX98 pty, majors 136-143), return 1 if so */
+int serial_linux_is_pty(int fd) {
+	struct stat st;
+
+	if (fstat(fd, &st) != 0 || !S_ISCHR(st.st_mode))
+		return 0;
+	return major(st.st_rdev) >= 136 && major(st.st_rdev) <= 143;
+}
+
+/* switch ASYNC_LOW_LATENCY on or off, old gets the previous state.
+ * Return 0 on success.
+ */
+int serial_linux_set_low_latency(int fd, int enable, int *old) {
+	struct serial_struct ss;
+
+	if (ioctl(fd, TIOCGSERIAL, &ss) != 0)
+		return -1;
+	if (old)
+		*old = (ss.flags & ASYNC_LOW_LATENCY) ? 1 : 0;
+
+	if (enable)
+		ss.flags |= ASYNC_LOW_LATENCY;
+	else
+		ss.flags &= ~ASYNC_LOW_LATENCY;
+
+	return ioctl(fd, TIOCSSERIAL, &ss);
+}
+
+/* set latency_timer of an USB-serial adapter (FTDI) through sysfs.
+ * Return the previous value in ms or -1 if the port has no writable timer.
+ */
+int serial_linux_set_latency_timer(const char *device, int ms) {
+	char real[PATH_MAX];
+	char path[PATH_MAX + 64];
+	const char *name;
+	FILE *f;
+	int old;
+
+	/* follow /dev/serial/by-id/... links to the real ttyUSBx */
+	if (!realpath(device, real))
+		return -1;
+	name = strrchr(real, '/');
+	name = name ? name + 1 : real;
+
+	snprintf(path, sizeof(path), "/sys/class/tty/%s/device/latency_timer", name);
+	f = fopen(path, "r+");
+	if (!f)
+		return -1;
+
+	if (fscanf(f, "%d", &old) != 1 || fseek(f, 0, SEEK_SET) != 0 ||
+	    fprintf(f, "%d\n", ms) < 0 || fflush(f) != 0) {
+		fclose(f);
+		return -1;
+	}
+
+	fclose(f);
+	return old;
+}
+
+#endif
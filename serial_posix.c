@@ -25,25 +25,37 @@
 #include <fcntl.h>
 #include <unistd.h>
 #include <termios.h>
+#include <poll.h>
+#include <errno.h>
 #include <stdio.h>
+#include <string.h>
 #include <assert.h>
 
-#include "serial.h"
+#include "serial_backend.h"
 
-struct serial {
+typedef struct {
 	int			fd;
 	struct termios		oldtio;
 	struct termios		newtio;
 
-	char			configured;
-	serial_baud_t		baud;
-	serial_bits_t		bits;
-	serial_parity_t		parity;
-	serial_stopbit_t	stopbit;
-};
+	/* low latency tuning, restored on close */
+	char			*device;
+	char			low_latency;
+	int			old_low_latency;
+	int			old_latency_timer;
+} tty_t;
+
+#ifdef __linux__
+/* serial_linux.c */
+int          serial_linux_set_baud(int fd, unsigned int baud);
+unsigned int serial_linux_get_baud(int fd);
+int          serial_linux_is_pty(int fd);
+int          serial_linux_set_low_latency(int fd, int enable, int *old);
+int          serial_linux_set_latency_timer(const char *device, int ms);
+#endif
 
-serial_t* serial_open(const char *device) {
-	serial_t *h = calloc(sizeof(serial_t), 1);
+void* tty_open(const char *device) {
+	tty_t *h = calloc(sizeof(tty_t), 1);
 
 	h->fd = open(device, O_RDWR | O_NOCTTY | O_NDELAY);
 	if (h->fd < 0) {
@@ -51,6 +63,8 @@ serial_t* serial_open(const char *device) {
 		return NULL;
 	}
 	fcntl(h->fd, F_SETFL, 0);
+	h->device  = strdup(device);
+	h->old_latency_timer = -1;
 
 	tcgetattr(h->fd, &h->oldtio);
 	tcgetattr(h->fd, &h->newtio);
@@ -58,32 +72,38 @@ serial_t* serial_open(const char *device) {
 	return h;
 }
 
-void serial_close(serial_t *h) {
-	if(!h || (h->fd <= -1))
-		return;
+void tty_flush(void *storage) {
+	tty_t *h = storage;
+
+	tcflush(h->fd, TCIFLUSH);
+}
+
+void tty_close(void *storage) {
+	tty_t *h = storage;
 
-	serial_flush(h);
+	tty_flush(h);
 	tcsetattr(h->fd, TCSANOW, &h->oldtio);
+#ifdef __linux__
+	if (h->low_latency)
+		serial_linux_set_low_latency(h->fd, h->old_low_latency, NULL);
+	if (h->old_latency_timer >= 0)
+		serial_linux_set_latency_timer(h->device, h->old_latency_timer);
+#endif
 	close(h->fd);
+	free(h->device);
 	free(h);
 }
 
-void serial_flush(const serial_t *h) {
-	if(!h || (h->fd <= -1))
-		return;
-	tcflush(h->fd, TCIFLUSH);
-}
-
-serial_err_t serial_setup(serial_t *h, const serial_baud_t baud, const serial_bits_t bits, const serial_parity_t parity, const serial_stopbit_t stopbit) {
-	if(!h || (h->fd <= -1))
-		return SERIAL_ERR_NOT_CONFIGURED;
+serial_err_t tty_setup(void *storage, const unsigned int baud, const serial_bits_t bits, const serial_parity_t parity, const serial_stopbit_t stopbit, unsigned int *baud_actual) {
+	tty_t *h = storage;
 
 	speed_t		port_baud;
 	tcflag_t	port_bits;
 	tcflag_t	port_parity;
 	tcflag_t	port_stop;
+	char		port_custom = 0;
 
-	switch(baud) {
+	switch(serial_get_baud(baud)) {
 		case SERIAL_BAUD_50     : port_baud = B50     ; break;
 		case SERIAL_BAUD_75     : port_baud = B75     ; break;
 		case SERIAL_BAUD_110    : port_baud = B110    ; break;
@@ -158,7 +178,16 @@ serial_err_t serial_setup(serial_t *h, const serial_baud_t baud, const serial_bi
 #endif
 		case SERIAL_BAUD_INVALID:
 		default:
+#ifdef __linux__
+			/* no Bxxx constant, set the rate with termios2 later */
+			if (baud == 0)
+				return SERIAL_ERR_INVALID_BAUD;
+			port_baud   = B38400;
+			port_custom = 1;
+			break;
+#else
 			return SERIAL_ERR_INVALID_BAUD;
+#endif
 	}
 
 	switch(bits) {
@@ -188,15 +217,6 @@ serial_err_t serial_setup(serial_t *h, const serial_baud_t baud, const serial_bi
 			return SERIAL_ERR_INVALID_STOPBIT;
 	}
 
-	/* if the port is already configured, no need to do anything */
-	if (
-		h->configured        &&
-		h->baud	   == baud   &&
-		h->bits	   == bits   &&
-		h->parity  == parity &&
-		h->stopbit == stopbit
-	) return SERIAL_ERR_OK;
-
 	/* reset the settings */
 	cfmakeraw(&h->newtio);
 	h->newtio.c_cflag &= ~(CSIZE | CRTSCTS);
@@ -215,82 +235,121 @@ serial_err_t serial_setup(serial_t *h, const serial_baud_t baud, const serial_bi
 		CREAD;
 	if(parity != SERIAL_PARITY_NONE) h->newtio.c_iflag |= INPCK;
 
+	/* don't block in read(), timeouts are handled with poll() */
 	h->newtio.c_cc[VMIN ] = 0;
-	h->newtio.c_cc[VTIME] = 30; //read timeout 3sec
+	h->newtio.c_cc[VTIME] = 0;
 
 	/* set the settings */
-	serial_flush(h);
+	tty_flush(h);
 	if (tcsetattr(h->fd, TCSANOW, &h->newtio) != 0)
 		return SERIAL_ERR_SYSTEM;
+#ifdef __linux__
+	if (port_custom && serial_linux_set_baud(h->fd, baud) != 0)
+		return SERIAL_ERR_INVALID_BAUD;
+#endif
 
-	/* confirm they were set */
+	/* confirm they were set, custom rate changes the speed bits */
 	struct termios settings;
+	tcflag_t cflag_mask = ~(tcflag_t)0;
+#ifdef CBAUD
+	if (port_custom)
+		cflag_mask &= ~CBAUD;
+#endif
+#ifdef CIBAUD
+	if (port_custom)
+		cflag_mask &= ~CIBAUD;
+#endif
+#ifdef __linux__
+	/* the pty driver has no parity and drops PARENB (simulated targets) */
+	if (serial_linux_is_pty(h->fd))
+		cflag_mask &= ~(PARENB | PARODD);
+#endif
 	tcgetattr(h->fd, &settings);
 	if (
 		settings.c_iflag != h->newtio.c_iflag ||
 		settings.c_oflag != h->newtio.c_oflag ||
-		settings.c_cflag != h->newtio.c_cflag ||
+		(settings.c_cflag & cflag_mask) != (h->newtio.c_cflag & cflag_mask) ||
 		settings.c_lflag != h->newtio.c_lflag
 	)	return SERIAL_ERR_UNKNOWN;
 
-	h->configured = 1;
-	h->baud	      = baud;
-	h->bits	      = bits;
-	h->parity     = parity;
-	h->stopbit    = stopbit;
+	*baud_actual = baud;
+#ifdef __linux__
+	/* the driver reports the rate it could really set */
+	if (serial_linux_get_baud(h->fd))
+		*baud_actual = serial_linux_get_baud(h->fd);
+#endif
 	return SERIAL_ERR_OK;
 }
 
-serial_err_t serial_write(const serial_t *h, const void *buffer, unsigned int len) {
-	if(!h || (h->fd <= -1) || !h->configured)
-		return SERIAL_ERR_NOT_CONFIGURED;
+serial_err_t tty_write(void *storage, const void *buffer, unsigned int len, unsigned int *written) {
+	tty_t *h = storage;
+	ssize_t r;
+
+	r = write(h->fd, buffer, len);
+	if (r < 1) return SERIAL_ERR_SYSTEM;
 
+	*written = r;
+	return SERIAL_ERR_OK;
+}
+
+serial_err_t tty_read(void *storage, void *buffer, unsigned int len, unsigned int *readed, unsigned int timeout) {
+	tty_t *h = storage;
+	struct pollfd pfd;
 	ssize_t r;
-	uint8_t *pos = (uint8_t*)buffer;
 
-	while(len > 0) {
-		r = write(h->fd, pos, len);
-		if (r < 1) return SERIAL_ERR_SYSTEM;
+	pfd.fd     = h->fd;
+	pfd.events = POLLIN;
+	r = poll(&pfd, 1, timeout);
+	      if (r == 0) return SERIAL_ERR_NODATA;
+	else  if (r <  0) return errno == EINTR ? SERIAL_ERR_NODATA : SERIAL_ERR_SYSTEM;
 
-		len -= r;
-		pos += r;
-	}
+	r = read(h->fd, buffer, len);
+	      if (r == 0) return SERIAL_ERR_NODATA;
+	else  if (r <  0) return SERIAL_ERR_SYSTEM;
 
+	*readed = r;
 	return SERIAL_ERR_OK;
 }
 
-serial_err_t serial_read(const serial_t *h, const void *buffer, unsigned int len, unsigned int *readed) {
-	if(!h || (h->fd <= -1) || !h->configured)
-		return SERIAL_ERR_NOT_CONFIGURED;
+int tty_fd(void *storage) {
+	tty_t *h = storage;
 
-	ssize_t r;
-	uint8_t *pos = (uint8_t*)buffer;
+	return h->fd;
+}
 
-	while(len > 0) {
-		r = read(h->fd, pos, len);
-		      if (r == 0) return SERIAL_ERR_NODATA;
-		else  if (r <  0) return SERIAL_ERR_SYSTEM;
+serial_err_t tty_low_latency(void *storage) {
+#ifdef __linux__
+	tty_t *h = storage;
+	char tuned = 0;
 
-		len -= r;
-		pos += r;
-		if(readed) *readed += r;
+	/* let the driver push every received byte up at once */
+	if (!h->low_latency && serial_linux_set_low_latency(h->fd, 1, &h->old_low_latency) == 0) {
+		h->low_latency = 1;
+		tuned = 1;
 	}
 
-	return SERIAL_ERR_OK;
-}
+	/* FTDI adapters hold data up to latency_timer (16 ms by default) */
+	if (h->old_latency_timer < 0) {
+		h->old_latency_timer = serial_linux_set_latency_timer(h->device, 1);
+		if (h->old_latency_timer >= 0)
+			tuned = 1;
+	}
 
-const char* serial_get_setup_str(const serial_t *h) {
-	static char str[11];
-	if (!h || !h->configured)
-		snprintf(str, sizeof(str), "INVALID");
-	else
-		snprintf(str, sizeof(str), "%u %d%c%d",
-			serial_get_baud_int   (h->baud   ),
-			serial_get_bits_int   (h->bits   ),
-			serial_get_parity_str (h->parity ),
-			serial_get_stopbit_int(h->stopbit)
-		);
-
-	return str;
+	return tuned ? SERIAL_ERR_OK : SERIAL_ERR_SYSTEM;
+#else
+	return SERIAL_ERR_SYSTEM;
+#endif
 }
 
+serial_backend_t SERIAL_TTY = {
+	"POSIX tty",
+	NULL,
+	tty_open,
+	tty_close,
+	tty_flush,
+	tty_setup,
+	tty_write,
+	tty_read,
+	tty_low_latency,
+	tty_fd
+};
@@ -0,0 +1,176 @@
+/*
+  stmflasher - Open Source ST MCU flash program for *nix
+  Copyright (C) 2010 Geoffrey McRae <geoff@spacevs.com>
+  Copyright (C) 2011 Steve Markgraf <steve@steve-m.de>
+  Copyright (C) 2012 Tormod Volden
+  Copyright (C) 2012-2013 Alatar <alatar_@list.ru>
+
+  This program is free software; you can redistribute it and/or
+  modify it under the terms of the GNU General Public License
+  as published by the Free Software Foundation; either version 2
+  of the License, or (at your option) any later version.
+
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with this program; if not, write to the Free Software
+  Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+*/
+
+/* Raw TCP transport for serial-over-Ethernet servers (ser2net & co),
+ * device name is tcp://host:port. The line settings belong to the
+ * server, so setup only records them.
+ */
+
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <netdb.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <poll.h>
+#include <errno.h>
+#include <stdio.h>
+
+#include "serial_backend.h"
+
+typedef struct {
+	int	fd;
+} tcp_t;
+
+void* tcp_open(const char *device) {
+	struct addrinfo hints, *res, *ai;
+	char *host, *port;
+	tcp_t *h;
+	int one = 1;
+
+	/* split host:port, the host may be [ipv6] */
+	host = strdup(device);
+	if (!host)
+		return NULL;
+	port = strrchr(host, ':');
+	if (!port) {
+		fprintf(stderr, "TCP port must be given as tcp://host:port\n");
+		free(host);
+		return NULL;
+	}
+	*port++ = '\0';
+	if (host[0] == '[' && host[strlen(host) - 1] == ']') {
+		memmove(host, host + 1, strlen(host));
+		host[strlen(host) - 1] = '\0';
+	}
+
+	memset(&hints, 0, sizeof(hints));
+	hints.ai_family   = AF_UNSPEC;
+	hints.ai_socktype = SOCK_STREAM;
+	if (getaddrinfo(host, port, &hints, &res) != 0) {
+		free(host);
+		return NULL;
+	}
+	free(host);
+
+	h = calloc(sizeof(tcp_t), 1);
+	if (!h) {
+		freeaddrinfo(res);
+		return NULL;
+	}
+	h->fd = -1;
+	for(ai = res; ai; ai = ai->ai_next) {
+		h->fd = socket(ai->ai_family, ai->ai_socktype, ai->ai_protocol);
+		if (h->fd < 0)
+			continue;
+		if (connect(h->fd, ai->ai_addr, ai->ai_addrlen) == 0)
+			break;
+		close(h->fd);
+		h->fd = -1;
+	}
+	freeaddrinfo(res);
+
+	if (h->fd < 0) {
+		free(h);
+		return NULL;
+	}
+
+	/* every protocol frame is one write, send it at once */
+	setsockopt(h->fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+	return h;
+}
+
+void tcp_flush(void *storage) {
+	tcp_t *h = storage;
+	char buf[256];
+
+	while(recv(h->fd, buf, sizeof(buf), MSG_DONTWAIT) > 0);
+}
+
+void tcp_close(void *storage) {
+	tcp_t *h = storage;
+
+	close(h->fd);
+	free(h);
+}
+
+serial_err_t tcp_setup(void *storage, const unsigned int baud, const serial_bits_t bits, const serial_parity_t parity, const serial_stopbit_t stopbit, unsigned int *baud_actual) {
+	/* nothing to configure on a raw socket */
+	*baud_actual = baud;
+	return SERIAL_ERR_OK;
+}
+
+serial_err_t tcp_write(void *storage, const void *buffer, unsigned int len, unsigned int *written) {
+	tcp_t *h = storage;
+	ssize_t r;
+
+	r = send(h->fd, buffer, len, 0);
+	if (r < 1) return SERIAL_ERR_SYSTEM;
+
+	*written = r;
+	return SERIAL_ERR_OK;
+}
+
+serial_err_t tcp_read(void *storage, void *buffer, unsigned int len, unsigned int *readed, unsigned int timeout) {
+	tcp_t *h = storage;
+	struct pollfd pfd;
+	ssize_t r;
+
+	pfd.fd     = h->fd;
+	pfd.events = POLLIN;
+	r = poll(&pfd, 1, timeout);
+	      if (r == 0) return SERIAL_ERR_NODATA;
+	else  if (r <  0) return errno == EINTR ? SERIAL_ERR_NODATA : SERIAL_ERR_SYSTEM;
+
+	/* zero here means the server closed the connection */
+	r = recv(h->fd, buffer, len, 0);
+	if (r < 1) return SERIAL_ERR_SYSTEM;
+
+	*readed = r;
+	return SERIAL_ERR_OK;
+}
+
+int tcp_fd(void *storage) {
+	tcp_t *h = storage;
+
+	return h->fd;
+}
+
+serial_err_t tcp_low_latency(void *storage) {
+	/* TCP_NODELAY is always set */
+	return SERIAL_ERR_OK;
+}
+
+serial_backend_t SERIAL_TCP = {
+	"TCP",
+	"tcp://",
+	tcp_open,
+	tcp_close,
+	tcp_flush,
+	tcp_setup,
+	tcp_write,
+	tcp_read,
+	tcp_low_latency,
+	tcp_fd
+};
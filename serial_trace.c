@@ -0,0 +1,417 @@
+/*
+  stmflasher - Open Source ST MCU flash program for *nix
+  Copyright (C) 2010 Geoffrey McRae <geoff@spacevs.com>
+  Copyright (C) 2011 Steve Markgraf <steve@steve-m.de>
+  Copyright (C) 2012 Tormod Volden
+  Copyright (C) 2012-2013 Alatar <alatar_@list.ru>
+
+  This program is free software; you can redistribute it and/or
+  modify it under the terms of the GNU General Public License
+  as published by the Free Software Foundation; either version 2
+  of the License, or (at your option) any later version.
+
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with this program; if not, write to the Free Software
+  Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+*/
+
+/* Wire level trace of a session and its replay.
+ *
+ * SERIAL_RECORD wraps any other transport and logs every chunk that goes
+ * through it, SERIAL_REPLAY (replay://file) plays a trace back to the
+ * protocol code without hardware, as fast as possible but for the timeouts.
+ *
+ * Trace file: "STMTRACE" magic, then records of
+ *	type (1 byte), time since previous record in us (varint),
+ *	length (varint), data
+ * Types: 'W' bytes sent, 'R' bytes received, 'T' read timeout (no data),
+ * 'S' line setup (data is the baud rate as varint), 'F' flush.
+ */
+
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <stdio.h>
+
+#include "serial_backend.h"
+#include "utils.h"
+
+#define TRACE_MAGIC	"STMTRACE"
+
+enum {
+	TRACE_WRITE	= 'W',
+	TRACE_READ	= 'R',
+	TRACE_TIMEOUT	= 'T',
+	TRACE_SETUP	= 'S',
+	TRACE_FLUSH	= 'F'
+};
+
+typedef struct {
+	const serial_backend_t	*backend;
+	void			*storage;
+	FILE			*f;
+	uint64_t		last;
+} record_t;
+
+typedef struct {
+	uint8_t		*data;
+	size_t		size, pos;
+
+	/* current record, valid until replay_done() */
+	char		current;
+	uint8_t		type;
+	size_t		rec_pos, rec_end;
+	size_t		tx_offset;
+} replay_t;
+
+static void trace_put_varint(FILE *f, uint64_t v) {
+	do {
+		uint8_t b = v & 0x7F;
+		v >>= 7;
+		fputc(v ? b | 0x80 : b, f);
+	} while (v);
+}
+
+static int trace_get_varint(replay_t *h, uint64_t *v) {
+	int shift = 0;
+
+	*v = 0;
+	while(h->pos < h->size && shift < 64) {
+		uint8_t b = h->data[h->pos++];
+		*v |= (uint64_t)(b & 0x7F) << shift;
+		if (!(b & 0x80))
+			return 1;
+		shift += 7;
+	}
+	return 0;
+}
+
+static void record_put(record_t *h, uint8_t type, const void *data, unsigned int len) {
+	uint64_t now = now_us();
+
+	fputc(type, h->f);
+	trace_put_varint(h->f, now - h->last);
+	trace_put_varint(h->f, len);
+	if (len)
+		fwrite(data, 1, len, h->f);
+	h->last = now;
+}
+
+void* record_wrap(const serial_backend_t *backend, void *storage, const char *filename) {
+	record_t *h = calloc(sizeof(record_t), 1);
+	if (!h)
+		return NULL;
+
+	h->f = fopen(filename, "wb");
+	if (!h->f) {
+		free(h);
+		return NULL;
+	}
+	fwrite(TRACE_MAGIC, 1, strlen(TRACE_MAGIC), h->f);
+
+	h->backend = backend;
+	h->storage = storage;
+	h->last    = now_us();
+	return h;
+}
+
+void* record_open(const char *device) {
+	/* only created by record_wrap() */
+	return NULL;
+}
+
+void record_close(void *storage) {
+	record_t *h = storage;
+
+	h->backend->close(h->storage);
+	fclose(h->f);
+	free(h);
+}
+
+void record_flush(void *storage) {
+	record_t *h = storage;
+
+	h->backend->flush(h->storage);
+	record_put(h, TRACE_FLUSH, NULL, 0);
+}
+
+serial_err_t record_setup(void *storage, const unsigned int baud, const serial_bits_t bits, const serial_parity_t parity, const serial_stopbit_t stopbit, unsigned int *baud_actual) {
+	record_t *h = storage;
+	serial_err_t err;
+	uint8_t buf[10];
+	unsigned int len = 0;
+	uint64_t v;
+
+	err = h->backend->setup(h->storage, baud, bits, parity, stopbit, baud_actual);
+	if (err != SERIAL_ERR_OK)
+		return err;
+
+	v = *baud_actual;
+	do {
+		buf[len] = v & 0x7F;
+		v >>= 7;
+		if (v) buf[len] |= 0x80;
+		len++;
+	} while (v);
+	record_put(h, TRACE_SETUP, buf, len);
+	return SERIAL_ERR_OK;
+}
+
+serial_err_t record_write(void *storage, const void *buffer, unsigned int len, unsigned int *written) {
+	record_t *h = storage;
+	serial_err_t err;
+
+	err = h->backend->write(h->storage, buffer, len, written);
+	if (err == SERIAL_ERR_OK)
+		record_put(h, TRACE_WRITE, buffer, *written);
+	return err;
+}
+
+/* a 'T' record is a wait that ran out: a backend giving up early (EINTR,
+ * a stalled fault) is asked again for the rest of the timeout, so the
+ * replay can wait it out at that record
+ */
+serial_err_t record_read(void *storage, void *buffer, unsigned int len, unsigned int *readed, unsigned int timeout) {
+	record_t *h = storage;
+	uint64_t end = now_us() + (uint64_t)timeout * 1000;
+	uint64_t now;
+	serial_err_t err;
+
+	do {
+		now = now_us();
+		err = h->backend->read(h->storage, buffer, len, readed,
+			now < end ? (end - now + 999) / 1000 : 0);
+	} while (err == SERIAL_ERR_NODATA && now_us() < end);
+	if (err == SERIAL_ERR_OK)
+		record_put(h, TRACE_READ, buffer, *readed);
+	else if (err == SERIAL_ERR_NODATA)
+		record_put(h, TRACE_TIMEOUT, NULL, 0);
+	return err;
+}
+
+serial_err_t record_low_latency(void *storage) {
+	record_t *h = storage;
+
+	return h->backend->low_latency(h->storage);
+}
+
+int record_fd(void *storage) {
+	record_t *h = storage;
+
+	return h->backend->fd(h->storage);
+}
+
+serial_backend_t SERIAL_RECORD = {
+	"trace recorder",
+	NULL,
+	record_open,
+	record_close,
+	record_flush,
+	record_setup,
+	record_write,
+	record_read,
+	record_low_latency,
+	record_fd
+};
+
+/* step to the next record, return its type or 0 at the end of trace */
+static uint8_t replay_next(replay_t *h) {
+	uint64_t delta, len;
+
+	if (h->current)
+		return h->type;
+
+	h->type = 0;
+	if (h->pos >= h->size)
+		return 0;
+
+	h->type = h->data[h->pos++];
+	if (!trace_get_varint(h, &delta) || !trace_get_varint(h, &len) || h->pos + len > h->size) {
+		fprintf(stderr, "Replay: trace is truncated\n");
+		h->type = 0;
+		h->pos  = h->size;
+		return 0;
+	}
+
+	h->rec_pos = h->pos;
+	h->rec_end = h->pos + len;
+	h->pos    += len;
+	h->current = 1;
+	return h->type;
+}
+
+/* mark the current record as used */
+static void replay_done(replay_t *h) {
+	h->current = 0;
+	h->type    = 0;
+}
+
+void* replay_open(const char *device) {
+	replay_t *h;
+	FILE *f;
+	long size;
+
+	f = fopen(device, "rb");
+	if (!f)
+		return NULL;
+
+	h = calloc(sizeof(replay_t), 1);
+	if (!h) {
+		fclose(f);
+		return NULL;
+	}
+	if (fseek(f, 0, SEEK_END) != 0 || (size = ftell(f)) == -1 || fseek(f, 0, SEEK_SET) != 0) {
+		fclose(f);
+		free(h);
+		return NULL;
+	}
+	h->data = malloc(size > 0 ? size : 1);
+	if (!h->data) {
+		fclose(f);
+		free(h);
+		return NULL;
+	}
+	if (size < (long)strlen(TRACE_MAGIC) || fread(h->data, 1, size, f) != (size_t)size ||
+	    memcmp(h->data, TRACE_MAGIC, strlen(TRACE_MAGIC)) != 0) {
+		fprintf(stderr, "Replay: %s is not a trace file\n", device);
+		fclose(f);
+		free(h->data);
+		free(h);
+		return NULL;
+	}
+	fclose(f);
+
+	h->size = size;
+	h->pos  = strlen(TRACE_MAGIC);
+	return h;
+}
+
+void replay_close(void *storage) {
+	replay_t *h = storage;
+
+	free(h->data);
+	free(h);
+}
+
+void replay_flush(void *storage) {
+	replay_t *h = storage;
+
+	if (replay_next(h) == TRACE_FLUSH)
+		replay_done(h);
+}
+
+serial_err_t replay_setup(void *storage, const unsigned int baud, const serial_bits_t bits, const serial_parity_t parity, const serial_stopbit_t stopbit, unsigned int *baud_actual) {
+	replay_t *h = storage;
+	uint64_t v = 0;
+	size_t pos;
+
+	/* report the rate of the recorded session */
+	*baud_actual = baud;
+	while(replay_next(h) == TRACE_FLUSH)
+		replay_done(h);
+	if (h->type == TRACE_SETUP) {
+		pos = h->pos;
+		h->pos = h->rec_pos;
+		if (trace_get_varint(h, &v) && v)
+			*baud_actual = v;
+		h->pos = pos;
+		replay_done(h);
+	}
+	return SERIAL_ERR_OK;
+}
+
+serial_err_t replay_write(void *storage, const void *buffer, unsigned int len, unsigned int *written) {
+	replay_t *h = storage;
+	const uint8_t *pos = buffer;
+	unsigned int n = 0;
+
+	/* sent bytes are a stream, chunks may be split differently than recorded */
+	while(n < len) {
+		while(replay_next(h) == TRACE_FLUSH || h->type == TRACE_SETUP)
+			replay_done(h);
+		if (h->type != TRACE_WRITE) {
+			fprintf(stderr, "Replay: host sends data the recorded session did not (tx offset %lu)\n",
+				(unsigned long)h->tx_offset);
+			return SERIAL_ERR_SYSTEM;
+		}
+		if (h->data[h->rec_pos] != pos[n]) {
+			fprintf(stderr, "Replay: sent 0x%02X, recorded 0x%02X (tx offset %lu)\n",
+				pos[n], h->data[h->rec_pos], (unsigned long)h->tx_offset);
+			return SERIAL_ERR_SYSTEM;
+		}
+		h->rec_pos++;
+		h->tx_offset++;
+		n++;
+		if (h->rec_pos == h->rec_end)
+			replay_done(h);
+	}
+
+	*written = n;
+	return SERIAL_ERR_OK;
+}
+
+serial_err_t replay_read(void *storage, void *buffer, unsigned int len, unsigned int *readed, unsigned int timeout) {
+	replay_t *h = storage;
+	unsigned int n;
+
+	while(replay_next(h) == TRACE_FLUSH || h->type == TRACE_SETUP)
+		replay_done(h);
+
+	switch(h->type) {
+		case TRACE_TIMEOUT:
+			/* the recorded wait ran out: so does this one, the deadlines
+			 * of the callers pass as they did
+			 */
+			sleep_us((uint64_t)timeout * 1000);
+			replay_done(h);
+			return SERIAL_ERR_NODATA;
+
+		case TRACE_READ:
+			n = h->rec_end - h->rec_pos;
+			if (n > len)
+				n = len;
+			memcpy(buffer, &h->data[h->rec_pos], n);
+			h->rec_pos += n;
+			if (h->rec_pos == h->rec_end)
+				replay_done(h);
+			*readed = n;
+			return SERIAL_ERR_OK;
+
+		case TRACE_WRITE:
+			fprintf(stderr, "Replay: host waits for data, recorded session sent first (tx offset %lu)\n",
+				(unsigned long)h->tx_offset);
+			return SERIAL_ERR_SYSTEM;
+
+		default:
+			fprintf(stderr, "Replay: host waits for data after the end of the recorded session (tx offset %lu)\n",
+				(unsigned long)h->tx_offset);
+			return SERIAL_ERR_SYSTEM;
+	}
+}
+
+serial_err_t replay_low_latency(void *storage) {
+	return SERIAL_ERR_OK;
+}
+
+int replay_fd(void *storage) {
+	/* replies come from the trace at once */
+	return -1;
+}
+
+serial_backend_t SERIAL_REPLAY = {
+	"trace replay",
+	"replay://",
+	replay_open,
+	replay_close,
+	replay_flush,
+	replay_setup,
+	replay_write,
+	replay_read,
+	replay_low_latency,
+	replay_fd
+};
@@ -29,25 +29,19 @@
 
 #include <windows.h>
 
-#include "serial.h"
+#include "serial_backend.h"
 
-struct serial {
+typedef struct {
 	HANDLE fd;
 	DCB oldtio;
 	DCB newtio;
+} tty_t;
 
-	char			configured;
-	serial_baud_t		baud;
-	serial_bits_t		bits;
-	serial_parity_t		parity;
-	serial_stopbit_t	stopbit;
-};
-
-serial_t* serial_open(const char *device) 
+void* tty_open(const char *device) 
 {
-	serial_t *h = calloc(sizeof(serial_t), 1);
+	tty_t *h = calloc(sizeof(tty_t), 1);
 
-	COMMTIMEOUTS timeouts = {MAXDWORD, MAXDWORD, 3000, 0, 0}; //read timeout 3sec
+	COMMTIMEOUTS timeouts = {MAXDWORD, MAXDWORD, SERIAL_DEFAULT_TIMEOUT, 0, 0};
 
 	/* Fix the device name if required */
 	char *devName;
@@ -72,6 +66,7 @@ serial_t* serial_open(const char *device)
 	if (h->fd == INVALID_HANDLE_VALUE) {
 		if (GetLastError() == ERROR_FILE_NOT_FOUND)
 			fprintf(stderr, "File not found: %s\n", device);
+		free(h);
 		return NULL;
 	}
 
@@ -89,34 +84,33 @@ serial_t* serial_open(const char *device)
 	return h;
 }
 
-void serial_close(serial_t *h) 
+void tty_flush(void *storage) 
 {
-	if(!h || h->fd == INVALID_HANDLE_VALUE)
-		return;
+	tty_t *h = storage;
 
-	serial_flush(h);
-	SetCommState(h->fd, &h->oldtio);
-	CloseHandle(h->fd);
-	free(h);
+	PurgeComm(h->fd, PURGE_TXCLEAR|PURGE_RXCLEAR);
 }
 
-void serial_flush(const serial_t *h) 
+void tty_close(void *storage) 
 {
-	if(!h || h->fd == INVALID_HANDLE_VALUE)
-		return;
-	PurgeComm(h->fd, PURGE_TXCLEAR|PURGE_RXCLEAR);
+	tty_t *h = storage;
+
+	tty_flush(h);
+	SetCommState(h->fd, &h->oldtio);
+	CloseHandle(h->fd);
+	free(h);
 }
 
-serial_err_t serial_setup(serial_t *h, 
-			  const serial_baud_t baud, 
-			  const serial_bits_t bits, 
-			  const serial_parity_t parity, 
-			  const serial_stopbit_t stopbit) 
+serial_err_t tty_setup(void *storage, 
+		       const unsigned int baud, 
+		       const serial_bits_t bits, 
+		       const serial_parity_t parity, 
+		       const serial_stopbit_t stopbit,
+		       unsigned int *baud_actual) 
 {
-	if(!h || h->fd == INVALID_HANDLE_VALUE)
-		return SERIAL_ERR_NOT_CONFIGURED;
+	tty_t *h = storage;
 
-	switch(baud) {
+	switch(serial_get_baud(baud)) {
 		case SERIAL_BAUD_110   : h->newtio.BaudRate = CBR_110   ; break;
 		case SERIAL_BAUD_300   : h->newtio.BaudRate = CBR_300   ; break;
 		case SERIAL_BAUD_600   : h->newtio.BaudRate = CBR_600   ; break;
@@ -133,10 +127,12 @@ serial_err_t serial_setup(serial_t *h,
 		case SERIAL_BAUD_128000: h->newtio.BaudRate = CBR_128000; break;
 		case SERIAL_BAUD_256000: h->newtio.BaudRate = CBR_256000; break;
 
-		case SERIAL_BAUD_INVALID: return SERIAL_ERR_INVALID_BAUD; break;
+		case SERIAL_BAUD_INVALID:
 		default:
 		/* These are not defined in WinBase.h and might work or not */
-			h->newtio.BaudRate = serial_get_baud_int(baud);
+			if (baud == 0)
+				return SERIAL_ERR_INVALID_BAUD;
+			h->newtio.BaudRate = baud;
 	}
 
 	switch(bits) {
@@ -166,15 +162,6 @@ serial_err_t serial_setup(serial_t *h,
 			return SERIAL_ERR_INVALID_STOPBIT;
 	}
 
-	/* if the port is already configured, no need to do anything */
-	if (
-		h->configured        &&
-		h->baud	   == baud   &&
-		h->bits	   == bits   &&
-		h->parity  == parity &&
-		h->stopbit == stopbit
-	) return SERIAL_ERR_OK;
-
 	/* reset the settings */
 	h->newtio.fOutxCtsFlow = FALSE;
 	h->newtio.fOutxDsrFlow = FALSE;
@@ -184,76 +171,70 @@ serial_err_t serial_setup(serial_t *h,
 	h->newtio.fAbortOnError = 0;
 
 	/* set the settings */
-	serial_flush(h);
+	tty_flush(h);
 	if (!SetCommState(h->fd, &h->newtio))
 		return SERIAL_ERR_SYSTEM;
 
-	h->configured = 1;
-	h->baud	      = baud;
-	h->bits	      = bits;
-	h->parity     = parity;
-	h->stopbit    = stopbit;
+	/* the driver reports the rate it could really set */
+	DCB settings;
+	*baud_actual = baud;
+	if (GetCommState(h->fd, &settings) && settings.BaudRate)
+		*baud_actual = settings.BaudRate;
 	return SERIAL_ERR_OK;
 }
 
-serial_err_t serial_write(const serial_t *h, const void *buffer, unsigned int len) 
+serial_err_t tty_write(void *storage, const void *buffer, unsigned int len, unsigned int *written) 
 {
-	if(!h || h->fd == INVALID_HANDLE_VALUE || !h->configured)
-		return SERIAL_ERR_NOT_CONFIGURED;
-	if(!buffer || !len)
-		return SERIAL_ERR_WRONG_ARG;
-
+	tty_t *h = storage;
 	DWORD r;
-	uint8_t *pos = (uint8_t*)buffer;
-
-	while(len > 0) {
-		if(!WriteFile(h->fd, pos, len, &r, NULL))
-			return SERIAL_ERR_SYSTEM;
-		if (r < 1) return SERIAL_ERR_SYSTEM;
 
-		len -= r;
-		pos += r;
-	}
+	if(!WriteFile(h->fd, buffer, len, &r, NULL))
+		return SERIAL_ERR_SYSTEM;
+	if (r < 1) return SERIAL_ERR_SYSTEM;
 
+	*written = r;
 	return SERIAL_ERR_OK;
 }
 
-serial_err_t serial_read(const serial_t *h, const void *buffer, unsigned int len, unsigned int *readed)
+serial_err_t tty_read(void *storage, void *buffer, unsigned int len, unsigned int *readed, unsigned int timeout)
 {
-	if(!h || h->fd == INVALID_HANDLE_VALUE || !h->configured)
-		return SERIAL_ERR_NOT_CONFIGURED;
-	if(!buffer || !len)
-		return SERIAL_ERR_WRONG_ARG;
-
+	tty_t *h = storage;
+	COMMTIMEOUTS timeouts = {MAXDWORD, MAXDWORD, 0, 0, 0};
 	DWORD r;
-	uint8_t *pos = (uint8_t*)buffer;
 
-	while(len > 0) {
-		ReadFile(h->fd, pos, len, &r, NULL);
-		      if (r == 0) return SERIAL_ERR_NODATA;
-		else  if (r <  0) return SERIAL_ERR_SYSTEM;
+	/* return at once if something is received, otherwise wait up to timeout */
+	timeouts.ReadTotalTimeoutConstant = timeout ? timeout : 1;
+	SetCommTimeouts(h->fd, &timeouts);
 
-		len -= r;
-		pos += r;
-		if(readed) *readed += r;
-	}
+	if (!ReadFile(h->fd, buffer, len, &r, NULL))
+		return SERIAL_ERR_SYSTEM;
+	if (r == 0) return SERIAL_ERR_NODATA;
 
+	*readed = r;
 	return SERIAL_ERR_OK;
 }
 
-const char* serial_get_setup_str(const serial_t *h) 
+int tty_fd(void *storage)
+{
+	/* COM handles can't be poll()ed */
+	return -1;
+}
+
+serial_err_t tty_low_latency(void *storage)
 {
-	static char str[11];
-	if (!h || !h->configured)
-		snprintf(str, sizeof(str), "INVALID");
-	else
-		snprintf(str, sizeof(str), "%u %d%c%d",
-			serial_get_baud_int   (h->baud   ),
-			serial_get_bits_int   (h->bits   ),
-			serial_get_parity_str (h->parity ),
-			serial_get_stopbit_int(h->stopbit)
-		);
-
-	return str;
+	/* the FTDI latency timer is a driver property on Windows */
+	return SERIAL_ERR_SYSTEM;
 }
 
+serial_backend_t SERIAL_TTY = {
+	"Win32 COM",
+	NULL,
+	tty_open,
+	tty_close,
+	tty_flush,
+	tty_setup,
+	tty_write,
+	tty_read,
+	tty_low_latency,
+	tty_fd
+};
@@ -0,0 +1,23 @@
+#!/bin/sh
+# Compressed writes through the RAM applet (-X -z) of images with an odd
+# and a 2-mod-4 length: blocks are halved until they pack, every frame but
+# the last one must still start on a half-word.
+#
+# usage: applet_tails.sh build_dir
+
+bin=$1
+tmp=${TMPDIR:-/tmp}/stmflasher_tails.$$
+mkdir -p "$tmp" || exit 1
+trap 'kill $sim 2>/dev/null; rm -rf "$tmp"' EXIT
+
+"$bin/stm32sim" -d 410 -b 0 -l "$tmp/tty" > /dev/null 2>&1 &
+sim=$!
+sleep 1
+
+# code packs, but not so well that a whole staging buffer fits a frame
+for len in 20003 20002; do
+	head -c $len "$bin/stmflasher" > "$tmp/image.bin"
+	"$bin/stmflasher" -p "$tmp/tty" -X -z -w "$tmp/image.bin" -v -K -V0 || exit 1
+	"$bin/stmflasher" -p "$tmp/tty" -c -r "$tmp/read.bin" -S :$len -V0 || exit 1
+	cmp "$tmp/image.bin" "$tmp/read.bin" || exit 1
+done
@@ -0,0 +1,1086 @@
+/*
+  stmflasher - Open Source ST MCU flash program for *nix
+  Copyright (C) 2010 Geoffrey McRae <geoff@spacevs.com>
+  Copyright (C) 2011 Steve Markgraf <steve@steve-m.de>
+  Copyright (C) 2012 Tormod Volden
+  Copyright (C) 2012-2013 Alatar <alatar_@list.ru>
+
+  This program is free software; you can redistribute it and/or
+  modify it under the terms of the GNU General Public License
+  as published by the Free Software Foundation; either version 2
+  of the License, or (at your option) any later version.
+
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with this program; if not, write to the Free Software
+  Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+*/
+
+/* stm32sim - STM32 USART bootloader (AN3155) on a pseudo terminal.
+ *
+ * The memory map of the simulated chip comes from the devices[] table of
+ * stm32.c. The wire time of every byte and the flash program and erase
+ * times are simulated, so the target can be as slow as a real one.
+ * After GO and after the commands which reset a real chip the simulator
+ * waits for INIT again, like a chip which boots with BOOT0 high.
+ */
+
+#define _GNU_SOURCE
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdarg.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <termios.h>
+#include <poll.h>
+
+#include "stm32.h"
+#include "applet.h"
+#include "lz4.h"
+#include "utils.h"
+
+#define SIM_ACK		0x79
+#define SIM_NACK	0x1F
+#define SIM_INIT	0x7F
+#define SIM_NOISE	128	/* 1 in SIM_NOISE bytes is hit above the clean rate */
+#define SIM_SWITCH	20	/* ms the host gets to follow a rate change of the applet */
+#define SIM_TRIAL	100	/* ms a new applet rate waits for a good frame */
+#define SIM_CMD_CRC	0xA1	/* Get Checksum */
+#define SIM_CRC_VERSION	0x33	/* first bootloader version with it */
+
+enum {
+	REG_RAM,
+	REG_FLASH,
+	REG_SYSTEM,
+	REG_OPTION,
+	REG_EEPROM,
+	REG_UID,	/* unique device ID, if outside the others */
+	REG_SIZE,	/* flash size register, if outside the others */
+	REG_COUNT
+};
+
+typedef struct {
+	uint32_t	start, end;
+	uint8_t		*data;
+} region_t;
+
+/* target */
+static const stm32_dev_t *dev		= NULL;
+static uint8_t		bl_version	= 0x22;
+static region_t		regions[REG_COUNT];
+static char		rdp		= 0; //read protection active
+static unsigned int	flash_kib	= 0; //flash the part has, 0 - all of the device table's
+static uint32_t		unit		= 1; //serial number in the unique ID
+
+/* timing */
+static unsigned int	baud		= 57600; //wire speed, 0 - no delay
+static char		baud_host	= 0; //wire speed is the host rate seen at INIT
+static unsigned int	max_baud	= 0; //fastest host rate without bit errors, 0 - any
+static int		page_erase	= -1; //ms, -1 - from devices[]
+static int		mass_erase	= -1; //ms, -1 - from devices[]
+static unsigned int	prog_word	= 100;//us to program 32 bits of flash
+static unsigned int	latency		= 0; //us added to each turn of the line (USB adapters)
+static uint64_t		byte_us		= 0;
+static uint64_t		rx_time		= 0; //when the last received byte was really in
+static unsigned int	locked		= 0; //host rate measured by INIT, 0 - waiting for INIT
+static unsigned int	noise_seed	= 1;
+
+/* link */
+static int		master		= -1;
+static int		slave		= -1;
+static char		*link_name	= NULL;
+static char		verbose		= 0;
+
+/* functions */
+static void show_help(char *name);
+static void cleanup(void);
+
+#ifdef __linux__
+/* serial_linux.c */
+unsigned int serial_linux_get_baud(int fd);
+#endif
+
+static void on_signal(int sig) {
+	exit(0);
+}
+
+static void cleanup(void) {
+	if (link_name)
+		unlink(link_name);
+}
+
+static void sim_log(const char *fmt, ...) {
+	va_list ap;
+
+	if (!verbose)
+		return;
+	va_start(ap, fmt);
+	vfprintf(stderr, fmt, ap);
+	va_end(ap);
+}
+
+/* sleep until the given moment */
+static void wait_until(uint64_t t) {
+	uint64_t now = now_us();
+	if (t > now)
+		sleep_us(t - now);
+}
+
+/* rate the host has set on the pty, 0 if not known */
+static unsigned int host_baud(void) {
+#ifdef __linux__
+	return serial_linux_get_baud(master);
+#else
+	return 0;
+#endif
+}
+
+/* What the UART makes of the bytes: garbage unless the host still uses the
+ * rate INIT was measured at, some bit errors above the clean rate.
+ */
+static void line_noise(uint8_t *buf, unsigned int len) {
+	unsigned int host, i;
+
+	if (!max_baud && !locked)
+		return;
+	host = host_baud();
+	if (!host)
+		return;
+	for(i = 0; i < len; i++) {
+		if (locked && host != locked)
+			buf[i] = rand_r(&noise_seed);
+		else if (max_baud && host > max_baud && rand_r(&noise_seed) % SIM_NOISE == 0)
+			buf[i] ^= 1 << (rand_r(&noise_seed) % 8);
+	}
+}
+
+/* Receive exactly len bytes, each of them takes its time on the wire.
+ * Data the simulator had to wait for has turned the line around, so it
+ * also pays the latency; bytes sent ahead without waiting for a reply don't.
+ */
+static int rx(uint8_t *buf, unsigned int len) {
+	struct pollfd pfd = {master, POLLIN, 0};
+	unsigned int got = 0;
+	char waited;
+	ssize_t r;
+
+	while(got < len) {
+		waited = poll(&pfd, 1, 0) == 0;
+		r = read(master, buf + got, len - got);
+		if (r <= 0)
+			return 0;
+		uint64_t now = now_us();
+		if (rx_time < now)
+			rx_time = now;
+		if (waited)
+			rx_time += latency;
+		rx_time += byte_us * r;
+		got += r;
+	}
+	line_noise(buf, len);
+	wait_until(rx_time);
+	return 1;
+}
+
+static void tx(const uint8_t *buf, unsigned int len) {
+	uint8_t chunk[256];
+	unsigned int n, sent;
+	ssize_t r;
+
+	sleep_us(byte_us * len);
+	while(len > 0) {
+		n = len < sizeof(chunk) ? len : sizeof(chunk);
+		memcpy(chunk, buf, n);
+		line_noise(chunk, n);
+		for(sent = 0; sent < n; sent += r) {
+			r = write(master, chunk + sent, n - sent);
+			if (r <= 0)
+				return;
+		}
+		buf += n;
+		len -= n;
+	}
+}
+
+static void tx_byte(uint8_t byte) {
+	tx(&byte, 1);
+}
+
+static uint8_t xor_cs(uint8_t cs, const uint8_t *data, unsigned int len) {
+	while(len-- > 0)
+		cs ^= *data++;
+	return cs;
+}
+
+static void map(int reg, uint32_t start, uint32_t end, uint8_t fill) {
+	regions[reg].start = start;
+	regions[reg].end   = end;
+	if (end > start) {
+		regions[reg].data = malloc(end - start);
+		memset(regions[reg].data, fill, end - start);
+	}
+}
+
+/* region holding [addr, addr + len), -1 if none */
+static int find_region(uint32_t addr, unsigned int len) {
+	int i;
+
+	for(i = 0; i < REG_COUNT; i++) {
+		if (regions[i].end > regions[i].start &&
+		    addr >= regions[i].start && addr + len <= regions[i].end)
+			return i;
+	}
+	return -1;
+}
+
+/* the flash size register, in system memory on F0/F1/F3, else a word of
+ * its own
+ */
+static void set_flash_size(void) {
+	int reg = find_region(dev->fl_size, 2);
+	uint8_t *p;
+
+	if (reg < 0) {
+		map(REG_SIZE, dev->fl_size & ~3, (dev->fl_size & ~3) + 4, 0xFF);
+		reg = REG_SIZE;
+	}
+	p = regions[reg].data + dev->fl_size - regions[reg].start;
+	p[0] = flash_kib;
+	p[1] = flash_kib >> 8;
+}
+
+/* the unique ID: unit number, then "SIMULATE" as lot number. On STM32L1
+ * the last word is 0x14 bytes on.
+ */
+static void set_uid(void) {
+	static const uint8_t lot[8] = "SIMULATE";
+	char l1 = dev->id == 0x416 || dev->id == 0x436 || dev->id == 0x427;
+	unsigned int len = l1 ? 24 : 12;
+	int reg = find_region(dev->uid, len);
+	uint8_t *p;
+
+	if (reg < 0) {
+		map(REG_UID, dev->uid, dev->uid + len, 0x00);
+		reg = REG_UID;
+	}
+	p = regions[reg].data + dev->uid - regions[reg].start;
+	p[0] = unit;
+	p[1] = unit >> 8;
+	p[2] = unit >> 16;
+	p[3] = unit >> 24;
+	memcpy(p + 4, lot, 4);
+	memcpy(p + (l1 ? 20 : 8), lot + 4, 4);
+}
+
+/* address phase: 4 bytes MSB first and XOR checksum */
+static int rx_address(uint32_t *addr) {
+	uint8_t frame[5];
+
+	if (!rx(frame, sizeof(frame)))
+		return 0;
+	if (xor_cs(0, frame, 4) != frame[4])
+		return 0;
+	*addr = (frame[0] << 24) | (frame[1] << 16) | (frame[2] << 8) | frame[3];
+	return 1;
+}
+
+static void erase_pages(unsigned int first, unsigned int count) {
+	region_t *fl = &regions[REG_FLASH];
+	unsigned int i;
+	uint32_t a;
+
+	for(i = first; i < first + count && (a = stm32_page_addr(dev, i)) < fl->end; i++)
+		memset(fl->data + a - fl->start, 0xFF, stm32_page_addr(dev, i + 1) - a);
+	sleep_us((uint64_t)count * page_erase * 1000);
+}
+
+static void erase_all(void) {
+	region_t *fl = &regions[REG_FLASH];
+
+	memset(fl->data, 0xFF, fl->end - fl->start);
+	sleep_us((uint64_t)mass_erase * 1000);
+}
+
+static void cmd_get(void) {
+	static const uint8_t cmds[] = {0x00, 0x01, 0x02, 0x11, 0x21, 0x31, 0x43, 0x63, 0x73, 0x82, 0x92};
+	uint8_t reply[3 + sizeof(cmds) + 2];
+	unsigned int n = 0;
+
+	reply[n++] = SIM_ACK;
+	reply[n++] = 0;
+	reply[n++] = bl_version;
+	memcpy(reply + n, cmds, sizeof(cmds));
+	if (bl_version >= 0x30)
+		reply[n + 6] = 0x44;
+	n += sizeof(cmds);
+	/* newer bootloaders list Get Checksum last */
+	if (bl_version >= SIM_CRC_VERSION)
+		reply[n++] = SIM_CMD_CRC;
+	reply[1] = n - 3;
+	reply[n++] = SIM_ACK;
+	tx(reply, n);
+}
+
+static void cmd_gvr(void) {
+	uint8_t reply[] = {SIM_ACK, bl_version, 0x00, 0x00, SIM_ACK};
+	tx(reply, sizeof(reply));
+}
+
+static void cmd_gid(void) {
+	uint8_t reply[] = {SIM_ACK, 1, dev->id >> 8, dev->id & 0xFF, SIM_ACK};
+	tx(reply, sizeof(reply));
+}
+
+static int cmd_read(void) {
+	uint32_t addr;
+	uint8_t n[2];
+	int reg;
+
+	if (rdp) {
+		tx_byte(SIM_NACK);
+		return 1;
+	}
+	tx_byte(SIM_ACK);
+	if (!rx_address(&addr) || find_region(addr, 1) < 0) {
+		tx_byte(SIM_NACK);
+		return 1;
+	}
+	tx_byte(SIM_ACK);
+
+	if (!rx(n, 2))
+		return 0;
+	reg = find_region(addr, n[0] + 1);
+	if ((n[0] ^ n[1]) != 0xFF || reg < 0) {
+		tx_byte(SIM_NACK);
+		return 1;
+	}
+	sim_log("READ  0x%08x %u\n", addr, n[0] + 1);
+	tx_byte(SIM_ACK);
+	tx(regions[reg].data + addr - regions[reg].start, n[0] + 1);
+	return 1;
+}
+
+/* Get Checksum: address, byte count, polynomial and initial value, each
+ * ACKed, then ACK and the CRC. Only the CRC unit's reset setup is known.
+ */
+static int cmd_crc(void) {
+	uint32_t addr, len, poly, init, crc;
+	uint8_t reply[5];
+	int reg;
+
+	if (rdp) {
+		tx_byte(SIM_NACK);
+		return 1;
+	}
+	tx_byte(SIM_ACK);
+	if (!rx_address(&addr) || addr % 4) {
+		tx_byte(SIM_NACK);
+		return 1;
+	}
+	tx_byte(SIM_ACK);
+	if (!rx_address(&len) || len % 4 || (reg = find_region(addr, len)) < 0) {
+		tx_byte(SIM_NACK);
+		return 1;
+	}
+	tx_byte(SIM_ACK);
+	if (!rx_address(&poly) || poly != 0x04C11DB7) {
+		tx_byte(SIM_NACK);
+		return 1;
+	}
+	tx_byte(SIM_ACK);
+	if (!rx_address(&init) || init != 0xFFFFFFFF) {
+		tx_byte(SIM_NACK);
+		return 1;
+	}
+	tx_byte(SIM_ACK);
+
+	sim_log("CRC   0x%08x %u\n", addr, len);
+	crc = crc32_unit(regions[reg].data + addr - regions[reg].start, len);
+	reply[0] = crc >> 24;
+	reply[1] = crc >> 16;
+	reply[2] = crc >> 8;
+	reply[3] = crc;
+	reply[4] = xor_cs(0, reply, 4);
+	sleep_us(len / 4 / 16);
+	tx_byte(SIM_ACK);
+	tx(reply, sizeof(reply));
+	return 1;
+}
+
+/* return 0 if the target restarts */
+static int cmd_write(void) {
+	uint8_t buf[1 + 256 + 1];
+	uint32_t addr;
+	unsigned int i, len;
+	uint8_t *dst;
+	int reg;
+
+	if (rdp) {
+		tx_byte(SIM_NACK);
+		return 1;
+	}
+	tx_byte(SIM_ACK);
+	if (!rx_address(&addr) || find_region(addr, 1) < 0 || addr % 4 ||
+	    (find_region(addr, 1) == REG_RAM && addr < dev->ram_bl_res)) {
+		tx_byte(SIM_NACK);
+		return 1;
+	}
+	tx_byte(SIM_ACK);
+
+	if (!rx(buf, 1))
+		return 0;
+	len = buf[0] + 1;
+	if (!rx(buf + 1, len + 1))
+		return 0;
+	reg = find_region(addr, len);
+	if (xor_cs(0, buf, len + 1) != buf[len + 1] || reg < 0) {
+		tx_byte(SIM_NACK);
+		return 1;
+	}
+	sim_log("WRITE 0x%08x %u\n", addr, len);
+
+	dst = regions[reg].data + addr - regions[reg].start;
+	if (reg == REG_FLASH) {
+		/* programming can only clear bits */
+		for(i = 0; i < len; i++)
+			dst[i] &= buf[1 + i];
+		sleep_us((uint64_t)(len + 3) / 4 * prog_word);
+	} else {
+		memcpy(dst, buf + 1, len);
+	}
+	tx_byte(SIM_ACK);
+
+	/* new option bytes are loaded by a reset */
+	return reg != REG_OPTION;
+}
+
+static uint32_t rd_le32(const uint8_t *p) {
+	return p[0] | (p[1] << 8) | (p[2] << 16) | ((uint32_t)p[3] << 24);
+}
+
+static void wr_le32(uint8_t *p, uint32_t v) {
+	p[0] = v;
+	p[1] = v >> 8;
+	p[2] = v >> 16;
+	p[3] = v >> 24;
+}
+
+/* stmflasher's RAM applet, which GO enters after the 8 byte header of its
+ * reset code, its parameter block aside
+ */
+static int is_applet(uint32_t addr) {
+	region_t *ram = &regions[REG_RAM];
+	const uint8_t *code;
+
+	if (find_region(addr + 8, applet_code_length) != REG_RAM)
+		return 0;
+	code = ram->data + addr + 8 - ram->start;
+	return memcmp(code, applet_code, APPLET_PARAMS) == 0 &&
+	       memcmp(code + APPLET_PARAMS + APPLET_PARAMS_LEN, applet_code + APPLET_PARAMS + APPLET_PARAMS_LEN,
+		      applet_code_length - APPLET_PARAMS - APPLET_PARAMS_LEN) == 0;
+}
+
+/* 'W': flash only, half-words which already hold the data are skipped,
+ * others must be erased
+ */
+static uint8_t sim_applet_write(uint32_t addr, const uint8_t *data, unsigned int len) {
+	region_t *fl = &regions[REG_FLASH];
+	uint8_t *dst;
+	unsigned int i;
+
+	if (find_region(addr, len) != REG_FLASH || addr % 2 || len % 2)
+		return APPLET_NACK;
+	dst = fl->data + addr - fl->start;
+	sim_log("APPLET WRITE 0x%08x %u\n", addr, len);
+	for(i = 0; i < len; i += 2) {
+		if (dst[i] == data[i] && dst[i + 1] == data[i + 1])
+			continue;
+		if (dst[i] != 0xFF || dst[i + 1] != 0xFF)
+			return APPLET_FAIL;
+		dst[i]     = data[i];
+		dst[i + 1] = data[i + 1];
+	}
+	sleep_us((uint64_t)(len + 3) / 4 * prog_word);
+	return APPLET_ACK;
+}
+
+/* 'Z': an LZ4 block after its unpacked length, programmed as 'W' */
+static uint8_t sim_applet_unpack(uint32_t addr, const uint8_t *data, unsigned int len, unsigned int zsz) {
+	uint8_t *buf;
+	int out;
+	uint8_t r;
+
+	if (len < 2 || !(buf = malloc(zsz + 1)))
+		return APPLET_NACK;
+	out = lz4_decompress(data + 2, len - 2, buf, zsz);
+	if (out < 0 || out != (data[0] | (data[1] << 8))) {
+		free(buf);
+		return APPLET_NACK;
+	}
+	sim_log("APPLET UNPACK %u -> %d\n", len, out);
+	r = sim_applet_write(addr, buf, out);
+	free(buf);
+	return r;
+}
+
+/* 'R': ACK, the data and its CRC-32 */
+static void sim_applet_read(uint32_t addr, uint32_t len) {
+	uint8_t crc[4];
+	int reg;
+
+	reg = find_region(addr, len);
+	if (len == 0 || reg < 0) {
+		tx_byte(APPLET_NACK);
+		return;
+	}
+	sim_log("APPLET READ  0x%08x %u\n", addr, len);
+	wr_le32(crc, crc32_update(0, regions[reg].data + addr - regions[reg].start, len));
+	tx_byte(APPLET_ACK);
+	tx(regions[reg].data + addr - regions[reg].start, len);
+	tx(crc, sizeof(crc));
+}
+
+/* 'C': ACK and the CRC of the range, by the CRC unit if it has one and the
+ * range is word aligned
+ */
+static void sim_applet_crc(uint32_t addr, uint32_t len, char unit) {
+	const uint8_t *data;
+	uint8_t crc[4];
+	int reg;
+
+	reg = find_region(addr, len);
+	if (reg < 0) {
+		tx_byte(APPLET_NACK);
+		return;
+	}
+	data = regions[reg].data + addr - regions[reg].start;
+	unit = unit && !(addr % 4) && !(len % 4);
+	sim_log("APPLET CRC   0x%08x %u%s\n", addr, len, unit ? " (unit)" : "");
+	wr_le32(crc, unit ? crc32_unit(data, len) : crc32_update(0, data, len));
+	tx_byte(APPLET_ACK);
+	tx(crc, sizeof(crc));
+}
+
+/* the applet has set the USART to a new rate */
+static void sim_applet_rate(unsigned int rate) {
+	locked = rate;
+	if (baud_host && locked)
+		byte_us = 11000000ULL / locked;
+}
+
+/* rx() of the applet, which gives up with -1 when a rate trial runs out */
+static int applet_rx(uint8_t *buf, unsigned int len, uint64_t trial) {
+	struct pollfd pfd = {master, POLLIN, 0};
+	unsigned int i;
+	uint64_t now;
+
+	if (!trial)
+		return rx(buf, len);
+	for(i = 0; i < len; i++) {
+		now = now_us();
+		if (now >= trial || poll(&pfd, 1, (trial - now) / 1000 + 1) == 0)
+			return -1;
+		if (!rx(buf + i, 1))
+			return 0;
+	}
+	return 1;
+}
+
+/* serve the applet protocol (applet.h) until it resets the chip */
+static void sim_applet_session(uint32_t addr) {
+	const uint8_t *params = regions[REG_RAM].data + addr + 8 + APPLET_PARAMS - regions[REG_RAM].start;
+	unsigned int bufsz = rd_le32(params + APPLET_P_BUFSZ);
+	unsigned int zsz = rd_le32(params + APPLET_P_ZSZ);
+	char crc_unit = rd_le32(params + APPLET_P_CRC) != 0;
+	uint8_t *frame = malloc(7 + bufsz + 4);
+	const uint8_t *script = regions[REG_RAM].data + rd_le32(params + 4) - regions[REG_RAM].start;	/* startup script */
+	unsigned int len, i, start_rate = locked;
+	uint64_t trial = 0;
+	uint32_t arg;
+	int r;
+
+	sim_log("APPLET at 0x%08x, frames up to %u, blocks up to %u\n", addr + 8, bufsz, zsz);
+	tx_byte(APPLET_ACK);
+	for(;;) {
+		if ((r = applet_rx(frame, 1, trial)) <= 0 || frame[0] != APPLET_MAGIC ||
+		    (r = applet_rx(frame, 7, trial)) <= 0)
+			goto next;
+		len = frame[1] | (frame[2] << 8);
+		arg = rd_le32(frame + 3);
+		if (len > bufsz) {
+			tx_byte(APPLET_NACK);
+			continue;
+		}
+		if ((r = applet_rx(frame + 7, len + 4, trial)) <= 0)
+			goto next;
+		if (crc32_update(0, frame, 7 + len) != rd_le32(frame + 7 + len)) {
+			tx_byte(APPLET_NACK);
+			continue;
+		}
+		trial = 0;
+
+		switch(frame[0]) {
+			case APPLET_OP_WRITE:
+				tx_byte(sim_applet_write(arg, frame + 7, len));
+				break;
+			case APPLET_OP_CRC:
+				if (len != 4) {
+					tx_byte(APPLET_NACK);
+					break;
+				}
+				sim_applet_crc(arg, rd_le32(frame + 7), crc_unit);
+				break;
+			case APPLET_OP_UNPACK:
+				tx_byte(sim_applet_unpack(arg, frame + 7, len, zsz));
+				break;
+			case APPLET_OP_READ:
+				if (len != 4) {
+					tx_byte(APPLET_NACK);
+					break;
+				}
+				sim_applet_read(arg, rd_le32(frame + 7));
+				break;
+			case APPLET_OP_BAUD:
+				/* the startup script sets the startup rate, another one is taken
+				 * to set the rate the host follows with
+				 */
+				tx_byte(APPLET_ACK);
+				if (memcmp(frame + 7, script, len) == 0) {
+					sim_applet_rate(start_rate);
+				} else {
+					for(i = 0; i < SIM_SWITCH && host_baud() == locked; i++)
+						sleep_us(1000);
+					sim_applet_rate(host_baud());
+				}
+				trial = now_us() + SIM_TRIAL * 1000;
+				sim_log("APPLET BAUD %u, on trial\n", locked);
+				break;
+			case APPLET_OP_RESET:
+				tx_byte(APPLET_ACK);
+				sim_log("APPLET reset, target restarts\n");
+				free(frame);
+				return;
+			default:
+				tx_byte(APPLET_NACK);
+		}
+		continue;
+next:
+		if (r == 0)
+			break;
+		/* a rate on trial without a good frame in time: the startup script runs again */
+		if (r < 0) {
+			sim_log("APPLET no good frame at %u baud, back to %u\n", locked, start_rate);
+			sim_applet_rate(start_rate);
+			trial = 0;
+		}
+	}
+	free(frame);
+}
+
+static int cmd_go(void) {
+	uint32_t addr;
+	int reg;
+
+	if (rdp) {
+		tx_byte(SIM_NACK);
+		return 1;
+	}
+	tx_byte(SIM_ACK);
+	if (!rx_address(&addr) ||
+	    ((reg = find_region(addr, 4)) != REG_FLASH && reg != REG_RAM)) {
+		tx_byte(SIM_NACK);
+		return 1;
+	}
+	tx_byte(SIM_ACK);
+	if (reg == REG_RAM && is_applet(addr)) {
+		sim_applet_session(addr);
+		return 0;
+	}
+	sim_log("GO    0x%08x, target restarts\n", addr);
+	return 0;
+}
+
+static int cmd_erase(void) {
+	uint8_t buf[1 + 256 + 1];
+	unsigned int i, n;
+
+	if (rdp) {
+		tx_byte(SIM_NACK);
+		return 1;
+	}
+	tx_byte(SIM_ACK);
+
+	if (!rx(buf, 1))
+		return 0;
+	if (buf[0] == 0xFF) {
+		if (!rx(buf + 1, 1))
+			return 0;
+		if (buf[1] != 0x00) {
+			tx_byte(SIM_NACK);
+			return 1;
+		}
+		sim_log("ERASE all\n");
+		erase_all();
+		tx_byte(SIM_ACK);
+		return 1;
+	}
+
+	n = buf[0] + 1;
+	if (!rx(buf + 1, n + 1))
+		return 0;
+	if (xor_cs(0, buf, n + 1) != buf[n + 1]) {
+		tx_byte(SIM_NACK);
+		return 1;
+	}
+	sim_log("ERASE %u pages from %u\n", n, buf[1]);
+	for(i = 0; i < n; i++)
+		erase_pages(buf[1 + i], 1);
+	tx_byte(SIM_ACK);
+	return 1;
+}
+
+static int cmd_ext_erase(void) {
+	uint8_t *buf;
+	unsigned int i, n;
+
+	if (rdp) {
+		tx_byte(SIM_NACK);
+		return 1;
+	}
+	tx_byte(SIM_ACK);
+
+	buf = malloc(2 + 2 * 0x10000 + 1);
+	if (!rx(buf, 2)) {
+		free(buf);
+		return 0;
+	}
+	n = (buf[0] << 8) | buf[1];
+	if (n >= 0xFFFD) {
+		if (!rx(buf + 2, 1)) {
+			free(buf);
+			return 0;
+		}
+		if (xor_cs(0, buf, 2) != buf[2]) {
+			tx_byte(SIM_NACK);
+		} else {
+			sim_log("ERASE all (special 0x%04x)\n", n);
+			erase_all();
+			tx_byte(SIM_ACK);
+		}
+		free(buf);
+		return 1;
+	}
+
+	n++;
+	if (!rx(buf + 2, 2 * n + 1)) {
+		free(buf);
+		return 0;
+	}
+	if (xor_cs(0, buf, 2 + 2 * n) != buf[2 + 2 * n]) {
+		tx_byte(SIM_NACK);
+		free(buf);
+		return 1;
+	}
+	sim_log("ERASE %u pages from %u\n", n, (buf[2] << 8) | buf[3]);
+	for(i = 0; i < n; i++)
+		erase_pages((buf[2 + 2 * i] << 8) | buf[3 + 2 * i], 1);
+	tx_byte(SIM_ACK);
+	free(buf);
+	return 1;
+}
+
+static int cmd_write_protect(void) {
+	uint8_t buf[1 + 256 + 1];
+	unsigned int n;
+
+	if (rdp) {
+		tx_byte(SIM_NACK);
+		return 1;
+	}
+	tx_byte(SIM_ACK);
+	if (!rx(buf, 1))
+		return 0;
+	n = buf[0] + 1;
+	if (!rx(buf + 1, n + 1))
+		return 0;
+	if (xor_cs(0, buf, n + 1) != buf[n + 1]) {
+		tx_byte(SIM_NACK);
+		return 1;
+	}
+	sim_log("WRITE PROTECT %u sectors\n", n);
+	tx_byte(SIM_ACK);
+	return 0;
+}
+
+static int cmd_write_unprotect(void) {
+	if (rdp) {
+		tx_byte(SIM_NACK);
+		return 1;
+	}
+	tx_byte(SIM_ACK);
+	sim_log("WRITE UNPROTECT\n");
+	sleep_us((uint64_t)page_erase * 1000);
+	tx_byte(SIM_ACK);
+	return 0;
+}
+
+static int cmd_read_protect(void) {
+	if (rdp) {
+		tx_byte(SIM_NACK);
+		return 1;
+	}
+	tx_byte(SIM_ACK);
+	sim_log("READ PROTECT\n");
+	sleep_us((uint64_t)page_erase * 1000);
+	rdp = 1;
+	tx_byte(SIM_ACK);
+	return 0;
+}
+
+static int cmd_read_unprotect(void) {
+	tx_byte(SIM_ACK);
+	sim_log("READ UNPROTECT\n");
+	erase_all();
+	rdp = 0;
+	tx_byte(SIM_ACK);
+	return 0;
+}
+
+/* Serve the bootloader until the target restarts or the link breaks.
+ * Return 0 on a broken link.
+ */
+static int session(void) {
+	uint8_t cmd[2];
+	int alive = 1;
+
+	/* autobaud: everything but INIT is noise until then */
+	locked = 0;
+	do {
+		if (!rx(cmd, 1))
+			return 0;
+	} while (cmd[0] != SIM_INIT);
+	locked = host_baud();
+	if (baud_host && locked)
+		byte_us = 11000000ULL / locked;
+	sim_log("INIT at %u baud\n", locked);
+	tx_byte(SIM_ACK);
+
+	while(alive) {
+		if (!rx(cmd, 2))
+			return 0;
+		if ((cmd[0] ^ cmd[1]) != 0xFF) {
+			tx_byte(SIM_NACK);
+			continue;
+		}
+
+		switch(cmd[0]) {
+			case 0x00: cmd_get(); break;
+			case 0x01: cmd_gvr(); break;
+			case 0x02: cmd_gid(); break;
+			case 0x11: alive = cmd_read(); break;
+			case 0x21: alive = cmd_go(); break;
+			case 0x31: alive = cmd_write(); break;
+			case 0x43:
+				if (bl_version >= 0x30) {
+					tx_byte(SIM_NACK);
+					break;
+				}
+				alive = cmd_erase();
+				break;
+			case 0x44:
+				if (bl_version < 0x30) {
+					tx_byte(SIM_NACK);
+					break;
+				}
+				alive = cmd_ext_erase();
+				break;
+			case 0x63: alive = cmd_write_protect(); break;
+			case 0x73: alive = cmd_write_unprotect(); break;
+			case 0x82: alive = cmd_read_protect(); break;
+			case 0x92: alive = cmd_read_unprotect(); break;
+			case SIM_CMD_CRC:
+				if (bl_version < SIM_CRC_VERSION) {
+					tx_byte(SIM_NACK);
+					break;
+				}
+				alive = cmd_crc();
+				break;
+			default:
+				tx_byte(SIM_NACK);
+		}
+	}
+	return 1;
+}
+
+static int open_pty(void) {
+	struct termios tio;
+	char *name;
+
+	master = posix_openpt(O_RDWR | O_NOCTTY);
+	if (master < 0 || grantpt(master) != 0 || unlockpt(master) != 0) {
+		perror("posix_openpt");
+		return 0;
+	}
+	name = ptsname(master);
+
+	/* keep the slave open, so the master doesn't see EIO between sessions */
+	slave = open(name, O_RDWR | O_NOCTTY);
+	if (slave < 0) {
+		perror(name);
+		return 0;
+	}
+	tcgetattr(slave, &tio);
+	cfmakeraw(&tio);
+	tcsetattr(slave, TCSANOW, &tio);
+
+	if (link_name) {
+		unlink(link_name);
+		if (symlink(name, link_name) != 0) {
+			perror(link_name);
+			link_name = NULL;
+			return 0;
+		}
+	}
+
+	printf("%s\n", link_name ? link_name : name);
+	fflush(stdout);
+	return 1;
+}
+
+int main(int argc, char *argv[]) {
+	unsigned int id = 0x410;
+	int c;
+
+	while((c = getopt(argc, argv, "d:V:f:u:b:m:L:e:E:w:l:vDh")) != -1) {
+		switch(c) {
+			case 'd':
+				id = strtoul(optarg, NULL, 16);
+				break;
+			case 'V':
+				bl_version = strtoul(optarg, NULL, 16);
+				break;
+			case 'f':
+				flash_kib = strtoul(optarg, NULL, 0);
+				break;
+			case 'u':
+				unit = strtoul(optarg, NULL, 0);
+				break;
+			case 'b':
+				if (strcmp(optarg, "host") == 0)
+					baud_host = 1;
+				else
+					baud = strtoul(optarg, NULL, 0);
+				break;
+			case 'm':
+				max_baud = strtoul(optarg, NULL, 0);
+				break;
+			case 'L':
+				latency = strtoul(optarg, NULL, 0);
+				break;
+			case 'e':
+				page_erase = strtoul(optarg, NULL, 0);
+				break;
+			case 'E':
+				mass_erase = strtoul(optarg, NULL, 0);
+				break;
+			case 'w':
+				prog_word = strtoul(optarg, NULL, 0);
+				break;
+			case 'l':
+				link_name = optarg;
+				break;
+			case 'v':
+				verbose = 1;
+				break;
+			case 'D':
+				for(dev = devices; dev->id; dev++)
+					printf("0x%03x  %s\n", dev->id, dev->name);
+				return 0;
+			case 'h':
+				show_help(argv[0]);
+				return 0;
+			default:
+				show_help(argv[0]);
+				return 1;
+		}
+	}
+
+	for(dev = devices; dev->id && dev->id != id; dev++);
+	if (!dev->id) {
+		fprintf(stderr, "ERROR: Unknown device ID 0x%03x, see -D\n", id);
+		return 1;
+	}
+	if (!flash_kib)
+		flash_kib = (dev->fl_end - dev->fl_start) / 1024;
+	if (flash_kib * 1024 > dev->fl_end - dev->fl_start ||
+	    stm32_page_addr(dev, stm32_page_of(dev, dev->fl_start + flash_kib * 1024)) != dev->fl_start + flash_kib * 1024) {
+		fprintf(stderr, "ERROR: %s has up to %uKiB of flash in whole pages\n", dev->name, (dev->fl_end - dev->fl_start) / 1024);
+		return 1;
+	}
+	if (page_erase < 0) page_erase = dev->fl_pet;
+	if (mass_erase < 0) mass_erase = dev->fl_met;
+
+	/* 8E1: start, 8 data, parity and stop bit */
+	byte_us = baud && !baud_host ? 11000000ULL / baud : 0;
+
+	map(REG_RAM   , dev->ram_start, dev->ram_end      , 0x00);
+	map(REG_FLASH , dev->fl_start , dev->fl_start + flash_kib * 1024, 0xFF);
+	map(REG_SYSTEM, dev->mem_start, dev->mem_end      , 0x00);
+	map(REG_OPTION, dev->opt_start, dev->opt_end + 1  , 0xFF);
+	map(REG_EEPROM, dev->eep_start, dev->eep_end      , 0x00);
+	set_uid();
+	set_flash_size();
+
+	atexit(cleanup);
+	signal(SIGINT , on_signal);
+	signal(SIGTERM, on_signal);
+
+	if (!open_pty())
+		return 1;
+	sim_log("Simulating %s (0x%03x), bootloader 0x%02x\n", dev->name, dev->id, bl_version);
+
+	while(session())
+		rx_time = 0;
+	return 1;
+}
+
+static void show_help(char *name) {
+	fprintf(stderr,
+		"Usage: %s [-d id] [-V version] [-f KiB] [-u unit] [-b rate|host] [-m rate] [-L us] [-e ms] [-E ms] [-w us]\n"
+		"	[-l link] [-vDh]\n"
+		"\n"
+		"	-d id		Device ID from the stmflasher device table (default 410)\n"
+		"	-V version	Bootloader version (default 22), 30 and up use extended erase,\n"
+		"			33 and up have Get Checksum\n"
+		"	-f KiB		Flash the part has, as its size register says (default the\n"
+		"			device table's)\n"
+		"	-u unit		Serial number in the unique device ID (default 1)\n"
+		"	-b rate		Simulated wire speed for 8E1 bytes (default 57600, 0 - no delay)\n"
+		"			host - the rate the host has set, as measured by INIT\n"
+		"	-m rate		Fastest host rate the line carries without bit errors\n"
+		"			(default 0 - any)\n"
+		"	-L us		Latency of every turn of the line, like a USB adapter (default 0)\n"
+		"	-e ms		Page erase time (default from the device table)\n"
+		"	-E ms		Mass erase time (default from the device table)\n"
+		"	-w us		Flash program time of 32 bits (default 100)\n"
+		"	-l link		Create a symlink to the pseudo terminal\n"
+		"	-v		Log bootloader commands to stderr\n"
+		"	-D		List known devices\n"
+		"	-h		Show this help\n"
+		"\n"
+		"The name of the pseudo terminal (or link) is printed on stdout.\n"
+		"Like the real bootloader, the simulator takes the host rate at INIT; changing\n"
+		"it without a reset garbles everything until the next INIT.\n"
+		"Example:\n"
+		"	%s -d 413 -V 31 -l /tmp/stm32 &\n"
+		"	stmflasher -p /tmp/stm32 -w firmware.hex -v\n",
+		name, name
+	);
+}
@@ -0,0 +1,24 @@
+#!/bin/sh
+# Record a session against stm32sim and replay it: -b auto above the rate
+# the simulated line carries (-m) times out at the higher rates, so the
+# trace has read timeouts in it. The replay must show the same.
+#
+# usage: trace_roundtrip.sh build_dir
+
+bin=$1
+tmp=${TMPDIR:-/tmp}/stmflasher_trace.$$
+mkdir -p "$tmp" || exit 1
+trap 'kill $sim 2>/dev/null; rm -rf "$tmp"' EXIT
+
+"$bin/stm32sim" -m 230400 -b host -l "$tmp/tty" > /dev/null 2>&1 &
+sim=$!
+sleep 1
+
+"$bin/stmflasher" -p "$tmp/tty" -b auto -i -T "$tmp/trace" > "$tmp/record.out" 2>&1 || exit 1
+kill $sim
+"$bin/stmflasher" -p "replay://$tmp/trace" -b auto -i > "$tmp/replay.out" 2>&1 || exit 1
+
+grep -q "Baud rate     : 230400 (auto)" "$tmp/record.out" || exit 1
+grep -v "round trip" "$tmp/record.out" > "$tmp/record.cmp"
+grep -v "round trip" "$tmp/replay.out" > "$tmp/replay.cmp"
+diff "$tmp/record.cmp" "$tmp/replay.cmp"
@@ -26,27 +26,12 @@
 #include <string.h>
 
 #include "stm32.h"
+#include "stm32_op.h"
 #include "utils.h"
 
-#define STM32_ACK	0x79
-#define STM32_NACK	0x1F
-#define STM32_CMD_INIT	0x7F
-#define STM32_CMD_GET	0x00	/* get the version and command supported */
-#define STM32_CMD_EE	0x44	/* extended erase */
-
-struct stm32_cmd {
-	uint8_t get;
-	uint8_t gvr;
-	uint8_t gid;
-	uint8_t rm;
-	uint8_t go;
-	uint8_t wm;
-	uint8_t er; /* this may be extended erase */
-	uint8_t wp;
-	uint8_t uw;
-	uint8_t rp;
-	uint8_t ur;
-};
+#define STM32_RESET_TRIES	3	/* attempts to run the reset code over a bad link */
+#define STM32_BOOT_TIME		20	/* ms from reset until the bootloader listens */
+#define STM32_CHECK_LEN		256	/* bytes of system memory read by the link check */
 
 /* Reset code for ARMv7-M (Cortex-M3) and ARMv6-M (Cortex-M0)
  * see ARMv7-M or ARMv6-M Architecture Reference Manual (table B3-8)
@@ -66,195 +51,146 @@ static const uint32_t stm_reset_code_length = sizeof(stm_reset_code);
 /* Device table, corresponds to the "Bootloader device-dependant parameters"
  * table in ST document AN2606.
  * Note that the option bytes upper range is inclusive!
+ * Erase times are the maximum values from the datasheets, they are used
+ * as the timeout for page and mass erase. The size register holds the
+ * flash the part really has in KiB, the UID is the 96 bit unique ID, see
+ * the "Device electronic signature" chapter of the reference manuals.
  */
+static const stm32_sector_t f2_f4_sectors[] = {
+	{4, 16384}, {1, 65536}, {7, 131072}, {0}
+};
+
 const stm32_dev_t devices[] = {
-//	{ PID ,         NAME                   , RAM start , RAM bl res, RAM end   ,FLASH start, FLASH end ,pps, psize, Mem start , Mem end   , Opt start ,  Opt end  ,EEPROM start,EEPROM end},
-	{0x412, "STM32F Low-density"           , 0x20000000, 0x20000200, 0x20002800, 0x08000000, 0x08008000,  4, 1024 , 0x1FFFF000, 0x1FFFF800, 0x1FFFF800, 0x1FFFF80F, 0x00000000, 0x00000000},
-	{0x410, "STM32F Medium-density"        , 0x20000000, 0x20000200, 0x20005000, 0x08000000, 0x08020000,  4, 1024 , 0x1FFFF000, 0x1FFFF800, 0x1FFFF800, 0x1FFFF80F, 0x00000000, 0x00000000},
-	{0x414, "STM32F High-density"          , 0x20000000, 0x20000200, 0x20010000, 0x08000000, 0x08080000,  2, 2048 , 0x1FFFF000, 0x1FFFF800, 0x1FFFF800, 0x1FFFF80F, 0x00000000, 0x00000000},
-	{0x418, "STM32F Connectivity line"     , 0x20000000, 0x20001000, 0x20010000, 0x08000000, 0x08040000,  2, 2048 , 0x1FFFB000, 0x1FFFF800, 0x1FFFF800, 0x1FFFF80F, 0x00000000, 0x00000000},
-	{0x420, "STM32F Low/Medium-density VL" , 0x20000000, 0x20000200, 0x20002000, 0x08000000, 0x08020000,  4, 1024 , 0x1FFFF000, 0x1FFFF800, 0x1FFFF800, 0x1FFFF80F, 0x00000000, 0x00000000},
-	{0x428, "STM32F High-density VL"       , 0x20000000, 0x20000200, 0x20008000, 0x08000000, 0x08080000,  2, 2048 , 0x1FFFF000, 0x1FFFF800, 0x1FFFF800, 0x1FFFF80F, 0x00000000, 0x00000000},
-	{0x430, "STM32F XL-density"            , 0x20000000, 0x20000800, 0x20018000, 0x08000000, 0x08100000,  2, 2048 , 0x1FFFE000, 0x1FFFF800, 0x1FFFF800, 0x1FFFF80F, 0x00000000, 0x00000000},
-	{0x416, "STM32L Medium-density"        , 0x20000000, 0x20000800, 0x20004000, 0x08000000, 0x08020000, 16,  256 , 0x1FF00000, 0x1FF01000, 0x1FF80000, 0x1FF8000F, 0x08080000, 0x08081000},
-	{0x436, "STM32L High-density"          , 0x20000000, 0x20001000, 0x2000C000, 0x08000000, 0x08060000, 16,  256 , 0x1FF00000, 0x1FF02000, 0x1FF80000, 0x1FF8001F, 0x08080000, 0x08083000},
-	{0x440, "STM32F051x"                   , 0x20000000, 0x20000800, 0x20002000, 0x08000000, 0x08010000,  4, 1024 , 0x1FFFEC00, 0x1FFFF800, 0x1FFFF800, 0x1FFFF80B, 0x00000000, 0x00000000},
-	/* Note that F2 and F4 devices have sectors of different page sizes
-           and only the first sectors (of one page size) are included here */
-	{0x411, "STM32F2xx"                    , 0x20000000, 0x20002000, 0x20020000, 0x08000000, 0x08100000,  4, 16384, 0x1FFF0000, 0x1FFF7800, 0x1FFFC000, 0x1FFFC00F, 0x00000000, 0x00000000},
-	{0x413, "STM32F4xx"                    , 0x20000000, 0x20002000, 0x20020000, 0x08000000, 0x08100000,  4, 16384, 0x1FFF0000, 0x1FFF7800, 0x1FFFC000, 0x1FFFC00F, 0x00000000, 0x00000000},
+//	{ PID ,         NAME                   , RAM start , RAM bl res, RAM end   ,FLASH start, FLASH end ,pps, psize, Mem start , Mem end   , Opt start ,  Opt end  ,EEPROM start,EEPROM end,PE ms, ME ms, Size reg  , UID       , Sectors  },
+	{0x412, "STM32F Low-density"           , 0x20000000, 0x20000200, 0x20002800, 0x08000000, 0x08008000,  4, 1024 , 0x1FFFF000, 0x1FFFF800, 0x1FFFF800, 0x1FFFF80F, 0x00000000, 0x00000000,   40 ,    40, 0x1FFFF7E0, 0x1FFFF7E8},
+	{0x410, "STM32F Medium-density"        , 0x20000000, 0x20000200, 0x20005000, 0x08000000, 0x08020000,  4, 1024 , 0x1FFFF000, 0x1FFFF800, 0x1FFFF800, 0x1FFFF80F, 0x00000000, 0x00000000,   40 ,    40, 0x1FFFF7E0, 0x1FFFF7E8},
+	{0x414, "STM32F High-density"          , 0x20000000, 0x20000200, 0x20010000, 0x08000000, 0x08080000,  2, 2048 , 0x1FFFF000, 0x1FFFF800, 0x1FFFF800, 0x1FFFF80F, 0x00000000, 0x00000000,   40 ,    40, 0x1FFFF7E0, 0x1FFFF7E8},
+	{0x418, "STM32F Connectivity line"     , 0x20000000, 0x20001000, 0x20010000, 0x08000000, 0x08040000,  2, 2048 , 0x1FFFB000, 0x1FFFF800, 0x1FFFF800, 0x1FFFF80F, 0x00000000, 0x00000000,   40 ,    40, 0x1FFFF7E0, 0x1FFFF7E8},
+	{0x420, "STM32F Low/Medium-density VL" , 0x20000000, 0x20000200, 0x20002000, 0x08000000, 0x08020000,  4, 1024 , 0x1FFFF000, 0x1FFFF800, 0x1FFFF800, 0x1FFFF80F, 0x00000000, 0x00000000,   40 ,    40, 0x1FFFF7E0, 0x1FFFF7E8},
+	{0x428, "STM32F High-density VL"       , 0x20000000, 0x20000200, 0x20008000, 0x08000000, 0x08080000,  2, 2048 , 0x1FFFF000, 0x1FFFF800, 0x1FFFF800, 0x1FFFF80F, 0x00000000, 0x00000000,   40 ,    40, 0x1FFFF7E0, 0x1FFFF7E8},
+	{0x430, "STM32F XL-density"            , 0x20000000, 0x20000800, 0x20018000, 0x08000000, 0x08100000,  2, 2048 , 0x1FFFE000, 0x1FFFF800, 0x1FFFF800, 0x1FFFF80F, 0x00000000, 0x00000000,   40 ,    80, 0x1FFFF7E0, 0x1FFFF7E8},
+	{0x416, "STM32L Medium-density"        , 0x20000000, 0x20000800, 0x20004000, 0x08000000, 0x08020000, 16,  256 , 0x1FF00000, 0x1FF01000, 0x1FF80000, 0x1FF8000F, 0x08080000, 0x08081000,   10 ,  5000, 0x1FF8004C, 0x1FF80050},
+	{0x436, "STM32L High-density"          , 0x20000000, 0x20001000, 0x2000C000, 0x08000000, 0x08060000, 16,  256 , 0x1FF00000, 0x1FF02000, 0x1FF80000, 0x1FF8001F, 0x08080000, 0x08083000,   10 ,  5000, 0x1FF800CC, 0x1FF800D0},
+	{0x440, "STM32F051x"                   , 0x20000000, 0x20000800, 0x20002000, 0x08000000, 0x08010000,  4, 1024 , 0x1FFFEC00, 0x1FFFF800, 0x1FFFF800, 0x1FFFF80B, 0x00000000, 0x00000000,   40 ,    40, 0x1FFFF7CC, 0x1FFFF7AC},
+	/* F2 and F4 erase sectors of 16, 64 and 128KiB, psize is the smallest */
+	{0x411, "STM32F2xx"                    , 0x20000000, 0x20002000, 0x20020000, 0x08000000, 0x08100000,  4, 16384, 0x1FFF0000, 0x1FFF7800, 0x1FFFC000, 0x1FFFC00F, 0x00000000, 0x00000000, 4000 , 32000, 0x1FFF7A22, 0x1FFF7A10, f2_f4_sectors},
+	{0x413, "STM32F4xx"                    , 0x20000000, 0x20002000, 0x20020000, 0x08000000, 0x08100000,  4, 16384, 0x1FFF0000, 0x1FFF7800, 0x1FFFC000, 0x1FFFC00F, 0x00000000, 0x00000000, 4000 , 32000, 0x1FFF7A22, 0x1FFF7A10, f2_f4_sectors},
 	/* These are not (yet) in AN2606 - reserved by bootloader memory not known: */
-	{0x427, "STM32L Medium-density Plus"   , 0x20000000, 0x20000800, 0x2000C000, 0x08000000, 0x08040000, 16,  256 , 0x1FF00000, 0x1FF02000, 0x1FF80000, 0x1FF8001F, 0x08080000, 0x08082000},
-	{0x422, "STM32F30x & F31x"             , 0x20000000, 0x20002000, 0x20003000, 0x08000000, 0x08040000,  2, 2048 , 0x1FFFE000, 0x1FFFF800, 0x1FFFF800, 0x1FFFF80F, 0x00000000, 0x00000000},
-	{0x432, "STM32F37x & F38x"             , 0x20000000, 0x20002000, 0x20003000, 0x08000000, 0x08040000,  2, 2048 , 0x1FFFE000, 0x1FFFF800, 0x1FFFF800, 0x1FFFF80F, 0x00000000, 0x00000000},
-	{0x444, "STM32F050x"                   , 0x20000000, 0x20000800, 0x20001000, 0x08000000, 0x08008000,  4, 1024 , 0x1FFFEC00, 0x1FFFF800, 0x1FFFF800, 0x1FFFF80B, 0x00000000, 0x00000000},
+	{0x427, "STM32L Medium-density Plus"   , 0x20000000, 0x20000800, 0x2000C000, 0x08000000, 0x08040000, 16,  256 , 0x1FF00000, 0x1FF02000, 0x1FF80000, 0x1FF8001F, 0x08080000, 0x08082000,   10 ,  5000, 0x1FF800CC, 0x1FF800D0},
+	{0x422, "STM32F30x & F31x"             , 0x20000000, 0x20002000, 0x20003000, 0x08000000, 0x08040000,  2, 2048 , 0x1FFFE000, 0x1FFFF800, 0x1FFFF800, 0x1FFFF80F, 0x00000000, 0x00000000,   40 ,    40, 0x1FFFF7CC, 0x1FFFF7AC},
+	{0x432, "STM32F37x & F38x"             , 0x20000000, 0x20002000, 0x20003000, 0x08000000, 0x08040000,  2, 2048 , 0x1FFFE000, 0x1FFFF800, 0x1FFFF800, 0x1FFFF80F, 0x00000000, 0x00000000,   40 ,    40, 0x1FFFF7CC, 0x1FFFF7AC},
+	{0x444, "STM32F050x"                   , 0x20000000, 0x20000800, 0x20001000, 0x08000000, 0x08008000,  4, 1024 , 0x1FFFEC00, 0x1FFFF800, 0x1FFFF800, 0x1FFFF80B, 0x00000000, 0x00000000,   40 ,    40, 0x1FFFF7CC, 0x1FFFF7AC},
 	{0x0}
 };
 
 /* internal functions */
-uint8_t stm32_gen_cs(const uint32_t v);
-void    stm32_send_byte(const stm32_t *stm, uint8_t byte);
-uint8_t stm32_read_byte(const stm32_t *stm);
-char    stm32_send_command(const stm32_t *stm, const uint8_t cmd);
-
+char stm32_run(stm32_op_t *op);
+void stm32_deferred_fallback(stm32_t *stm, uint32_t address);
+void stm32_flash_size(stm32_t *stm);
 
-uint8_t stm32_gen_cs(const uint32_t v) {
-	return  ((v & 0xFF000000) >> 24) ^
-		((v & 0x00FF0000) >> 16) ^
-		((v & 0x0000FF00) >>  8) ^
-		((v & 0x000000FF) >>  0);
-}
-
-void stm32_send_byte(const stm32_t *stm, uint8_t byte) {
-	serial_err_t err;
-	err = serial_write(stm->serial, &byte, 1);
-	if (err != SERIAL_ERR_OK) {
-		fprintf(stderr, "Failed to send byte: ");
-		perror("send_byte");
-		exit(1);
-	}
-}
 
-uint8_t stm32_read_byte(const stm32_t *stm) {
-	uint8_t byte;
-	serial_err_t err;
-	err = serial_read(stm->serial, &byte, 1, NULL);
-	if (err == SERIAL_ERR_NODATA) {
-		fprintf(stderr, "Failed to read byte: read timeout\n");
-		exit(1);
-	} else if (err != SERIAL_ERR_OK) {
-		fprintf(stderr, "Failed to read byte: ");
-		perror("read_byte");
-		exit(1);
-	}
-	return byte;
-}
+/* run one operation to its end and free it */
+char stm32_run(stm32_op_t *op) {
+	char ret = stm32_op_run(op) == STM32_OP_DONE;
 
-char stm32_send_command(const stm32_t *stm, const uint8_t cmd) {
-	int ret;
-
-	stm32_send_byte(stm, cmd);
-	stm32_send_byte(stm, cmd ^ 0xFF);
-	ret = stm32_read_byte(stm);
-	if (ret == STM32_ACK) {
-		return 1;
-	} else if (ret == STM32_NACK) {
-		fprintf(stderr, "Got NACK from device on command 0x%02x\n", cmd);
-	} else {
-		fprintf(stderr, "Unexpected reply from device on command 0x%02x\n", cmd);
-	}
-	return 0;
+	stm32_op_free(op);
+	return ret;
 }
 
-stm32_t* stm32_init(const serial_t *serial, const char init) {
-	uint8_t len;
+stm32_t* stm32_new(serial_t *serial) {
 	stm32_t *stm;
 
 	stm      = calloc(sizeof(stm32_t), 1);
 	stm->cmd = calloc(sizeof(stm32_cmd_t), 1);
 	stm->serial = serial;
+	return stm;
+}
 
-	if (init) {
-		uint8_t index;
-		uint8_t ans = 0;
-		serial_err_t err = 0;
-		for(index = 5; index > 0; index--) {
-			stm32_send_byte(stm, STM32_CMD_INIT);
-			err = serial_read(stm->serial, &ans, 1, NULL);
-			if (err == SERIAL_ERR_OK)
-				break;
-			if (err != SERIAL_ERR_NODATA) {
-				fprintf(stderr, "Failed to read byte: ");
-				perror("read_byte");
-				exit(1);
-			}
-		}
-		if(index == 0) {
-			fprintf(stderr, "Failed to read byte: read timeout\n");
-			exit(1);
-		}
-		if (ans == STM32_NACK) {
-			fprintf(stderr, "Got NACK from INIT! Trying to resume connection...\n");
-		} else if (ans != STM32_ACK) {
-			stm32_close(stm);
-			fprintf(stderr, "Failed to get init ACK (device return 0x%02X)\n", ans);
-			return NULL;
-		}
-	}
+stm32_t* stm32_init(serial_t *serial, const char init) {
+	stm32_t *stm = stm32_new(serial);
 
-	/* get the bootloader information */
-	if (!stm32_send_command(stm, STM32_CMD_GET)) return 0;
-	len              = stm32_read_byte(stm) + 1;
-	stm->bl_version  = stm32_read_byte(stm); --len;
-	stm->cmd->get    = stm32_read_byte(stm); --len;
-	stm->cmd->gvr    = stm32_read_byte(stm); --len;
-	stm->cmd->gid    = stm32_read_byte(stm); --len;
-	stm->cmd->rm     = stm32_read_byte(stm); --len;
-	stm->cmd->go     = stm32_read_byte(stm); --len;
-	stm->cmd->wm     = stm32_read_byte(stm); --len;
-	stm->cmd->er     = stm32_read_byte(stm); --len;
-	stm->cmd->wp     = stm32_read_byte(stm); --len;
-	stm->cmd->uw     = stm32_read_byte(stm); --len;
-	stm->cmd->rp     = stm32_read_byte(stm); --len;
-	stm->cmd->ur     = stm32_read_byte(stm); --len;
-	if (len > 0) {
-		fprintf(stderr, "Seems this bootloader returns more then we understand in the GET command, we will skip the unknown bytes\n");
-		while(len-- > 0) stm32_read_byte(stm);
-	}
-	if (stm32_read_byte(stm) != STM32_ACK) {
+	if (!stm32_run(stm32_op_init(stm, init))) {
 		stm32_close(stm);
 		return NULL;
 	}
+	stm32_flash_size(stm);
+	return stm;
+}
 
-	/* get the version and read protection status  */
-	if (!stm32_send_command(stm, stm->cmd->gvr)) {
-		stm32_close(stm);
-		return NULL;
-	}
+uint32_t stm32_page_addr(const stm32_dev_t *dev, unsigned int page) {
+	const stm32_sector_t *s = dev->fl_map;
+	uint32_t addr = dev->fl_start;
 
-	stm->version = stm32_read_byte(stm);
-	stm->option1 = stm32_read_byte(stm);
-	stm->option2 = stm32_read_byte(stm);
-	if (stm32_read_byte(stm) != STM32_ACK) {
-		stm32_close(stm);
-		return NULL;
+	if (!s)
+		return addr + page * dev->fl_ps;
+	for(; s[1].count && page >= s->count; s++) {
+		addr += s->count * s->size;
+		page -= s->count;
 	}
+	return addr + page * s->size;
+}
 
-	/* get the device ID */
-	if (!stm32_send_command(stm, stm->cmd->gid)) {
-		stm32_close(stm);
-		return NULL;
-	}
-	len = stm32_read_byte(stm) + 1;
-	if (len < 2) {
-		stm32_close(stm);
-		fprintf(stderr, "Only %d bytes sent in the PID, unknown/unsupported device\n", len);
-		return NULL;
-	}
-	stm->pid = (stm32_read_byte(stm) << 8) | stm32_read_byte(stm);
-	len -= 2;
-	if (len > 0) {
-		fprintf(stderr, "This bootloader returns %d extra bytes in PID:", len);
-		while (len-- > 0)
-			fprintf(stderr, " %02x", stm32_read_byte(stm));
-		fprintf(stderr, "\n");
-	}
-	if (stm32_read_byte(stm) != STM32_ACK) {
-		stm32_close(stm);
-		return NULL;
+unsigned int stm32_page_of(const stm32_dev_t *dev, uint32_t address) {
+	const stm32_sector_t *s = dev->fl_map;
+	uint32_t offset = address - dev->fl_start;
+	unsigned int page = 0;
+
+	if (!s)
+		return offset / dev->fl_ps;
+	for(; s[1].count && offset >= s->count * s->size; s++) {
+		offset -= s->count * s->size;
+		page += s->count;
 	}
+	return page + offset / s->size;
+}
 
-	stm->dev = devices;
-	while(stm->dev->id != 0x00 && stm->dev->id != stm->pid)
-		++stm->dev;
+/* the device table has the most flash of the family, the size register
+ * what this part has. Keep the table's if it can't be read (read
+ * protection) or makes no sense.
+ */
+void stm32_flash_size(stm32_t *stm) {
+	uint8_t reg[4];
+	const uint8_t *p = &reg[stm->dev->fl_size % 4]; /* reads are word aligned */
+	stm32_op_t *op;
+	uint32_t size;
+
+	stm->fl_end = stm->dev->fl_end;
+	op = stm32_op_read(stm, stm->dev->fl_size & ~3, reg, sizeof(reg));
+	stm32_op_quiet(op);
+	if (!stm32_run(op))
+		return;
+	size = p[0] | (p[1] << 8);
+	/* STM32L High-density has a code here: 0 - 256KiB, 1 - 384KiB */
+	if (stm->pid == 0x436 && size < 2)
+		size = size ? 384 : 256;
+	size *= 1024;
+	if (size && size < stm->dev->fl_end - stm->dev->fl_start)
+		stm->fl_end = stm->dev->fl_start + size;
+}
 
-	if (!stm->dev->id) {
-		fprintf(stderr, "Unknown/unsupported device (Device ID: 0x%03x)\n", stm->pid);
-		stm32_close(stm);
-		return NULL;
+/* STM32L1 has the last word of it 0x14 bytes on, not next to the others.
+ * A read-protected part NACKs it, that is no error here.
+ */
+char stm32_read_uid(stm32_t *stm, uint8_t uid[STM32_UID_LEN]) {
+	uint8_t reg[24];
+	char l1 = stm->pid == 0x416 || stm->pid == 0x436 || stm->pid == 0x427;
+	stm32_op_t *op;
+
+	op = stm32_op_read(stm, stm->dev->uid, reg, l1 ? 24 : STM32_UID_LEN);
+	stm32_op_quiet(op);
+	if (!stm32_run(op)) {
+		/* what is left of a deferred ACK burst */
+		if (stm->deferred_ack)
+			stm32_resync(stm);
+		return 0;
 	}
+	memcpy(uid, reg, 8);
+	memcpy(uid + 8, reg + (l1 ? 20 : 8), 4);
+	return 1;
+}
 
-	return stm;
+char stm32_probe(serial_t *serial, unsigned int tries) {
+	return stm32_run(stm32_op_probe(serial, tries));
 }
 
 void stm32_close(stm32_t *stm) {
@@ -262,207 +198,85 @@ void stm32_close(stm32_t *stm) {
 	free(stm);
 }
 
-char stm32_read_memory(const stm32_t *stm, uint32_t address, uint8_t data[], unsigned int len) {
-	uint8_t cs;
-	unsigned int i;
-	assert(len > 0 && len < 257);
-
-	/* must be 32bit aligned */
-	assert(address % 4 == 0);
-
-	address = be_u32      (address);
-	cs      = stm32_gen_cs(address);
-
-	if (!stm32_send_command(stm, stm->cmd->rm)) return 0;
-	if (serial_write(stm->serial, &address, 4) != SERIAL_ERR_OK)
-		return 0;
-
-	stm32_send_byte(stm, cs);
-	if (stm32_read_byte(stm) != STM32_ACK) return 0;
-
-	i = len - 1;
-	stm32_send_byte(stm, i);
-	stm32_send_byte(stm, i ^ 0xFF);
-	if (stm32_read_byte(stm) != STM32_ACK) return 0;
-
-	if (serial_read(stm->serial, data, len, NULL) != SERIAL_ERR_OK)
-		return 0;
-
-	return 1;
+char stm32_resync(stm32_t *stm) {
+	return stm32_run(stm32_op_resync(stm));
 }
 
-char stm32_write_memory(const stm32_t *stm, uint32_t address, const uint8_t data[], unsigned int len) {
-	uint8_t cs;
-	unsigned int i;
-	int c, extra;
-	assert(len > 0 && len < 257);
-
-	/* must be 32bit aligned */
-	assert(address % 4 == 0);
-
-	address = be_u32      (address);
-	cs      = stm32_gen_cs(address);
-
-	/* send the address and checksum */
-	if (!stm32_send_command(stm, stm->cmd->wm)) return 0;
-	if (serial_write(stm->serial, &address, 4) != SERIAL_ERR_OK)
-		return 0;
+/* the bootloader didn't take the burst, go back to lock-step for good */
+void stm32_deferred_fallback(stm32_t *stm, uint32_t address) {
+	fprintf(stderr, "Deferred ACK failed at address 0x%08x, falling back to lock-step\n", address);
+	stm->deferred_ack = 0;
+	stm32_resync(stm);
+}
 
-	stm32_send_byte(stm, cs);
-	if (stm32_read_byte(stm) != STM32_ACK) return 0;
+char stm32_read_memory(stm32_t *stm, uint32_t address, uint8_t data[], unsigned int len) {
+	if (stm->deferred_ack) {
+		if (stm32_run(stm32_op_read(stm, address, data, len)))
+			return 1;
+		stm32_deferred_fallback(stm, address);
+	}
+	return stm32_run(stm32_op_read(stm, address, data, len));
+}
 
-	/* setup the cs and send the length */
-	extra = len % 4;
-	if(extra) extra = 4 - extra;
-	cs = len - 1 + extra;
-	stm32_send_byte(stm, cs);
+char stm32_write_memory(stm32_t *stm, uint32_t address, const uint8_t data[], unsigned int len) {
+	if (stm->deferred_ack) {
+		if (stm32_run(stm32_op_write(stm, address, data, len)))
+			return 1;
+		stm32_deferred_fallback(stm, address);
+	}
+	return stm32_run(stm32_op_write(stm, address, data, len));
+}
 
-	/* write the data and build the checksum */
-	for(i = 0; i < len; ++i)
-		cs ^= data[i];
+/* CRC of flash by the bootloader (Get Checksum), if it has the command and
+ * the range is word aligned
+ */
+char stm32_crc_memory(stm32_t *stm, uint32_t address, uint32_t len, uint32_t *crc) {
+	uint8_t reply[5];
 
-	if (serial_write(stm->serial, data, len) != SERIAL_ERR_OK)
+	if (stm->cmd->crc == STM32_CMD_NONE || address % 4 || len % 4 ||
+	    !stm32_run(stm32_op_crc(stm, address, len, reply)) ||
+	    (reply[0] ^ reply[1] ^ reply[2] ^ reply[3]) != reply[4])
 		return 0;
-
-	/* write the alignment padding */
-	for(c = 0; c < extra; ++c) {
-		stm32_send_byte(stm, 0xFF);
-		cs ^= 0xFF;
-	}
-
-	/* send the checksum */
-	stm32_send_byte(stm, cs);
-	return stm32_read_byte(stm) == STM32_ACK;
+	*crc = (reply[0] << 24) | (reply[1] << 16) | (reply[2] << 8) | reply[3];
+	return 1;
 }
 
-char stm32_wunprot_memory(const stm32_t *stm) {
-	int ret;
-	if (!stm32_send_command(stm, stm->cmd->uw)) return 0;
 //Write unprotect should return two ACK bytes - one for command reception and one for command execution
-	ret = stm32_read_byte(stm);
-	if (ret == STM32_ACK) {
-		return 1;
-	} else if (ret == STM32_NACK) {
-		fprintf(stderr, "Got NACK from device on flash write unprotecting\n");
-	} else {
-		fprintf(stderr, "Unexpected reply from device on flash write unprotecting\n");
-	}
-	return 0;
+char stm32_wunprot_memory(stm32_t *stm) {
+	return stm32_run(stm32_op_confirm(stm, stm->cmd->uw, stm->dev->fl_pet, "flash write unprotecting"));
 }
 
-char stm32_runprot_memory  (const stm32_t *stm) {
-	int ret;
-	if (!stm32_send_command(stm, stm->cmd->ur)) return 0;
 //Read unprotect should return two ACK bytes - one for command reception and one for command execution
-	ret = stm32_read_byte(stm);
-	if (ret == STM32_ACK) {
-		return 1;
-	} else if (ret == STM32_NACK) {
-		fprintf(stderr, "Got NACK from device on flash read unprotecting\n");
-	} else {
-		fprintf(stderr, "Unexpected reply from device on flash read unprotecting\n");
-	}
-	return 0;
+//The second one comes after the whole flash is erased
+char stm32_runprot_memory(stm32_t *stm) {
+	return stm32_run(stm32_op_confirm(stm, stm->cmd->ur, stm->dev->fl_met, "flash read unprotecting"));
 }
 
-char stm32_rprot_memory(const stm32_t *stm) {
-	int ret;
-	if (!stm32_send_command(stm, stm->cmd->rp)) return 0;
 //Read protect should return two ACK bytes - one for command reception and one for command execution
-	ret = stm32_read_byte(stm);
-	if (ret == STM32_ACK) {
-		return 1;
-	} else if (ret == STM32_NACK) {
-		fprintf(stderr, "Got NACK from device on flash read protecting\n");
-	} else {
-		fprintf(stderr, "Unexpected reply from device on flash read protecting\n");
-	}
-	return 0;
+char stm32_rprot_memory(stm32_t *stm) {
+	return stm32_run(stm32_op_confirm(stm, stm->cmd->rp, stm->dev->fl_pet, "flash read protecting"));
 }
 
-char stm32_erase_memory(const stm32_t *stm, uint16_t spage, uint16_t pages) {
-	char res;
-
-	if (!pages)
-		return 1;
-
-	if (!stm32_send_command(stm, stm->cmd->er)) {
-		fprintf(stderr, "Can't initiate chip erase!\n");
-		return 0;
-	}
-
-	/* The erase command reported by the bootloader is either 0x43 or 0x44 */
-	/* 0x44 is Extended Erase, a 2 byte based protocol and needs to be handled differently. */
-	if (stm->cmd->er == STM32_CMD_EE) {
- 		/* Not all chips using Extended Erase support mass erase */
- 		/* Currently known as not supporting mass erase is the Ultra Low Power STM32L15xx range */
- 		/* So if someone has not overridden the default, but uses one of these chips, take it out of */
- 		/* mass erase mode, so it will be done page by page. This maximum might not be correct either! */
-		if (stm->pid == 0x416 && pages == 0xFFFF)
-		{
-			spage = 0;
-			pages = (stm->dev->fl_end - stm->dev->fl_start) / stm->dev->fl_ps; /* works for the STM32L152RB with 128Kb flash */
-		}
-
+char stm32_erase_memory(stm32_t *stm, uint16_t spage, uint16_t pages) {
+	return stm32_run(stm32_op_erase(stm, spage, pages));
+}
 
-		if (pages == 0xFFFF) {
-			stm32_send_byte(stm, 0xFF);
-			stm32_send_byte(stm, 0xFF); // 0xFFFF the magic number for mass erase
-			stm32_send_byte(stm, 0x00); // 0x00 the XOR of those two bytes as a checksum
-			if ((res = stm32_read_byte(stm)) != STM32_ACK) {
-				fprintf(stderr, "Mass erase failed (devicw return 0x%02X). Try specifying the number of pages to be erased.\n", res);
-				return 0;
-			} else
+/* erase the pages in list[], in as few commands as the bootloader takes */
+char stm32_erase_pages(stm32_t *stm, const uint16_t list[], unsigned int count) {
+	unsigned int n;
 
-			return 1;
-		}
-
-		uint16_t pg_num;
-		uint8_t pg_byte;
- 		uint8_t cs = ((pages-1) >> 8) ^ ((pages-1) & 0xFF);
-
- 		stm32_send_byte(stm, (pages-1) >> 8); // Number of pages to be erased, two bytes, MSB first
- 		stm32_send_byte(stm, (pages-1) & 0xFF);
-
- 		for (pg_num = spage; pg_num < (pages + spage); pg_num++) {
- 			pg_byte = pg_num >> 8;
- 			cs ^= pg_byte;
- 			stm32_send_byte(stm, pg_byte);
- 			pg_byte = pg_num & 0xFF;
- 			cs ^= pg_byte;
- 			stm32_send_byte(stm, pg_byte);
- 		}
- 		stm32_send_byte(stm, cs);
-
- 		if (stm32_read_byte(stm) != STM32_ACK) {
- 			fprintf(stderr, "Page-by-page erase failed. Check the maximum pages your device supports.\n");
+	for(; count; list += n, count -= n) {
+		n = count > STM32_ERASE_BATCH ? STM32_ERASE_BATCH : count;
+		if (!stm32_run(stm32_op_erase_list(stm, list, n)))
 			return 0;
- 		}
-
- 		return 1;
-	}
-
-	/* And now the regular erase (0x43) for all other chips */
-	if (pages == 0xFFFF) {
-		return stm32_send_command(stm, 0xFF);
-	} else {
-		uint8_t cs = 0;
-		uint8_t pg_num;
-		stm32_send_byte(stm, pages-1);
-		cs ^= (pages-1);
-		for (pg_num = spage; pg_num < (pages + spage); pg_num++) {
-			stm32_send_byte(stm, pg_num);
-			cs ^= pg_num;
-		}
-		stm32_send_byte(stm, cs);
-		return stm32_read_byte(stm) == STM32_ACK;
 	}
+	return 1;
 }
 
-char stm32_run_raw_code(const stm32_t *stm, uint32_t target_address, const uint8_t *code, uint32_t code_size)
+char stm32_run_raw_code(stm32_t *stm, uint32_t target_address, const uint8_t *code, uint32_t code_size)
 {
 	uint32_t stack_le = le_u32(0x20002000);
-	uint32_t code_address_le = le_u32(target_address + 8);
+	uint32_t code_address_le = le_u32(target_address + 8 + 1); /* Thumb state bit */
 	uint32_t length = code_size + 8;
 
 	/* Must be 32-bit aligned */
@@ -495,22 +309,47 @@ char stm32_run_raw_code(const stm32_t *stm, uint32_t target_address, const uint8
 	return stm32_go(stm, target_address);
 }
 
-char stm32_go(const stm32_t *stm, uint32_t address) {
-	uint8_t cs;
-
-	address = be_u32      (address);
-	cs      = stm32_gen_cs(address);
-
-	if (!stm32_send_command(stm, stm->cmd->go)) return 0;
-	serial_write(stm->serial, &address, 4);
-	serial_write(stm->serial, &cs     , 1);
-
-	return stm32_read_byte(stm) == STM32_ACK;
+char stm32_go(stm32_t *stm, uint32_t address) {
+	return stm32_run(stm32_op_go(stm, address));
 }
 
-char stm32_reset_device(const stm32_t *stm) {
+char stm32_reset_device(stm32_t *stm) {
 	uint32_t target_address = stm->dev->ram_bl_res;
 
 	return stm32_run_raw_code(stm, target_address, stm_reset_code, stm_reset_code_length);
 }
 
+/* The system memory doesn't change: read the same block twice, any failure
+ * or difference means the link corrupts data.
+ */
+char stm32_check_link(stm32_t *stm) {
+	uint8_t first[STM32_CHECK_LEN], second[STM32_CHECK_LEN];
+
+	if (!stm32_read_memory(stm, stm->dev->mem_start, first, sizeof(first)) ||
+	    !stm32_read_memory(stm, stm->dev->mem_start, second, sizeof(second)))
+		return 0;
+	return memcmp(first, second, sizeof(first)) == 0;
+}
+
+/* The bootloader measures the baud rate on the first INIT only, so restart
+ * it with the reset code (BOOT0 must still select the system memory) and
+ * INIT again at the new rate.
+ */
+char stm32_set_baud(stm32_t *stm, unsigned int baud) {
+	unsigned int i;
+
+	for(i = 0; !stm32_reset_device(stm); i++) {
+		if (i + 1 == STM32_RESET_TRIES)
+			return 0;
+		stm32_resync(stm);
+	}
+
+	if (serial_setup(stm->serial, baud, SERIAL_BITS_8, SERIAL_PARITY_EVEN, SERIAL_STOPBIT_1) != SERIAL_ERR_OK)
+		return 0;
+	sleep_us(STM32_BOOT_TIME * 1000);
+	serial_flush(stm->serial);
+
+	/* the command to ACK time changes with the rate */
+	stm->rtt = 0;
+	return stm32_probe(stm->serial, 5) && stm32_run(stm32_op_init(stm, 0));
+}
@@ -30,17 +30,49 @@
 typedef struct stm32		stm32_t;
 typedef struct stm32_cmd	stm32_cmd_t;
 typedef struct stm32_dev	stm32_dev_t;
+typedef struct stm32_sector	stm32_sector_t;
 
 struct stm32 {
-	const serial_t		*serial;
+	serial_t		*serial;
 	uint8_t			bl_version;
 	uint8_t			version;
 	uint8_t			option1, option2;
 	uint16_t		pid;
+	uint32_t		fl_end; // end of the flash the part really has
+	uint32_t		rtt; // command to ACK round trip time (us)
+	char			deferred_ack; // send read/write phases without waiting for each ACK
 	stm32_cmd_t		*cmd;
 	const stm32_dev_t	*dev;
 };
 
+#define STM32_CMD_NONE	0xFF	/* command not in the GET list */
+#define STM32_CMD_EE	0x44	/* extended erase */
+#define STM32_ERASE_BATCH	256	/* pages one erase command takes, as many as a regular erase can */
+#define STM32_UID_LEN		12	/* bytes of the unique device ID */
+
+struct stm32_cmd {
+	uint8_t get;
+	uint8_t gvr;
+	uint8_t gid;
+	uint8_t rm;
+	uint8_t go;
+	uint8_t wm;
+	uint8_t er; /* this may be extended erase */
+	uint8_t wp;
+	uint8_t uw;
+	uint8_t rp;
+	uint8_t ur;
+	uint8_t crc; /* Get Checksum, newer bootloaders only */
+	uint8_t count;
+	uint8_t list[255]; /* everything GET returned */
+};
+
+/* run of erase units of one size, a map of them ends with count 0 */
+struct stm32_sector {
+	uint16_t	count;
+	uint32_t	size;
+};
+
 struct stm32_dev {
 	uint16_t	id;
 	char		*name;
@@ -51,18 +83,38 @@ struct stm32_dev {
 	uint32_t	mem_start, mem_end;
 	uint32_t	opt_start, opt_end;
 	uint32_t	eep_start, eep_end;
+	uint16_t	fl_pet; // page erase time (ms, max)
+	uint16_t	fl_met; // mass erase time (ms, max)
+	uint32_t	fl_size; // flash size register (16 bit, KiB)
+	uint32_t	uid;     // unique device ID (96 bit)
+	const stm32_sector_t *fl_map; // sectors of different sizes, NULL - all fl_ps
 };
 
-stm32_t* stm32_init      (const serial_t *serial, const char init);
+extern const stm32_dev_t devices[];
+
+stm32_t* stm32_new       (serial_t *serial);
+stm32_t* stm32_init      (serial_t *serial, const char init);
+char stm32_probe         (serial_t *serial, unsigned int tries);
 void stm32_close         (stm32_t *stm);
-char stm32_read_memory   (const stm32_t *stm, uint32_t address, uint8_t data[], unsigned int len);
-char stm32_write_memory  (const stm32_t *stm, uint32_t address, const uint8_t data[], unsigned int len);
-char stm32_wunprot_memory(const stm32_t *stm);
-char stm32_erase_memory  (const stm32_t *stm, uint16_t spage, uint16_t pages);
-char stm32_go            (const stm32_t *stm, uint32_t address);
-char stm32_reset_device  (const stm32_t *stm);
-char stm32_rprot_memory    (const stm32_t *stm);
-char stm32_runprot_memory  (const stm32_t *stm);
+char stm32_read_memory   (stm32_t *stm, uint32_t address, uint8_t data[], unsigned int len);
+char stm32_write_memory  (stm32_t *stm, uint32_t address, const uint8_t data[], unsigned int len);
+char stm32_crc_memory    (stm32_t *stm, uint32_t address, uint32_t len, uint32_t *crc);
+char stm32_read_uid      (stm32_t *stm, uint8_t uid[STM32_UID_LEN]);
+char stm32_wunprot_memory(stm32_t *stm);
+char stm32_erase_memory  (stm32_t *stm, uint16_t spage, uint16_t pages);
+char stm32_erase_pages   (stm32_t *stm, const uint16_t list[], unsigned int count);
+char stm32_go            (stm32_t *stm, uint32_t address);
+char stm32_reset_device  (stm32_t *stm);
+char stm32_run_raw_code  (stm32_t *stm, uint32_t target_address, const uint8_t *code, uint32_t code_size);
+char stm32_rprot_memory    (stm32_t *stm);
+char stm32_runprot_memory  (stm32_t *stm);
+char stm32_resync          (stm32_t *stm);
+char stm32_check_link      (stm32_t *stm);
+char stm32_set_baud        (stm32_t *stm, unsigned int baud);
+
+/* flash pages are the erase units: the sectors where the device has fl_map */
+uint32_t     stm32_page_addr(const stm32_dev_t *dev, unsigned int page);
+unsigned int stm32_page_of  (const stm32_dev_t *dev, uint32_t address);
 
 #endif
 
@@ -0,0 +1,965 @@
+/*
+  stmflasher - Open Source ST MCU flash program for *nix
+  Copyright (C) 2010 Geoffrey McRae <geoff@spacevs.com>
+  Copyright (C) 2011 Steve Markgraf <steve@steve-m.de>
+  Copyright (C) 2012 Tormod Volden
+  Copyright (C) 2012-2013 Alatar <alatar_@list.ru>
+
+  This program is free software; you can redistribute it and/or
+  modify it under the terms of the GNU General Public License
+  as published by the Free Software Foundation; either version 2
+  of the License, or (at your option) any later version.
+
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with this program; if not, write to the Free Software
+  Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+*/
+
+/* Every bootloader operation is a list of steps: send a frame, expect
+ * ACKs, receive bytes, or call a function which looks at the reply and
+ * queues the next steps. Input steps never block on their own, they take
+ * what the port has and keep their deadline, so stm32_op_poll() can return
+ * to the caller whenever there is nothing to do.
+ */
+
+#include <stdlib.h>
+#include <assert.h>
+#include <stdio.h>
+#include <string.h>
+#ifndef __WIN32__
+#include <poll.h>
+#endif
+
+#include "stm32_op.h"
+#include "utils.h"
+
+#define STM32_ACK	0x79
+#define STM32_NACK	0x1F
+#define STM32_CMD_INIT	0x7F
+#define STM32_CMD_GET	0x00	/* get the version and command supported */
+#define STM32_CRC_POLY	0x04C11DB7	/* Get Checksum: the CRC unit's own setup */
+#define STM32_CRC_INIT	0xFFFFFFFF
+
+#define STM32_INIT_TRIES	5
+#define STM32_INIT_TIMEOUT	200	/* ms to wait for the answer to INIT */
+#define STM32_ACK_TIMEOUT	1000	/* ms to wait for ACK of a command or data block */
+#define STM32_CRC_KIB_US	1000	/* us the bootloader takes for the CRC of 1 KiB, at most */
+#define STM32_RESYNC_TRIES	300	/* more than the longest frame the target can wait for */
+#define STM32_OP_STEPS		16	/* queued steps of one operation */
+#define STM32_OP_IDLE_MS	1	/* poll period of ports without a descriptor */
+
+typedef enum {
+	STEP_SEND,	/* write a frame */
+	STEP_INIT,	/* INIT, sent again on timeout */
+	STEP_ACK,	/* len ACK bytes */
+	STEP_RECV,	/* len bytes to dst */
+	STEP_RECV_LEN,	/* length byte N and N + 1 bytes to op->rx */
+	STEP_RESYNC,	/* 0xFF until the target NACKs */
+	STEP_DRAIN,	/* drop input until the line is quiet for timeout */
+	STEP_CALL	/* look at the reply, may queue more steps */
+} step_type_t;
+
+typedef struct {
+	step_type_t	type;
+	unsigned int	off, len;	/* SEND: frame in op->tx, ACK and RECV: byte count */
+	uint8_t		*dst;		/* RECV */
+	unsigned int	timeout;	/* ms, input steps */
+	unsigned int	tries;		/* INIT and RESYNC */
+	int		cmd;		/* ACK of this command, -1 for other phases */
+	const char	*what;		/* ACK: operation named in the messages */
+	const char	*fail;		/* message when the step fails */
+	char		rtt;		/* ACK: keep the command round trip time */
+	char		(*fn)(stm32_op_t *op);	/* CALL, return 0 to fail */
+} step_t;
+
+struct stm32_op {
+	serial_t		*serial;
+	stm32_t			*stm;
+	char			quiet;		/* no messages, for probing */
+	stm32_op_state_t	state;
+
+	step_t			steps[STM32_OP_STEPS];
+	unsigned int		n_steps;
+	unsigned int		step;		/* current step */
+	char			started;	/* the current step has begun */
+	unsigned int		got;		/* input of the current step */
+	uint64_t		deadline;
+	uint64_t		t_sent;		/* last frame written */
+
+	uint8_t			*tx;		/* frames of the SEND steps */
+	unsigned int		tx_len, tx_size;
+	uint8_t			rx[1 + 256];	/* replies looked at by CALL steps */
+};
+
+/* internal functions */
+uint8_t stm32_gen_cs(const uint32_t v);
+uint8_t stm32_xor_cs(uint8_t cs, const uint8_t *data, unsigned int len);
+void    stm32_put_address(uint8_t *frame, uint32_t address);
+
+stm32_op_t* op_new(serial_t *serial, stm32_t *stm);
+step_t* op_add(stm32_op_t *op, step_type_t type);
+void    op_send(stm32_op_t *op, const uint8_t *frame, unsigned int len);
+void    op_command(stm32_op_t *op, uint8_t cmd, char rtt);
+step_t* op_ack(stm32_op_t *op, unsigned int count, unsigned int timeout);
+void    op_recv(stm32_op_t *op, uint8_t *dst, unsigned int len);
+void    op_call(stm32_op_t *op, char (*fn)(stm32_op_t *op));
+void    op_fail(stm32_op_t *op, const step_t *s);
+void    op_next(stm32_op_t *op);
+void    op_start(stm32_op_t *op, step_t *s);
+void    op_input(stm32_op_t *op, step_t *s, const uint8_t *buf, unsigned int len);
+void    op_timeout(stm32_op_t *op, step_t *s);
+char    op_init_get(stm32_op_t *op);
+char    op_init_gvr(stm32_op_t *op);
+char    op_init_gid(stm32_op_t *op);
+char    op_erase_list(stm32_op_t *op, const uint16_t list[], unsigned int count);
+
+
+uint8_t stm32_gen_cs(const uint32_t v) {
+	return  ((v & 0xFF000000) >> 24) ^
+		((v & 0x00FF0000) >> 16) ^
+		((v & 0x0000FF00) >>  8) ^
+		((v & 0x000000FF) >>  0);
+}
+
+uint8_t stm32_xor_cs(uint8_t cs, const uint8_t *data, unsigned int len) {
+	while(len-- > 0)
+		cs ^= *data++;
+	return cs;
+}
+
+/* address is sent MSB first and followed by XOR checksum, 5 bytes */
+void stm32_put_address(uint8_t *frame, uint32_t address) {
+	frame[0] = address >> 24;
+	frame[1] = address >> 16;
+	frame[2] = address >>  8;
+	frame[3] = address >>  0;
+	frame[4] = stm32_gen_cs(address);
+}
+
+stm32_op_t* op_new(serial_t *serial, stm32_t *stm) {
+	stm32_op_t *op = calloc(sizeof(stm32_op_t), 1);
+	if (!op)
+		return NULL;
+
+	op->serial = serial;
+	op->stm    = stm;
+	op->state  = STM32_OP_RUNNING;
+	return op;
+}
+
+/* queue a step, steps already done make room */
+step_t* op_add(stm32_op_t *op, step_type_t type) {
+	step_t *s;
+
+	if (op->n_steps == STM32_OP_STEPS) {
+		memmove(op->steps, &op->steps[op->step], (op->n_steps - op->step) * sizeof(step_t));
+		op->n_steps -= op->step;
+		op->step     = 0;
+	}
+	assert(op->n_steps < STM32_OP_STEPS);
+
+	s = &op->steps[op->n_steps++];
+	memset(s, 0, sizeof(step_t));
+	s->type    = type;
+	s->cmd     = -1;
+	s->timeout = STM32_ACK_TIMEOUT;
+	return s;
+}
+
+/* Send one complete protocol phase (command, address, data block...)
+ * with a single write, so USB adapters don't split it into many transfers.
+ */
+void op_send(stm32_op_t *op, const uint8_t *frame, unsigned int len) {
+	step_t *s;
+
+	if (op->tx_len + len > op->tx_size) {
+		uint8_t *tx = realloc(op->tx, op->tx_len + len + 64);
+		if (!tx) {
+			op->state = STM32_OP_FAILED;
+			return;
+		}
+		op->tx      = tx;
+		op->tx_size = op->tx_len + len + 64;
+	}
+	memcpy(op->tx + op->tx_len, frame, len);
+
+	s = op_add(op, STEP_SEND);
+	s->off = op->tx_len;
+	s->len = len;
+	op->tx_len += len;
+}
+
+/* command code and its complement, answered by an ACK */
+void op_command(stm32_op_t *op, uint8_t cmd, char rtt) {
+	uint8_t frame[2] = {cmd, cmd ^ 0xFF};
+	step_t *s;
+
+	op_send(op, frame, sizeof(frame));
+	s = op_ack(op, 1, STM32_ACK_TIMEOUT);
+	s->cmd = cmd;
+	s->rtt = rtt;
+}
+
+step_t* op_ack(stm32_op_t *op, unsigned int count, unsigned int timeout) {
+	step_t *s = op_add(op, STEP_ACK);
+
+	s->len     = count;
+	s->timeout = timeout;
+	return s;
+}
+
+void op_recv(stm32_op_t *op, uint8_t *dst, unsigned int len) {
+	step_t *s = op_add(op, STEP_RECV);
+
+	s->dst = dst;
+	s->len = len;
+}
+
+void op_call(stm32_op_t *op, char (*fn)(stm32_op_t *op)) {
+	op_add(op, STEP_CALL)->fn = fn;
+}
+
+void op_fail(stm32_op_t *op, const step_t *s) {
+	if (!op->quiet && s && s->fail)
+		fprintf(stderr, "%s\n", s->fail);
+	op->state = STM32_OP_FAILED;
+}
+
+void op_next(stm32_op_t *op) {
+	op->step++;
+	op->started = 0;
+	if (op->step == op->n_steps)
+		op->state = STM32_OP_DONE;
+}
+
+void op_start(stm32_op_t *op, step_t *s) {
+	serial_err_t err = SERIAL_ERR_OK;
+	uint8_t byte;
+
+	op->started  = 1;
+	op->got      = 0;
+	op->deadline = now_us() + s->timeout * 1000ULL +
+		serial_get_wire_us(op->serial, s->type == STEP_RECV_LEN ? 257 : s->len);
+
+	switch(s->type) {
+		case STEP_SEND:
+			op->t_sent = now_us();
+			err = serial_write(op->serial, op->tx + s->off, s->len);
+			if (err == SERIAL_ERR_OK)
+				op_next(op);
+			break;
+		case STEP_INIT:
+		case STEP_RESYNC:
+			byte = s->type == STEP_INIT ? STM32_CMD_INIT : 0xFF;
+			err = serial_write(op->serial, &byte, 1);
+			break;
+		case STEP_CALL:
+			/* fn may queue steps and move s, it prints its own messages */
+			if (s->fn(op))
+				op_next(op);
+			else
+				op_fail(op, NULL);
+			break;
+		default:
+			break;
+	}
+
+	if (err != SERIAL_ERR_OK) {
+		if (!op->quiet) {
+			fprintf(stderr, "Failed to send frame: ");
+			perror("send_frame");
+		}
+		op_fail(op, NULL);
+	}
+}
+
+/* a wrong byte where an ACK was expected */
+static void op_not_ack(stm32_op_t *op, const step_t *s, uint8_t byte) {
+	if (!op->quiet) {
+		const char *reply = byte == STM32_NACK ? "Got NACK" : "Unexpected reply";
+		if (s->cmd >= 0)
+			fprintf(stderr, "%s from device on command 0x%02x\n", reply, s->cmd);
+		else if (s->what)
+			fprintf(stderr, "%s from device on %s\n", reply, s->what);
+	}
+	op_fail(op, s);
+}
+
+void op_input(stm32_op_t *op, step_t *s, const uint8_t *buf, unsigned int len) {
+	unsigned int i;
+
+	switch(s->type) {
+		case STEP_ACK:
+			for(i = 0; i < len; i++) {
+				if (buf[i] != STM32_ACK) {
+					op_not_ack(op, s, buf[i]);
+					return;
+				}
+			}
+			op->got += len;
+			if (op->got < s->len)
+				return;
+			if (s->rtt && op->stm) {
+				uint64_t t = now_us() - op->t_sent;
+				if (op->stm->rtt == 0 || t < op->stm->rtt)
+					op->stm->rtt = t;
+			}
+			op_next(op);
+			break;
+
+		case STEP_RECV:
+			memcpy(s->dst + op->got, buf, len);
+			op->got += len;
+			if (op->got == s->len)
+				op_next(op);
+			break;
+
+		case STEP_RECV_LEN:
+			memcpy(op->rx + op->got, buf, len);
+			op->got += len;
+			if (op->got == op->rx[0] + 2u)
+				op_next(op);
+			break;
+
+		case STEP_INIT:
+			if (buf[0] == STM32_ACK) {
+				op_next(op);
+			} else if (buf[0] == STM32_NACK) {
+				if (!op->quiet)
+					fprintf(stderr, "Got NACK from INIT! Trying to resume connection...\n");
+				op_next(op);
+			} else {
+				if (!op->quiet)
+					fprintf(stderr, "Failed to get init ACK (device return 0x%02X)\n", buf[0]);
+				op_fail(op, s);
+			}
+			break;
+
+		case STEP_RESYNC:
+			if (buf[0] == STM32_NACK)
+				op_next(op);
+			else
+				op_timeout(op, s);
+			break;
+
+		case STEP_DRAIN:
+			/* quiet for a whole timeout from now on */
+			op->deadline = now_us() + s->timeout * 1000ULL;
+			break;
+
+		default:
+			break;
+	}
+}
+
+void op_timeout(stm32_op_t *op, step_t *s) {
+	switch(s->type) {
+		case STEP_INIT:
+		case STEP_RESYNC:
+			if (--s->tries > 0) {
+				op->started = 0;
+				return;
+			}
+			if (s->type == STEP_INIT && !op->quiet)
+				fprintf(stderr, "Failed to read byte: read timeout\n");
+			op_fail(op, s);
+			break;
+
+		case STEP_DRAIN:
+			op_next(op);
+			break;
+
+		default:
+			if (!op->quiet) {
+				fprintf(stderr, "Failed to read byte: read timeout\n");
+				if (s->type == STEP_ACK && s->cmd >= 0)
+					fprintf(stderr, "Unexpected reply from device on command 0x%02x\n", s->cmd);
+				else if (s->type == STEP_ACK && s->what)
+					fprintf(stderr, "Unexpected reply from device on %s\n", s->what);
+			}
+			op_fail(op, s);
+			break;
+	}
+}
+
+/* input bytes the current step still waits for */
+static unsigned int op_want(const stm32_op_t *op, const step_t *s) {
+	switch(s->type) {
+		case STEP_ACK:
+		case STEP_RECV:
+			return s->len - op->got;
+		case STEP_RECV_LEN:
+			return op->got ? op->rx[0] + 2u - op->got : 1;
+		case STEP_DRAIN:
+			return sizeof(op->rx);
+		default:
+			return 1;
+	}
+}
+
+/* Advance the operation, waiting at most wait ms for input
+ * (0 - take what is there, STM32_OP_FOREVER - until it ends).
+ */
+stm32_op_state_t stm32_op_poll(stm32_op_t *op, unsigned int wait) {
+	uint8_t buf[sizeof(op->rx)];
+	uint64_t until, limit, now;
+	unsigned int r;
+	serial_err_t err;
+	step_t *s;
+
+	if (!op)
+		return STM32_OP_FAILED;
+
+	until = wait == STM32_OP_FOREVER ? UINT64_MAX : now_us() + wait * 1000ULL;
+	while(op->state == STM32_OP_RUNNING) {
+		if (op->step == op->n_steps) {
+			op->state = STM32_OP_DONE;
+			break;
+		}
+
+		s = &op->steps[op->step];
+		if (!op->started) {
+			op_start(op, s);
+			continue;
+		}
+
+		now   = now_us();
+		limit = op->deadline < until ? op->deadline : until;
+		err   = serial_read_some(op->serial, buf, op_want(op, s), &r,
+			limit > now ? (limit - now + 999) / 1000 : 0);
+		if (err == SERIAL_ERR_OK) {
+			op_input(op, s, buf, r);
+		} else if (err != SERIAL_ERR_NODATA) {
+			if (!op->quiet) {
+				fprintf(stderr, "Failed to read byte: ");
+				perror("read_byte");
+			}
+			op_fail(op, NULL);
+		} else if (now_us() >= op->deadline) {
+			op_timeout(op, s);
+		} else if (now_us() >= until) {
+			break;
+		}
+	}
+	return op->state;
+}
+
+stm32_op_state_t stm32_op_state(const stm32_op_t *op) {
+	return op ? op->state : STM32_OP_FAILED;
+}
+
+/* when the operation gives up waiting for input (now_us() time) */
+uint64_t stm32_op_deadline(const stm32_op_t *op) {
+	return op->started ? op->deadline : now_us();
+}
+
+int stm32_op_fd(const stm32_op_t *op) {
+	return serial_get_fd(op->serial);
+}
+
+void stm32_op_quiet(stm32_op_t *op) {
+	if (op)
+		op->quiet = 1;
+}
+
+void stm32_op_free(stm32_op_t *op) {
+	if (op)
+		free(op->tx);
+	free(op);
+}
+
+/* run one operation to its end */
+stm32_op_state_t stm32_op_run(stm32_op_t *op) {
+	return stm32_op_poll(op, STM32_OP_FOREVER);
+}
+
+/* Drive operations on different ports from one thread: sleep in poll()
+ * until a port has input or the nearest deadline comes, then let every
+ * operation take what it can without waiting. Return the number done.
+ * Ports without a descriptor (replay, fault injector, Win32) can't wake
+ * poll(), while others run they are read every STM32_OP_IDLE_MS; one left
+ * on its own waits in its read up to the deadline.
+ */
+unsigned int stm32_op_run_all(stm32_op_t **ops, unsigned int n) {
+	unsigned int i, done = 0;
+#ifdef __WIN32__
+	char running = 1;
+
+	while(running) {
+		running = 0;
+		for(i = 0; i < n; i++)
+			if (stm32_op_poll(ops[i], STM32_OP_IDLE_MS) == STM32_OP_RUNNING)
+				running = 1;
+	}
+#else
+	struct pollfd *pfd = calloc(n ? n : 1, sizeof(struct pollfd));
+	uint64_t next, now;
+	unsigned int m, idle;
+	int timeout;
+
+	if (!pfd)
+		return 0;
+
+	/* start them all, the first steps only send */
+	for(i = 0; i < n; i++)
+		stm32_op_poll(ops[i], 0);
+
+	for(;;) {
+		next = UINT64_MAX;
+		timeout = -1;
+		idle = n;
+		for(i = m = 0; i < n; i++) {
+			pfd[i].fd      = -1;
+			pfd[i].events  = POLLIN;
+			pfd[i].revents = 0;
+			if (stm32_op_state(ops[i]) != STM32_OP_RUNNING)
+				continue;
+			m++;
+			pfd[i].fd = stm32_op_fd(ops[i]);
+			if (pfd[i].fd < 0) {
+				timeout = STM32_OP_IDLE_MS;
+				idle = i;
+			}
+			if (stm32_op_deadline(ops[i]) < next)
+				next = stm32_op_deadline(ops[i]);
+		}
+		if (m == 0)
+			break;
+		if (m == 1 && idle < n) {
+			stm32_op_run(ops[idle]);
+			break;
+		}
+
+		now = now_us();
+		if (timeout < 0 || (next < UINT64_MAX && (next - now) / 1000 < (uint64_t)timeout))
+			timeout = next > now ? (next - now + 999) / 1000 : 0;
+		/* negative fds are ignored by poll() */
+		poll(pfd, n, timeout);
+
+		now = now_us();
+		for(i = 0; i < n; i++) {
+			if (stm32_op_state(ops[i]) != STM32_OP_RUNNING)
+				continue;
+			if (pfd[i].revents || pfd[i].fd < 0 || stm32_op_deadline(ops[i]) <= now)
+				stm32_op_poll(ops[i], 0);
+		}
+	}
+	free(pfd);
+#endif
+
+	for(i = 0; i < n; i++)
+		if (stm32_op_state(ops[i]) == STM32_OP_DONE)
+			done++;
+	return done;
+}
+
+/* Quietly check that a bootloader answers INIT, to scan many ports at once.
+ * An already initialized bootloader NACKs the second INIT instead.
+ */
+stm32_op_t* stm32_op_probe(serial_t *serial, unsigned int tries) {
+	stm32_op_t *op = op_new(serial, NULL);
+	step_t *s;
+
+	if (!op)
+		return NULL;
+	op->quiet = 1;
+	s = op_add(op, STEP_INIT);
+	s->tries   = tries;
+	s->timeout = STM32_INIT_TIMEOUT;
+	return op;
+}
+
+/* INIT (unless resuming), then GET, GVR and GID fill in stm,
+ * they also give the link round trip time.
+ */
+stm32_op_t* stm32_op_init(stm32_t *stm, const char init) {
+	stm32_op_t *op = op_new(stm->serial, stm);
+	step_t *s;
+
+	if (!op)
+		return NULL;
+	if (init) {
+		/* fail fast if nobody answers, the bootloader replies at once */
+		s = op_add(op, STEP_INIT);
+		s->tries   = STM32_INIT_TRIES;
+		s->timeout = STM32_INIT_TIMEOUT;
+	}
+	op_command(op, STM32_CMD_GET, 1);
+	op_add(op, STEP_RECV_LEN);
+	op_ack(op, 1, STM32_ACK_TIMEOUT);
+	op_call(op, op_init_get);
+	return op;
+}
+
+char op_init_get(stm32_op_t *op) {
+	stm32_t *stm = op->stm;
+	unsigned int len = op->rx[0] + 1, i;
+	const uint8_t *p = &op->rx[1];
+
+	if (len < 12) {
+		if (!op->quiet)
+			fprintf(stderr, "Only %d bytes sent in the GET command, unknown bootloader\n", len);
+		return 0;
+	}
+	stm->bl_version = p[0];
+
+	/* the list is in no particular order, and newer bootloaders add commands */
+	memset(stm->cmd, STM32_CMD_NONE, sizeof(stm32_cmd_t));
+	stm->cmd->count = len - 1;
+	memcpy(stm->cmd->list, &p[1], len - 1);
+	for(i = 1; i < len; i++) {
+		switch(p[i]) {
+			case 0x00: stm->cmd->get = p[i]; break;
+			case 0x01: stm->cmd->gvr = p[i]; break;
+			case 0x02: stm->cmd->gid = p[i]; break;
+			case 0x11: stm->cmd->rm  = p[i]; break;
+			case 0x21: stm->cmd->go  = p[i]; break;
+			case 0x31: stm->cmd->wm  = p[i]; break;
+			case 0x43:
+			case 0x44: stm->cmd->er  = p[i]; break;
+			case 0x63: stm->cmd->wp  = p[i]; break;
+			case 0x73: stm->cmd->uw  = p[i]; break;
+			case 0x82: stm->cmd->rp  = p[i]; break;
+			case 0x92: stm->cmd->ur  = p[i]; break;
+			case 0xA1: stm->cmd->crc = p[i]; break;
+			default:
+				if (!op->quiet)
+					fprintf(stderr, "Unknown command 0x%02x in the GET list, not used\n", p[i]);
+		}
+	}
+	if (stm->cmd->gvr == STM32_CMD_NONE || stm->cmd->gid == STM32_CMD_NONE) {
+		if (!op->quiet)
+			fprintf(stderr, "The GET list has no Get Version or Get ID command, unknown bootloader\n");
+		return 0;
+	}
+
+	/* get the version and read protection status */
+	op_command(op, stm->cmd->gvr, 1);
+	op_recv(op, op->rx, 3);
+	op_ack(op, 1, STM32_ACK_TIMEOUT);
+	op_call(op, op_init_gvr);
+	return 1;
+}
+
+char op_init_gvr(stm32_op_t *op) {
+	stm32_t *stm = op->stm;
+
+	stm->version = op->rx[0];
+	stm->option1 = op->rx[1];
+	stm->option2 = op->rx[2];
+
+	/* get the device ID */
+	op_command(op, stm->cmd->gid, 1);
+	op_add(op, STEP_RECV_LEN);
+	op_ack(op, 1, STM32_ACK_TIMEOUT);
+	op_call(op, op_init_gid);
+	return 1;
+}
+
+char op_init_gid(stm32_op_t *op) {
+	stm32_t *stm = op->stm;
+	unsigned int len = op->rx[0] + 1, i;
+
+	if (len < 2) {
+		if (!op->quiet)
+			fprintf(stderr, "Only %d bytes sent in the PID, unknown/unsupported device\n", len);
+		return 0;
+	}
+	stm->pid = (op->rx[1] << 8) | op->rx[2];
+	if (len > 2 && !op->quiet) {
+		fprintf(stderr, "This bootloader returns %d extra bytes in PID:", len - 2);
+		for(i = 3; i <= len; i++)
+			fprintf(stderr, " %02x", op->rx[i]);
+		fprintf(stderr, "\n");
+	}
+
+	stm->dev = devices;
+	while(stm->dev->id != 0x00 && stm->dev->id != stm->pid)
+		++stm->dev;
+
+	if (!stm->dev->id) {
+		if (!op->quiet)
+			fprintf(stderr, "Unknown/unsupported device (Device ID: 0x%03x)\n", stm->pid);
+		return 0;
+	}
+	return 1;
+}
+
+stm32_op_t* stm32_op_read(stm32_t *stm, uint32_t address, uint8_t data[], unsigned int len) {
+	stm32_op_t *op = op_new(stm->serial, stm);
+	uint8_t frame[2 + 5 + 2];
+	assert(len > 0 && len < 257);
+
+	/* must be 32bit aligned */
+	assert(address % 4 == 0);
+
+	if (!op)
+		return NULL;
+
+	frame[0] = stm->cmd->rm;
+	frame[1] = stm->cmd->rm ^ 0xFF;
+	stm32_put_address(&frame[2], address);
+	frame[7] = len - 1;
+	frame[8] = frame[7] ^ 0xFF;
+
+	if (stm->deferred_ack) {
+		/* command, address and length in one burst, then all three ACKs */
+		op_send(op, frame, sizeof(frame));
+		op_ack(op, 3, STM32_ACK_TIMEOUT);
+		op->quiet = 1;
+	} else {
+		op_command(op, stm->cmd->rm, 0);
+		op_send(op, &frame[2], 5);
+		op_ack(op, 1, STM32_ACK_TIMEOUT);
+		op_send(op, &frame[7], 2);
+		op_ack(op, 1, STM32_ACK_TIMEOUT);
+	}
+	op_recv(op, data, len);
+	return op;
+}
+
+stm32_op_t* stm32_op_write(stm32_t *stm, uint32_t address, const uint8_t data[], unsigned int len) {
+	stm32_op_t *op = op_new(stm->serial, stm);
+	/* command, address, length byte, up to 256 data bytes, up to 3 padding bytes, checksum */
+	uint8_t buf[2 + 5 + 1 + 256 + 3 + 1];
+	uint8_t *frame = &buf[2 + 5];
+	unsigned int flen;
+	int extra;
+	assert(len > 0 && len < 257);
+
+	/* must be 32bit aligned */
+	assert(address % 4 == 0);
+
+	if (!op)
+		return NULL;
+
+	/* the length must be word aligned, pad the data with 0xFF */
+	extra = len % 4;
+	if(extra) extra = 4 - extra;
+
+	/* length byte, data and padding, then the checksum of all of them */
+	flen = 0;
+	frame[flen++] = len + extra - 1;
+	memcpy(&frame[flen], data, len);
+	flen += len;
+	memset(&frame[flen], 0xFF, extra);
+	flen += extra;
+	frame[flen] = stm32_xor_cs(0, frame, flen);
+	flen++;
+
+	buf[0] = stm->cmd->wm;
+	buf[1] = stm->cmd->wm ^ 0xFF;
+	stm32_put_address(&buf[2], address);
+
+	if (stm->deferred_ack) {
+		/* command, address and data in one burst, then all three ACKs */
+		op_send(op, buf, 2 + 5 + flen);
+		op_ack(op, 3, STM32_ACK_TIMEOUT);
+		op->quiet = 1;
+	} else {
+		op_command(op, stm->cmd->wm, 0);
+		op_send(op, &buf[2], 5);
+		op_ack(op, 1, STM32_ACK_TIMEOUT);
+		op_send(op, frame, flen);
+		op_ack(op, 1, STM32_ACK_TIMEOUT);
+	}
+	return op;
+}
+
+/* Get Checksum: address, byte count (a multiple of 4), polynomial and
+ * initial value, each 4 bytes MSB first with an XOR checksum and ACKed.
+ * Then the target ACKs once more and sends the CRC the same way, into
+ * reply[]. The words are taken as the CRC unit does, see crc32_unit().
+ */
+stm32_op_t* stm32_op_crc(stm32_t *stm, uint32_t address, uint32_t len, uint8_t reply[5]) {
+	stm32_op_t *op = op_new(stm->serial, stm);
+	uint8_t frame[5];
+
+	if (!op)
+		return NULL;
+	op_command(op, stm->cmd->crc, 0);
+	stm32_put_address(frame, address);
+	op_send(op, frame, sizeof(frame));
+	op_ack(op, 1, STM32_ACK_TIMEOUT);
+	stm32_put_address(frame, len);
+	op_send(op, frame, sizeof(frame));
+	op_ack(op, 1, STM32_ACK_TIMEOUT);
+	stm32_put_address(frame, STM32_CRC_POLY);
+	op_send(op, frame, sizeof(frame));
+	op_ack(op, 1, STM32_ACK_TIMEOUT);
+	stm32_put_address(frame, STM32_CRC_INIT);
+	op_send(op, frame, sizeof(frame));
+	op_ack(op, 1, STM32_ACK_TIMEOUT);
+	op_ack(op, 1, STM32_ACK_TIMEOUT + len / 1024 * STM32_CRC_KIB_US / 1000);
+	op_recv(op, reply, 5);
+	return op;
+}
+
+stm32_op_t* stm32_op_erase(stm32_t *stm, uint16_t spage, uint16_t pages) {
+	stm32_op_t *op = op_new(stm->serial, stm);
+	unsigned int pg_num;
+	uint16_t *list;
+	step_t *s;
+
+	if (!op || !pages)
+		return op;
+
+	op_command(op, stm->cmd->er, 0);
+	op->steps[op->n_steps - 1].fail = "Can't initiate chip erase!";
+
+	/* The erase command reported by the bootloader is either 0x43 or 0x44 */
+	/* 0x44 is Extended Erase, a 2 byte based protocol and needs to be handled differently. */
+	if (stm->cmd->er == STM32_CMD_EE) {
+ 		/* Not all chips using Extended Erase support mass erase */
+ 		/* Currently known as not supporting mass erase is the Ultra Low Power STM32L15xx range */
+ 		/* So if someone has not overridden the default, but uses one of these chips, take it out of */
+ 		/* mass erase mode, so it will be done page by page. This maximum might not be correct either! */
+		if (stm->pid == 0x416 && pages == 0xFFFF)
+		{
+			spage = 0;
+			pages = stm32_page_of(stm->dev, stm->fl_end - 1) + 1; /* works for the STM32L152RB with 128Kb flash */
+		}
+
+		if (pages == 0xFFFF) {
+			/* 0xFFFF the magic number for mass erase, 0x00 the XOR of those two bytes as a checksum */
+			static const uint8_t mass_erase[] = {0xFF, 0xFF, 0x00};
+			op_send(op, mass_erase, sizeof(mass_erase));
+			s = op_ack(op, 1, STM32_ACK_TIMEOUT + stm->dev->fl_met);
+			s->fail = "Mass erase failed. Try specifying the number of pages to be erased.";
+			return op;
+		}
+	} else if (pages == 0xFFFF) {
+		/* And now the regular erase (0x43) for all other chips */
+		static const uint8_t mass_erase[] = {0xFF, 0x00};
+		op_send(op, mass_erase, sizeof(mass_erase));
+		op_ack(op, 1, STM32_ACK_TIMEOUT + stm->dev->fl_met);
+		return op;
+	}
+
+	list = malloc(pages * sizeof(uint16_t));
+	if (!list) {
+		fprintf(stderr, "Failed to allocate erase frame\n");
+		stm32_op_free(op);
+		return NULL;
+	}
+	for (pg_num = 0; pg_num < pages; pg_num++)
+		list[pg_num] = spage + pg_num;
+	if (!op_erase_list(op, list, pages)) {
+		stm32_op_free(op);
+		op = NULL;
+	}
+	free(list);
+	return op;
+}
+
+/* erase of the pages in list[], the command is queued already */
+char op_erase_list(stm32_op_t *op, const uint16_t list[], unsigned int count) {
+	stm32_t *stm = op->stm;
+	unsigned int flen = 0, i;
+	uint8_t *frame;
+	step_t *s;
+
+	if (stm->cmd->er != STM32_CMD_EE) {
+		for (i = 0; i < count && list[i] < 256; i++);
+		if (count > 256 || i < count) {
+			fprintf(stderr, "Regular erase can't address pages above 255\n");
+			return 0;
+		}
+	}
+
+	frame = malloc(2 + 2 * count + 1);
+	if (!frame) {
+		fprintf(stderr, "Failed to allocate erase frame\n");
+		return 0;
+	}
+	if (stm->cmd->er == STM32_CMD_EE) {
+		/* Number of pages to be erased and the page numbers, two bytes each, MSB first */
+		frame[flen++] = (count-1) >> 8;
+		frame[flen++] = (count-1) & 0xFF;
+		for (i = 0; i < count; i++) {
+			frame[flen++] = list[i] >> 8;
+			frame[flen++] = list[i] & 0xFF;
+		}
+	} else {
+		frame[flen++] = count-1;
+		for (i = 0; i < count; i++)
+			frame[flen++] = list[i];
+	}
+	frame[flen] = stm32_xor_cs(0, frame, flen);
+	flen++;
+
+	op_send(op, frame, flen);
+	free(frame);
+
+	s = op_ack(op, 1, STM32_ACK_TIMEOUT + count * stm->dev->fl_pet);
+	if (stm->cmd->er == STM32_CMD_EE)
+		s->fail = "Page-by-page erase failed. Check the maximum pages your device supports.";
+	return 1;
+}
+
+/* one erase command for the pages in list[], at most STM32_ERASE_BATCH */
+stm32_op_t* stm32_op_erase_list(stm32_t *stm, const uint16_t list[], unsigned int count) {
+	stm32_op_t *op = op_new(stm->serial, stm);
+
+	if (!op || !count)
+		return op;
+
+	op_command(op, stm->cmd->er, 0);
+	op->steps[op->n_steps - 1].fail = "Can't initiate chip erase!";
+	if (!op_erase_list(op, list, count)) {
+		stm32_op_free(op);
+		return NULL;
+	}
+	return op;
+}
+
+stm32_op_t* stm32_op_go(stm32_t *stm, uint32_t address) {
+	stm32_op_t *op = op_new(stm->serial, stm);
+	uint8_t frame[5];
+
+	if (!op)
+		return NULL;
+	stm32_put_address(frame, address);
+	op_command(op, stm->cmd->go, 0);
+	op_send(op, frame, sizeof(frame));
+	op_ack(op, 1, STM32_ACK_TIMEOUT);
+	return op;
+}
+
+/* Commands which ACK the command and ACK again once done (write unprotect,
+ * read protect and unprotect). timeout - extra ms the target may work.
+ */
+stm32_op_t* stm32_op_confirm(stm32_t *stm, uint8_t cmd, unsigned int timeout, const char *what) {
+	stm32_op_t *op = op_new(stm->serial, stm);
+
+	if (!op)
+		return NULL;
+	op_command(op, cmd, 0);
+	op_ack(op, 1, STM32_ACK_TIMEOUT + timeout)->what = what;
+	return op;
+}
+
+/* Bring the bootloader back to waiting for a command after a broken exchange.
+ * A lone 0xFF can't complete any frame with a valid checksum, so feed them one
+ * by one until the target NACKs, whatever state it was left in.
+ */
+stm32_op_t* stm32_op_resync(stm32_t *stm) {
+	stm32_op_t *op = op_new(stm->serial, stm);
+	step_t *s;
+
+	if (!op)
+		return NULL;
+	op->quiet = 1;
+	s = op_add(op, STEP_RESYNC);
+	s->tries   = STM32_RESYNC_TRIES;
+	s->timeout = stm->rtt / 500 + 10;
+
+	/* drop a late reply to the broken exchange too */
+	op_add(op, STEP_DRAIN)->timeout = stm->rtt / 500 + 10;
+	return op;
+}
@@ -0,0 +1,68 @@
+/*
+  stmflasher - Open Source ST MCU flash program for *nix
+  Copyright (C) 2010 Geoffrey McRae <geoff@spacevs.com>
+  Copyright (C) 2011 Steve Markgraf <steve@steve-m.de>
+  Copyright (C) 2012 Tormod Volden
+  Copyright (C) 2012-2013 Alatar <alatar_@list.ru>
+
+  This program is free software; you can redistribute it and/or
+  modify it under the terms of the GNU General Public License
+  as published by the Free Software Foundation; either version 2
+  of the License, or (at your option) any later version.
+
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with this program; if not, write to the Free Software
+  Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+*/
+
+
+#ifndef _STM32_OP_H
+#define _STM32_OP_H
+
+#include <stdint.h>
+#include "serial.h"
+#include "stm32.h"
+
+/* Resumable bootloader operations. Creating an operation only queues its
+ * steps; stm32_op_poll() advances it as far as the input allows and returns
+ * when it has to wait, so one thread can drive many ports. The blocking
+ * stm32_*() calls run one operation until it finishes.
+ */
+
+#define STM32_OP_FOREVER	((unsigned int)-1)	/* wait until the operation ends */
+
+typedef struct stm32_op stm32_op_t;
+
+typedef enum {
+	STM32_OP_RUNNING,
+	STM32_OP_DONE,
+	STM32_OP_FAILED
+} stm32_op_state_t;
+
+stm32_op_t* stm32_op_probe  (serial_t *serial, unsigned int tries);
+stm32_op_t* stm32_op_init   (stm32_t *stm, const char init);
+stm32_op_t* stm32_op_read   (stm32_t *stm, uint32_t address, uint8_t data[], unsigned int len);
+stm32_op_t* stm32_op_write  (stm32_t *stm, uint32_t address, const uint8_t data[], unsigned int len);
+stm32_op_t* stm32_op_crc    (stm32_t *stm, uint32_t address, uint32_t len, uint8_t reply[5]);
+stm32_op_t* stm32_op_erase  (stm32_t *stm, uint16_t spage, uint16_t pages);
+stm32_op_t* stm32_op_erase_list(stm32_t *stm, const uint16_t list[], unsigned int count);
+stm32_op_t* stm32_op_go     (stm32_t *stm, uint32_t address);
+stm32_op_t* stm32_op_confirm(stm32_t *stm, uint8_t cmd, unsigned int timeout, const char *what);
+stm32_op_t* stm32_op_resync (stm32_t *stm);
+
+stm32_op_state_t stm32_op_poll    (stm32_op_t *op, unsigned int wait);
+stm32_op_state_t stm32_op_state   (const stm32_op_t *op);
+uint64_t         stm32_op_deadline(const stm32_op_t *op);
+int              stm32_op_fd      (const stm32_op_t *op);
+void             stm32_op_quiet   (stm32_op_t *op);
+void             stm32_op_free    (stm32_op_t *op);
+
+stm32_op_state_t stm32_op_run    (stm32_op_t *op);
+unsigned int     stm32_op_run_all(stm32_op_t **ops, unsigned int n);
+
+#endif
@@ -21,6 +21,12 @@
 */
 
 
+#ifdef __WIN32__
+#include <windows.h>
+#else
+#include <time.h>
+#endif
+
 #include "utils.h"
 
 /* detect CPU endian */
@@ -46,3 +52,56 @@ uint32_t le_u32(const uint32_t v) {
                         ((v & 0x000000FF) << 24);
         return v;
 }
+
+/* monotonic time in microseconds */
+uint64_t now_us() {
+#ifdef __WIN32__
+	LARGE_INTEGER freq, cnt;
+	QueryPerformanceFrequency(&freq);
+	QueryPerformanceCounter(&cnt);
+	return (uint64_t)cnt.QuadPart * 1000000 / freq.QuadPart;
+#else
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+#endif
+}
+
+void sleep_us(uint64_t us) {
+#ifdef __WIN32__
+	Sleep((us + 999) / 1000);
+#else
+	struct timespec ts;
+	ts.tv_sec  = us / 1000000;
+	ts.tv_nsec = (us % 1000000) * 1000;
+	nanosleep(&ts, NULL);
+#endif
+}
+
+/* CRC-32 (IEEE 802.3, as zlib), crc is 0 to start, the result to go on */
+uint32_t crc32_update(uint32_t crc, const uint8_t *data, unsigned int len) {
+	unsigned int i;
+
+	crc = ~crc;
+	while(len-- > 0) {
+		crc ^= *data++;
+		for(i = 0; i < 8; i++)
+			crc = (crc >> 1) ^ (crc & 1 ? 0xEDB88320 : 0);
+	}
+	return ~crc;
+}
+
+/* what the STM32 CRC unit gives after a reset and len / 4 LE words:
+ * polynomial 0x04C11DB7, MSB first, no final inversion
+ */
+uint32_t crc32_unit(const uint8_t *data, unsigned int len) {
+	uint32_t crc = 0xFFFFFFFF;
+	unsigned int i;
+
+	for(; len >= 4; len -= 4, data += 4) {
+		crc ^= data[0] | (data[1] << 8) | (data[2] << 16) | ((uint32_t)data[3] << 24);
+		for(i = 0; i < 32; i++)
+			crc = (crc << 1) ^ (crc & 0x80000000 ? 0x04C11DB7 : 0);
+	}
+	return crc;
+}
@@ -29,5 +29,9 @@
 char     cpu_le();
 uint32_t be_u32(const uint32_t v);
 uint32_t le_u32(const uint32_t v);
+uint64_t now_us();
+void     sleep_us(uint64_t us);
+uint32_t crc32_update(uint32_t crc, const uint8_t *data, unsigned int len);
+uint32_t crc32_unit(const uint8_t *data, unsigned int len);
 
 #endif